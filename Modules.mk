@@ -19,11 +19,13 @@ dist_modules = $(both_modules)	# Modules to distribute
 openvswitch_sources = \
 	actions.c \
 	conntrack.c \
+	ct_frag.c \
 	datapath.c \
 	dp_notify.c \
 	flow.c \
 	flow_netlink.c \
 	flow_table.c \
+	upcall_ring.c \
 	vport.c \
 	vport-internal_dev.c \
 	vport-netdev.c \
@@ -43,10 +45,12 @@ vport_stt_sources = vport-stt.c
 openvswitch_headers = \
 	compat.h \
 	conntrack.h \
+	ct_frag.h \
 	datapath.h \
 	flow.h \
 	flow_netlink.h \
 	flow_table.h \
+	upcall_ring.h \
 	vport.h \
 	vport-internal_dev.h \
 	vport-netdev.h \
@@ -29,6 +29,7 @@
 #include <linux/in6.h>
 #include <linux/if_arp.h>
 #include <linux/if_vlan.h>
+#include <linux/vmalloc.h>
 
 #include <net/dst.h>
 #include <net/ip.h>
@@ -45,12 +46,14 @@
 
 static int do_execute_actions(struct datapath *dp, struct sk_buff *skb,
 			      struct sw_flow_key *key,
-			      const struct nlattr *attr, int len);
+			      const struct sw_flow_prog *prog);
 
 struct deferred_action {
 	struct sk_buff *skb;
-	const struct nlattr *actions;
-	int actions_len;
+	const struct sw_flow_prog *actions;
+
+	/* Flow that recirculated, see ovs_dp_recirc_from. */
+	const struct sw_flow *recirc_from;
 
 	/* Store pkt_key clone when creating deferred action. */
 	struct sw_flow_key pkt_key;
@@ -72,14 +75,20 @@ struct ovs_frag_data {
 
 static DEFINE_PER_CPU(struct ovs_frag_data, ovs_frag_data_storage);
 
-#define DEFERRED_ACTION_FIFO_SIZE 10
 #define OVS_RECURSION_LIMIT 4
 #define OVS_DEFERRED_ACTION_THRESHOLD (OVS_RECURSION_LIMIT - 2)
+struct action_fifo_storage {
+	unsigned int size;
+	struct deferred_action fifo[];
+};
+
 struct action_fifo {
 	int head;
 	int tail;
 	/* Deferred action fifo queue storage. */
-	struct deferred_action fifo[DEFERRED_ACTION_FIFO_SIZE];
+	struct action_fifo_storage *storage;
+	/* Larger storage to switch to once the queue is empty. */
+	struct action_fifo_storage *next;
 };
 
 struct action_flow_keys {
@@ -90,6 +99,11 @@ static struct action_fifo __percpu *action_fifos;
 static struct action_flow_keys __percpu *flow_keys;
 static DEFINE_PER_CPU(int, exec_actions_level);
 
+/* Size of the per-CPU action FIFOs, the largest limit of any datapath.
+ * Protected by ovs_mutex.
+ */
+static unsigned int action_fifo_size = DP_DEFERRED_LIMIT_DEFAULT;
+
 /* Make a clone of the 'key', using the pre-allocated percpu 'flow_keys'
  * space. Return NULL if out of key spaces.
  */
@@ -123,32 +137,83 @@ static struct deferred_action *action_fifo_get(struct action_fifo *fifo)
 	if (action_fifo_is_empty(fifo))
 		return NULL;
 
-	return &fifo->fifo[fifo->tail++];
+	return &fifo->storage->fifo[fifo->tail++];
 }
 
-static struct deferred_action *action_fifo_put(struct action_fifo *fifo)
+static struct deferred_action *action_fifo_put(struct action_fifo *fifo,
+					       unsigned int limit)
 {
-	if (fifo->head >= DEFERRED_ACTION_FIFO_SIZE - 1)
+	if (fifo->head >= min(limit, fifo->storage->size))
 		return NULL;
 
-	return &fifo->fifo[fifo->head++];
+	return &fifo->storage->fifo[fifo->head++];
+}
+
+static struct action_fifo_storage *action_fifo_storage_alloc(unsigned int size,
+							      int node)
+{
+	struct action_fifo_storage *storage;
+	size_t len;
+
+	len = sizeof(*storage) + size * sizeof(struct deferred_action);
+	storage = kmalloc_node(len, GFP_KERNEL | __GFP_NOWARN, node);
+	if (!storage)
+		storage = vmalloc_node(len, node);
+	if (storage)
+		storage->size = size;
+
+	return storage;
+}
+
+static void action_fifo_storage_free(struct action_fifo_storage *storage)
+{
+	if (is_vmalloc_addr(storage))
+		vfree(storage);
+	else
+		kfree(storage);
+}
+
+/* Switches an empty 'fifo' to the larger storage that
+ * ovs_deferred_actions_reserve() left for it.
+ */
+static void action_fifo_grow(struct action_fifo *fifo)
+{
+	struct action_fifo_storage *next = xchg(&fifo->next, NULL);
+
+	if (next) {
+		action_fifo_storage_free(fifo->storage);
+		fifo->storage = next;
+	}
 }
 
 /* Return queue entry if fifo is not full */
-static struct deferred_action *add_deferred_actions(struct sk_buff *skb,
+static struct deferred_action *add_deferred_actions(struct datapath *dp,
+				    struct sk_buff *skb,
 				    const struct sw_flow_key *key,
-				    const struct nlattr *actions,
-				    const int actions_len)
+				    const struct sw_flow_prog *actions)
 {
+	struct dp_stats_percpu *stats = this_cpu_ptr(dp->stats_percpu);
 	struct action_fifo *fifo;
 	struct deferred_action *da;
 
 	fifo = this_cpu_ptr(action_fifos);
-	da = action_fifo_put(fifo);
+	da = action_fifo_put(fifo, READ_ONCE(dp->deferred_limit));
+
+	u64_stats_update_begin(&stats->syncp);
+	if (da) {
+		stats->n_deferred++;
+		if (fifo->head > stats->deferred_depth_max)
+			stats->deferred_depth_max = fifo->head;
+	} else {
+		stats->n_deferred_dropped++;
+	}
+	u64_stats_update_end(&stats->syncp);
+
 	if (da) {
 		da->skb = skb;
 		da->actions = actions;
-		da->actions_len = actions_len;
+		da->recirc_from = actions ? NULL :
+				  __this_cpu_read(ovs_dp_recirc_from);
 		da->pkt_key = *key;
 	}
 
@@ -168,7 +233,7 @@ static bool is_flow_key_valid(const struct sw_flow_key *key)
 static int clone_execute(struct datapath *dp, struct sk_buff *skb,
 			 struct sw_flow_key *key,
 			 u32 recirc_id,
-			 const struct nlattr *actions, int len,
+			 const struct sw_flow_prog *actions,
 			 bool last, bool clone_flow_key);
 
 static void update_ethertype(struct sk_buff *skb, struct ethhdr *hdr,
@@ -385,8 +450,41 @@ static int push_eth(struct sk_buff *skb, struct sw_flow_key *key,
 	return 0;
 }
 
+/* Adds the change of a field from 'from' to 'to' to the checksum delta
+ * 'delta', so that several field changes can be folded into a checksum at
+ * once.
+ */
+static __wsum csum_delta4(__wsum delta, __be32 from, __be32 to)
+{
+	return csum_add(csum_sub(delta, (__force __wsum)from),
+			(__force __wsum)to);
+}
+
+static __wsum csum_delta2(__wsum delta, __be16 from, __be16 to)
+{
+	return csum_delta4(delta, (__force __be32)(__force u16)from,
+			   (__force __be32)(__force u16)to);
+}
+
+/* Folds into L4 checksum '*sum' a change 'pseudo' to the pseudo-header and a
+ * change 'data' to the L4 header itself.  A partial checksum only covers the
+ * pseudo-header; a complete skb->csum only sees the checksum field move.
+ */
+static void l4_csum_update(struct sk_buff *skb, __sum16 *sum,
+			   __wsum pseudo, __wsum data)
+{
+	if (skb->ip_summed != CHECKSUM_PARTIAL) {
+		*sum = csum_fold(csum_add(~csum_unfold(*sum),
+					  csum_add(pseudo, data)));
+		if (skb->ip_summed == CHECKSUM_COMPLETE)
+			skb->csum = ~csum_add(~skb->csum, pseudo);
+	} else {
+		*sum = ~csum_fold(csum_add(csum_unfold(*sum), pseudo));
+	}
+}
+
 static void update_ip_l4_checksum(struct sk_buff *skb, struct iphdr *nh,
-				  __be32 addr, __be32 new_addr)
+				  __wsum pseudo, __wsum data)
 {
 	int transport_len = skb->len - skb_transport_offset(skb);
 
@@ -395,15 +493,13 @@ static void update_ip_l4_checksum(struct sk_buff *skb, struct iphdr *nh,
 
 	if (nh->protocol == IPPROTO_TCP) {
 		if (likely(transport_len >= sizeof(struct tcphdr)))
-			inet_proto_csum_replace4(&tcp_hdr(skb)->check, skb,
-						 addr, new_addr, true);
+			l4_csum_update(skb, &tcp_hdr(skb)->check, pseudo, data);
 	} else if (nh->protocol == IPPROTO_UDP) {
 		if (likely(transport_len >= sizeof(struct udphdr))) {
 			struct udphdr *uh = udp_hdr(skb);
 
 			if (uh->check || skb->ip_summed == CHECKSUM_PARTIAL) {
-				inet_proto_csum_replace4(&uh->check, skb,
-							 addr, new_addr, true);
+				l4_csum_update(skb, &uh->check, pseudo, data);
 				if (!uh->check)
 					uh->check = CSUM_MANGLED_0;
 			}
@@ -412,39 +508,28 @@ static void update_ip_l4_checksum(struct sk_buff *skb, struct iphdr *nh,
 
 }
 
-static void set_ip_addr(struct sk_buff *skb, struct iphdr *nh,
-			__be32 *addr, __be32 new_addr)
-{
-	update_ip_l4_checksum(skb, nh, *addr, new_addr);
-	csum_replace4(&nh->check, *addr, new_addr);
-	skb_clear_hash(skb);
-	*addr = new_addr;
-}
-
 static void update_ipv6_checksum(struct sk_buff *skb, u8 l4_proto,
-				 __be32 addr[4], const __be32 new_addr[4])
+				 __wsum pseudo, __wsum data)
 {
 	int transport_len = skb->len - skb_transport_offset(skb);
 
 	if (l4_proto == NEXTHDR_TCP) {
 		if (likely(transport_len >= sizeof(struct tcphdr)))
-			inet_proto_csum_replace16(&tcp_hdr(skb)->check, skb,
-						  addr, new_addr, true);
+			l4_csum_update(skb, &tcp_hdr(skb)->check, pseudo, data);
 	} else if (l4_proto == NEXTHDR_UDP) {
 		if (likely(transport_len >= sizeof(struct udphdr))) {
 			struct udphdr *uh = udp_hdr(skb);
 
 			if (uh->check || skb->ip_summed == CHECKSUM_PARTIAL) {
-				inet_proto_csum_replace16(&uh->check, skb,
-							  addr, new_addr, true);
+				l4_csum_update(skb, &uh->check, pseudo, data);
 				if (!uh->check)
 					uh->check = CSUM_MANGLED_0;
 			}
 		}
 	} else if (l4_proto == NEXTHDR_ICMP) {
 		if (likely(transport_len >= sizeof(struct icmp6hdr)))
-			inet_proto_csum_replace16(&icmp6_hdr(skb)->icmp6_cksum,
-						  skb, addr, new_addr, true);
+			l4_csum_update(skb, &icmp6_hdr(skb)->icmp6_cksum,
+				       pseudo, data);
 	}
 }
 
@@ -457,15 +542,16 @@ static void mask_ipv6_addr(const __be32 old[4], const __be32 addr[4],
 	masked[3] = OVS_MASKED(old[3], addr[3], mask[3]);
 }
 
-static void set_ipv6_addr(struct sk_buff *skb, u8 l4_proto,
-			  __be32 addr[4], const __be32 new_addr[4],
-			  bool recalculate_csum)
+static __wsum set_ipv6_addr(__wsum pseudo, __be32 addr[4],
+			    const __be32 new_addr[4])
 {
-	if (likely(recalculate_csum))
-		update_ipv6_checksum(skb, l4_proto, addr, new_addr);
+	int i;
+
+	for (i = 0; i < 4; i++)
+		pseudo = csum_delta4(pseudo, addr[i], new_addr[i]);
 
-	skb_clear_hash(skb);
 	memcpy(addr, new_addr, sizeof(__be32[4]));
+	return pseudo;
 }
 
 static void set_ipv6_fl(struct ipv6hdr *nh, u32 fl, u32 mask)
@@ -476,29 +562,17 @@ static void set_ipv6_fl(struct ipv6hdr *nh, u32 fl, u32 mask)
 	OVS_SET_MASKED(nh->flow_lbl[2], (u8)fl, (u8)mask);
 }
 
-static void set_ip_ttl(struct sk_buff *skb, struct iphdr *nh, u8 new_ttl,
-		       u8 mask)
-{
-	new_ttl = OVS_MASKED(nh->ttl, new_ttl, mask);
-
-	csum_replace2(&nh->check, htons(nh->ttl << 8), htons(new_ttl << 8));
-	nh->ttl = new_ttl;
-}
-
-static int set_ipv4(struct sk_buff *skb, struct sw_flow_key *flow_key,
-		    const struct ovs_key_ipv4 *key,
-		    const struct ovs_key_ipv4 *mask)
+/* Rewrites the fields of IPv4 header 'nh' and folds the change into its
+ * header checksum once.  Returns the change to the L4 pseudo-header, which
+ * the caller folds into the L4 checksum.
+ */
+static __wsum __set_ipv4(struct sk_buff *skb, struct sw_flow_key *flow_key,
+			 struct iphdr *nh, const struct ovs_key_ipv4 *key,
+			 const struct ovs_key_ipv4 *mask)
 {
-	struct iphdr *nh;
+	__wsum pseudo = 0, delta;
 	__be32 new_addr;
-	int err;
-
-	err = skb_ensure_writable(skb, skb_network_offset(skb) +
-				  sizeof(struct iphdr));
-	if (unlikely(err))
-		return err;
-
-	nh = ip_hdr(skb);
+	bool changed = false;
 
 	/* Setting an IP addresses is typically only a side effect of
 	 * matching on them in the current userspace implementation, so it
@@ -508,48 +582,78 @@ static int set_ipv4(struct sk_buff *skb, struct sw_flow_key *flow_key,
 		new_addr = OVS_MASKED(nh->saddr, key->ipv4_src, mask->ipv4_src);
 
 		if (unlikely(new_addr != nh->saddr)) {
-			set_ip_addr(skb, nh, &nh->saddr, new_addr);
+			pseudo = csum_delta4(pseudo, nh->saddr, new_addr);
+			nh->saddr = new_addr;
 			flow_key->ipv4.addr.src = new_addr;
+			changed = true;
 		}
 	}
 	if (mask->ipv4_dst) {
 		new_addr = OVS_MASKED(nh->daddr, key->ipv4_dst, mask->ipv4_dst);
 
 		if (unlikely(new_addr != nh->daddr)) {
-			set_ip_addr(skb, nh, &nh->daddr, new_addr);
+			pseudo = csum_delta4(pseudo, nh->daddr, new_addr);
+			nh->daddr = new_addr;
 			flow_key->ipv4.addr.dst = new_addr;
+			changed = true;
 		}
 	}
 	if (mask->ipv4_tos) {
 		ipv4_change_dsfield(nh, ~mask->ipv4_tos, key->ipv4_tos);
 		flow_key->ip.tos = nh->tos;
 	}
+
+	delta = pseudo;
 	if (mask->ipv4_ttl) {
-		set_ip_ttl(skb, nh, key->ipv4_ttl, mask->ipv4_ttl);
-		flow_key->ip.ttl = nh->ttl;
-	}
+		u8 new_ttl = OVS_MASKED(nh->ttl, key->ipv4_ttl, mask->ipv4_ttl);
 
-	return 0;
-}
+		delta = csum_delta2(delta, htons(nh->ttl << 8),
+				    htons(new_ttl << 8));
+		nh->ttl = new_ttl;
+		flow_key->ip.ttl = new_ttl;
+	}
+	if (delta)
+		nh->check = csum_fold(csum_add(~csum_unfold(nh->check), delta));
 
-static bool is_ipv6_mask_nonzero(const __be32 addr[4])
-{
-	return !!(addr[0] | addr[1] | addr[2] | addr[3]);
+	if (changed)
+		skb_clear_hash(skb);
+	return pseudo;
 }
 
-static int set_ipv6(struct sk_buff *skb, struct sw_flow_key *flow_key,
-		    const struct ovs_key_ipv6 *key,
-		    const struct ovs_key_ipv6 *mask)
+static int set_ipv4(struct sk_buff *skb, struct sw_flow_key *flow_key,
+		    const struct ovs_key_ipv4 *key,
+		    const struct ovs_key_ipv4 *mask)
 {
-	struct ipv6hdr *nh;
+	struct iphdr *nh;
+	__wsum pseudo;
 	int err;
 
 	err = skb_ensure_writable(skb, skb_network_offset(skb) +
-				  sizeof(struct ipv6hdr));
+				  sizeof(struct iphdr));
 	if (unlikely(err))
 		return err;
 
-	nh = ipv6_hdr(skb);
+	nh = ip_hdr(skb);
+	pseudo = __set_ipv4(skb, flow_key, nh, key, mask);
+	if (pseudo)
+		update_ip_l4_checksum(skb, nh, pseudo, 0);
+
+	return 0;
+}
+
+static bool is_ipv6_mask_nonzero(const __be32 addr[4])
+{
+	return !!(addr[0] | addr[1] | addr[2] | addr[3]);
+}
+
+/* Rewrites the fields of IPv6 header 'nh'.  Returns the change to the L4
+ * pseudo-header, which the caller folds into the L4 checksum.
+ */
+static __wsum __set_ipv6(struct sk_buff *skb, struct sw_flow_key *flow_key,
+			 struct ipv6hdr *nh, const struct ovs_key_ipv6 *key,
+			 const struct ovs_key_ipv6 *mask)
+{
+	__wsum pseudo = 0;
 
 	/* Setting an IP addresses is typically only a side effect of
 	 * matching on them in the current userspace implementation, so it
@@ -562,8 +666,8 @@ static int set_ipv6(struct sk_buff *skb, struct sw_flow_key *flow_key,
 		mask_ipv6_addr(saddr, key->ipv6_src, mask->ipv6_src, masked);
 
 		if (unlikely(memcmp(saddr, masked, sizeof(masked)))) {
-			set_ipv6_addr(skb, flow_key->ip.proto, saddr, masked,
-				      true);
+			pseudo = set_ipv6_addr(pseudo, saddr, masked);
+			skb_clear_hash(skb);
 			memcpy(&flow_key->ipv6.addr.src, masked,
 			       sizeof(flow_key->ipv6.addr.src));
 		}
@@ -584,8 +688,14 @@ static int set_ipv6(struct sk_buff *skb, struct sw_flow_key *flow_key,
 							     NULL, &flags)
 					       != NEXTHDR_ROUTING);
 
-			set_ipv6_addr(skb, flow_key->ip.proto, daddr, masked,
-				      recalc_csum);
+			/* With a routing header the final destination, not
+			 * this one, is in the pseudo-header.
+			 */
+			if (likely(recalc_csum))
+				pseudo = set_ipv6_addr(pseudo, daddr, masked);
+			else
+				memcpy(daddr, masked, sizeof(masked));
+			skb_clear_hash(skb);
 			memcpy(&flow_key->ipv6.addr.dst, masked,
 			       sizeof(flow_key->ipv6.addr.dst));
 		}
@@ -605,6 +715,25 @@ static int set_ipv6(struct sk_buff *skb, struct sw_flow_key *flow_key,
 			       mask->ipv6_hlimit);
 		flow_key->ip.ttl = nh->hop_limit;
 	}
+	return pseudo;
+}
+
+static int set_ipv6(struct sk_buff *skb, struct sw_flow_key *flow_key,
+		    const struct ovs_key_ipv6 *key,
+		    const struct ovs_key_ipv6 *mask)
+{
+	__wsum pseudo;
+	int err;
+
+	err = skb_ensure_writable(skb, skb_network_offset(skb) +
+				  sizeof(struct ipv6hdr));
+	if (unlikely(err))
+		return err;
+
+	pseudo = __set_ipv6(skb, flow_key, ipv6_hdr(skb), key, mask);
+	if (pseudo)
+		update_ipv6_checksum(skb, flow_key->ip.proto, pseudo, 0);
+
 	return 0;
 }
 
@@ -855,36 +984,81 @@ err:
 	kfree_skb(skb);
 }
 
+static void do_output_vport(struct datapath *dp, struct sk_buff *skb,
+			    struct vport *vport, struct sw_flow_key *key)
+{
+	u16 mru = OVS_CB(skb)->mru;
+	u32 cutlen = OVS_CB(skb)->cutlen;
+
+	if (unlikely(cutlen > 0)) {
+		if (skb->len - cutlen > ovs_mac_header_len(key))
+			pskb_trim(skb, skb->len - cutlen);
+		else
+			pskb_trim(skb, ovs_mac_header_len(key));
+	}
+
+	if (likely(!mru ||
+		   (skb->len <= mru + vport->dev->hard_header_len))) {
+		ovs_vport_send(vport, skb, ovs_key_mac_proto(key));
+	} else if (mru <= vport->dev->mtu) {
+		struct net *net = ovs_dp_get_net(dp);
+
+		ovs_fragment(net, vport, skb, mru, key);
+	} else {
+		OVS_NLERR(true, "Cannot fragment IP frames");
+		kfree_skb(skb);
+	}
+}
+
 static void do_output(struct datapath *dp, struct sk_buff *skb, int out_port,
 		      struct sw_flow_key *key)
 {
 	struct vport *vport = ovs_vport_rcu(dp, out_port);
 
-	if (likely(vport)) {
-		u16 mru = OVS_CB(skb)->mru;
-		u32 cutlen = OVS_CB(skb)->cutlen;
+	if (likely(vport))
+		do_output_vport(dp, skb, vport, key);
+	else
+		kfree_skb(skb);
+}
 
-		if (unlikely(cutlen > 0)) {
-			if (skb->len - cutlen > ovs_mac_header_len(key))
-				pskb_trim(skb, skb->len - cutlen);
-			else
-				pskb_trim(skb, ovs_mac_header_len(key));
+/* Replicates 'skb' to the ports of the run of output actions starting at
+ * 'run'.  The ports are resolved first, so that ports missing from the
+ * datapath cost no copy and the last present port can take 'skb' itself when
+ * 'consume' is true.  The other ports get clones that share the packet data.
+ * Returns true if 'skb' was consumed.
+ */
+static bool do_output_run(struct datapath *dp, struct sk_buff *skb,
+			  struct sw_flow_key *key,
+			  const struct sw_flow_action_op *run, bool consume)
+{
+	struct vport *ports[OUTPUT_RUN_MAX];
+	int i, n_ports = 0;
+
+	for (i = 0; i < run->run; i++) {
+		struct vport *vport = ovs_vport_rcu(dp, run[i].port);
+
+		if (likely(vport)) {
+			prefetch(vport->dev);
+			ports[n_ports++] = vport;
 		}
+	}
 
-		if (likely(!mru ||
-		           (skb->len <= mru + vport->dev->hard_header_len))) {
-			ovs_vport_send(vport, skb, ovs_key_mac_proto(key));
-		} else if (mru <= vport->dev->mtu) {
-			struct net *net = ovs_dp_get_net(dp);
+	for (i = 0; i < n_ports; i++) {
+		struct sk_buff *clone;
 
-                        ovs_fragment(net, vport, skb, mru, key);
-		} else {
-			OVS_NLERR(true, "Cannot fragment IP frames");
-			kfree_skb(skb);
+		if (consume && i == n_ports - 1) {
+			do_output_vport(dp, skb, ports[i], key);
+			return true;
 		}
-	} else {
-		kfree_skb(skb);
+
+		clone = skb_clone(skb, GFP_ATOMIC);
+		if (clone)
+			do_output_vport(dp, clone, ports[i], key);
 	}
+
+	if (consume)
+		kfree_skb(skb);
+	return consume;
 }
 
 static int output_userspace(struct datapath *dp, struct sk_buff *skb,
@@ -946,19 +1120,14 @@ static int output_userspace(struct datapath *dp, struct sk_buff *skb,
  * actions are executed within sample().
  */
 static int sample(struct datapath *dp, struct sk_buff *skb,
-		  struct sw_flow_key *key, const struct nlattr *attr,
+		  struct sw_flow_key *key, const struct sw_flow_action_op *op,
 		  bool last)
 {
-	struct nlattr *actions;
-	struct nlattr *sample_arg;
-	int rem = nla_len(attr);
 	const struct sample_arg *arg;
 	bool clone_flow_key;
 
 	/* The first action is always 'OVS_SAMPLE_ATTR_ARG'. */
-	sample_arg = nla_data(attr);
-	arg = nla_data(sample_arg);
-	actions = nla_next(sample_arg, &rem);
+	arg = nla_data(nla_data(op->attr));
 
 	if ((arg->probability != U32_MAX) &&
 	    (!arg->probability || prandom_u32() > arg->probability)) {
@@ -968,8 +1137,7 @@ static int sample(struct datapath *dp, struct sk_buff *skb,
 	}
 
 	clone_flow_key = !arg->exec;
-	return clone_execute(dp, skb, key, 0, actions, rem, last,
-			     clone_flow_key);
+	return clone_execute(dp, skb, key, 0, op->sub, last, clone_flow_key);
 }
 
 static void execute_hash(struct sk_buff *skb, struct sw_flow_key *key,
@@ -1078,6 +1246,70 @@ static int execute_masked_set_action(struct sk_buff *skb,
 	return err;
 }
 
+/* Applies the masked set of IPv4 or IPv6 fields 'l3' and the masked set of
+ * TCP or UDP ports 'l4' in one pass, folding the address and port changes
+ * into the L4 checksum once instead of once per field.
+ */
+static int set_l3_l4(struct sk_buff *skb, struct sw_flow_key *flow_key,
+		     const struct nlattr *l3, const struct nlattr *l4)
+{
+	/* TCP and UDP port keys share a layout. */
+	const struct ovs_key_tcp *ports = nla_data(l4);
+	const struct ovs_key_tcp *ports_mask =
+		get_mask(l4, struct ovs_key_tcp *);
+	bool is_tcp = nla_type(l4) == OVS_KEY_ATTR_TCP;
+	__be16 *sport, *dport, src, dst;
+	__wsum pseudo, data = 0;
+	int err;
+
+	BUILD_BUG_ON(sizeof(struct ovs_key_udp) != sizeof(struct ovs_key_tcp));
+
+	err = skb_ensure_writable(skb, skb_transport_offset(skb) +
+				  (is_tcp ? sizeof(struct tcphdr)
+					  : sizeof(struct udphdr)));
+	if (unlikely(err))
+		return err;
+
+	if (nla_type(l3) == OVS_KEY_ATTR_IPV4)
+		pseudo = __set_ipv4(skb, flow_key, ip_hdr(skb), nla_data(l3),
+				    get_mask(l3, struct ovs_key_ipv4 *));
+	else
+		pseudo = __set_ipv6(skb, flow_key, ipv6_hdr(skb), nla_data(l3),
+				    get_mask(l3, struct ovs_key_ipv6 *));
+
+	if (is_tcp) {
+		sport = &tcp_hdr(skb)->source;
+		dport = &tcp_hdr(skb)->dest;
+	} else {
+		sport = &udp_hdr(skb)->source;
+		dport = &udp_hdr(skb)->dest;
+	}
+
+	src = OVS_MASKED(*sport, ports->tcp_src, ports_mask->tcp_src);
+	if (likely(src != *sport)) {
+		data = csum_delta2(data, *sport, src);
+		*sport = src;
+		flow_key->tp.src = src;
+	}
+	dst = OVS_MASKED(*dport, ports->tcp_dst, ports_mask->tcp_dst);
+	if (likely(dst != *dport)) {
+		data = csum_delta2(data, *dport, dst);
+		*dport = dst;
+		flow_key->tp.dst = dst;
+	}
+
+	if (pseudo || data) {
+		if (nla_type(l3) == OVS_KEY_ATTR_IPV4)
+			update_ip_l4_checksum(skb, ip_hdr(skb), pseudo, data);
+		else
+			update_ipv6_checksum(skb, flow_key->ip.proto,
+					     pseudo, data);
+	}
+	skb_clear_hash(skb);
+
+	return 0;
+}
+
 static int execute_recirc(struct datapath *dp, struct sk_buff *skb,
 			  struct sw_flow_key *key,
 			  const struct nlattr *a, bool last)
@@ -1094,32 +1326,44 @@ static int execute_recirc(struct datapath *dp, struct sk_buff *skb,
 	BUG_ON(!is_flow_key_valid(key));
 
 	recirc_id = nla_get_u32(a);
-	return clone_execute(dp, skb, key, recirc_id, NULL, 0, last, true);
+	return clone_execute(dp, skb, key, recirc_id, NULL, last, true);
 }
 
-/* Execute a list of actions against 'skb'. */
+/* Execute a compiled list of actions against 'skb'. */
 static int do_execute_actions(struct datapath *dp, struct sk_buff *skb,
 			      struct sw_flow_key *key,
-			      const struct nlattr *attr, int len)
+			      const struct sw_flow_prog *prog)
 {
-	const struct nlattr *a;
-	int rem;
+	const struct sw_flow_action_op *op, *end = prog->ops + prog->n_ops;
 
-	for (a = attr, rem = len; rem > 0;
-	     a = nla_next(a, &rem)) {
+	for (op = prog->ops; op < end; op++) {
+		const struct nlattr *a = op->attr;
 		int err = 0;
 
-		switch (nla_type(a)) {
+		switch (op->type) {
 		case OVS_ACTION_ATTR_OUTPUT: {
-			int port = nla_get_u32(a);
 			struct sk_buff *clone;
 
+			/* Flood and multicast flows output to many ports in
+			 * a row.  Replicate to all of them at once, unless
+			 * the first output is truncated.
+			 */
+			if (op->run > 1 && !OVS_CB(skb)->cutlen) {
+				const struct sw_flow_action_op *run = op;
+
+				/* Leave 'op' on the last output of the run. */
+				op += run->run - 1;
+				if (do_output_run(dp, skb, key, run, op->last))
+					return 0;
+				break;
+			}
+
 			/* Every output action needs a separate clone
 			 * of 'skb', In case the output action is the
 			 * last action, cloning can be avoided.
 			 */
-			if (nla_is_last(a, rem)) {
-				do_output(dp, skb, port, key);
+			if (op->last) {
+				do_output(dp, skb, op->port, key);
 				/* 'skb' has been used for output.
 				 */
 				return 0;
@@ -1127,7 +1371,7 @@ static int do_execute_actions(struct datapath *dp, struct sk_buff *skb,
 
 			clone = skb_clone(skb, GFP_ATOMIC);
 			if (clone)
-				do_output(dp, clone, port, key);
+				do_output(dp, clone, op->port, key);
 			OVS_CB(skb)->cutlen = 0;
 			break;
 		}
@@ -1141,8 +1385,8 @@ static int do_execute_actions(struct datapath *dp, struct sk_buff *skb,
 		}
 
 		case OVS_ACTION_ATTR_USERSPACE:
-			output_userspace(dp, skb, key, a, attr,
-						     len, OVS_CB(skb)->cutlen);
+			output_userspace(dp, skb, key, a, prog->actions,
+					 prog->actions_len, OVS_CB(skb)->cutlen);
 			OVS_CB(skb)->cutlen = 0;
 			break;
 
@@ -1167,7 +1411,7 @@ static int do_execute_actions(struct datapath *dp, struct sk_buff *skb,
 			break;
 
 		case OVS_ACTION_ATTR_RECIRC: {
-			bool last = nla_is_last(a, rem);
+			bool last = op->last;
 
 			err = execute_recirc(dp, skb, key, a, last);
 			if (last) {
@@ -1186,13 +1430,18 @@ static int do_execute_actions(struct datapath *dp, struct sk_buff *skb,
 
 		case OVS_ACTION_ATTR_SET_MASKED:
 		case OVS_ACTION_ATTR_SET_TO_MASKED:
-			err = execute_masked_set_action(skb, key, nla_data(a));
+			/* An L4 set that directly follows is folded in. */
+			if (op->l4)
+				err = set_l3_l4(skb, key, nla_data(a), op->l4);
+			else
+				err = execute_masked_set_action(skb, key,
+								nla_data(a));
 			break;
 
 		case OVS_ACTION_ATTR_SAMPLE: {
-			bool last = nla_is_last(a, rem);
+			bool last = op->last;
 
-			err = sample(dp, skb, key, a, last);
+			err = sample(dp, skb, key, op, last);
 			if (last)
 				return err;
 
@@ -1241,7 +1490,7 @@ static int do_execute_actions(struct datapath *dp, struct sk_buff *skb,
  */
 static int clone_execute(struct datapath *dp, struct sk_buff *skb,
 			 struct sw_flow_key *key, u32 recirc_id,
-			 const struct nlattr *actions, int len,
+			 const struct sw_flow_prog *actions,
 			 bool last, bool clone_flow_key)
 {
 	struct deferred_action *da;
@@ -1268,20 +1517,20 @@ static int clone_execute(struct datapath *dp, struct sk_buff *skb,
 			if (clone_flow_key)
 				__this_cpu_inc(exec_actions_level);
 
-			err = do_execute_actions(dp, skb, clone,
-						 actions, len);
+			err = do_execute_actions(dp, skb, clone, actions);
 
 			if (clone_flow_key)
 				__this_cpu_dec(exec_actions_level);
 		} else { /* Recirc action */
 			clone->recirc_id = recirc_id;
-			ovs_dp_process_packet(skb, clone);
+			ovs_dp_process_recirc(skb, clone,
+					      __this_cpu_read(ovs_dp_recirc_from));
 		}
 		return err;
 	}
 
 	/* Out of 'flow_keys' space. Defer actions */
-	da = add_deferred_actions(skb, key, actions, len);
+	da = add_deferred_actions(dp, skb, key, actions);
 	if (da) {
 		if (!actions) { /* Recirc action */
 			key = &da->pkt_key;
@@ -1312,24 +1561,31 @@ static void process_deferred_actions(struct datapath *dp)
 
 	/* Do not touch the FIFO in case there is no deferred actions. */
 	if (action_fifo_is_empty(fifo))
-		return;
+		goto out;
+
+	/* The deferred actions belong to other flows than the one whose
+	 * actions are executing.
+	 */
+	__this_cpu_write(ovs_dp_recirc_from, NULL);
 
 	/* Finishing executing all deferred actions. */
 	do {
 		struct deferred_action *da = action_fifo_get(fifo);
 		struct sk_buff *skb = da->skb;
 		struct sw_flow_key *key = &da->pkt_key;
-		const struct nlattr *actions = da->actions;
-		int actions_len = da->actions_len;
+		const struct sw_flow_prog *actions = da->actions;
 
 		if (actions)
-			do_execute_actions(dp, skb, key, actions, actions_len);
+			do_execute_actions(dp, skb, key, actions);
 		else
-			ovs_dp_process_packet(skb, key);
+			ovs_dp_process_recirc(skb, key, da->recirc_from);
 	} while (!action_fifo_is_empty(fifo));
 
 	/* Reset FIFO for the next packet.  */
 	action_fifo_init(fifo);
+out:
+	if (unlikely(READ_ONCE(fifo->next)))
+		action_fifo_grow(fifo);
 }
 
 /* Execute a list of actions against 'skb'. */
@@ -1341,6 +1597,12 @@ int ovs_execute_actions(struct datapath *dp, struct sk_buff *skb,
 
 	level = __this_cpu_inc_return(exec_actions_level);
 	if (unlikely(level > OVS_RECURSION_LIMIT)) {
+		struct dp_stats_percpu *stats = this_cpu_ptr(dp->stats_percpu);
+
+		u64_stats_update_begin(&stats->syncp);
+		stats->n_recursion_dropped++;
+		u64_stats_update_end(&stats->syncp);
+
 		net_crit_ratelimited("ovs: recursion limit reached on datapath %s, probable configuration error\n",
 				     ovs_dp_name(dp));
 		kfree_skb(skb);
@@ -1348,8 +1610,7 @@ int ovs_execute_actions(struct datapath *dp, struct sk_buff *skb,
 		goto out;
 	}
 
-	err = do_execute_actions(dp, skb, key,
-				 acts->actions, acts->actions_len);
+	err = do_execute_actions(dp, skb, key, acts->prog);
 
 	if (level == 1)
 		process_deferred_actions(dp);
@@ -1359,23 +1620,83 @@ out:
 	return err;
 }
 
-int action_fifos_init(void)
+/* Grows the per-CPU action FIFOs to hold at least 'limit' deferred actions.
+ * Each CPU switches to its larger FIFO the next time its FIFO is empty.
+ *
+ * Must be called with ovs_mutex.
+ */
+int ovs_deferred_actions_reserve(unsigned int limit)
 {
-	action_fifos = alloc_percpu(struct action_fifo);
-	if (!action_fifos)
-		return -ENOMEM;
+	int cpu;
 
-	flow_keys = alloc_percpu(struct action_flow_keys);
-	if (!flow_keys) {
-		free_percpu(action_fifos);
-		return -ENOMEM;
+	ASSERT_OVSL();
+
+	if (limit <= action_fifo_size)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		struct action_fifo *fifo = per_cpu_ptr(action_fifos, cpu);
+		struct action_fifo_storage *storage;
+
+		storage = action_fifo_storage_alloc(limit, cpu_to_node(cpu));
+		if (!storage)
+			return -ENOMEM;
+
+		/* Not yet picked up by the CPU, so nothing uses it. */
+		storage = xchg(&fifo->next, storage);
+		if (storage)
+			action_fifo_storage_free(storage);
 	}
+	action_fifo_size = limit;
 
 	return 0;
 }
 
 void action_fifos_exit(void)
 {
+	int cpu;
+
+	if (action_fifos) {
+		for_each_possible_cpu(cpu) {
+			struct action_fifo *fifo = per_cpu_ptr(action_fifos,
+							       cpu);
+
+			if (fifo->storage)
+				action_fifo_storage_free(fifo->storage);
+			if (fifo->next)
+				action_fifo_storage_free(fifo->next);
+		}
+	}
 	free_percpu(action_fifos);
 	free_percpu(flow_keys);
 }
+
+int action_fifos_init(void)
+{
+	int cpu;
+
+	action_fifos = alloc_percpu(struct action_fifo);
+	if (!action_fifos)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct action_fifo *fifo = per_cpu_ptr(action_fifos, cpu);
+
+		fifo->storage = action_fifo_storage_alloc(action_fifo_size,
+							  cpu_to_node(cpu));
+		if (!fifo->storage)
+			goto error;
+	}
+
+	flow_keys = alloc_percpu(struct action_flow_keys);
+	if (!flow_keys)
+		goto error;
+
+	return 0;
+
+error:
+	action_fifos_exit();
+	action_fifos = NULL;
+	flow_keys = NULL;
+	return -ENOMEM;
+}
@@ -16,12 +16,19 @@
 
 #if IS_ENABLED(CONFIG_NF_CONNTRACK)
 
+#include <linux/hash.h>
+#include <linux/llist.h>
 #include <linux/module.h>
+#include <linux/netfilter_ipv4.h>
 #include <linux/openvswitch.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/sctp.h>
 #include <net/ip.h>
+#include <net/genetlink.h>
+#include <net/ipv6.h>
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_helper.h>
 #include <net/netfilter/nf_conntrack_labels.h>
@@ -37,6 +44,7 @@
 
 #include "datapath.h"
 #include "conntrack.h"
+#include "ct_frag.h"
 #include "flow.h"
 #include "flow_netlink.h"
 #include "gso.h"
@@ -313,8 +321,12 @@ int ovs_ct_put_key(const struct sw_flow_key *swkey,
 	return 0;
 }
 
+/* The functions that change a connection below add the conntrack events
+ * they cause to '*events', a mask of 1 << IPCT_*, for the caller to queue
+ * with ovs_ct_queue_events().
+ */
 static int ovs_ct_set_mark(struct nf_conn *ct, struct sw_flow_key *key,
-			   u32 ct_mark, u32 mask)
+			   u32 ct_mark, u32 mask, unsigned long *events)
 {
 #if IS_ENABLED(CONFIG_NF_CONNTRACK_MARK)
 	u32 new_mark;
@@ -323,7 +335,7 @@ static int ovs_ct_set_mark(struct nf_conn *ct, struct sw_flow_key *key,
 	if (ct->mark != new_mark) {
 		ct->mark = new_mark;
 		if (nf_ct_is_confirmed(ct))
-			nf_conntrack_event_cache(IPCT_MARK, ct);
+			*events |= 1UL << IPCT_MARK;
 		key->ct.mark = new_mark;
 	}
 
@@ -352,7 +364,8 @@ static struct nf_conn_labels *ovs_ct_get_conn_labels(struct nf_conn *ct)
  */
 static int ovs_ct_init_labels(struct nf_conn *ct, struct sw_flow_key *key,
 			      const struct ovs_key_ct_labels *labels,
-			      const struct ovs_key_ct_labels *mask)
+			      const struct ovs_key_ct_labels *mask,
+			      unsigned long *events)
 {
 	struct nf_conn_labels *cl, *master_cl;
 	bool have_mask = labels_nonzero(mask);
@@ -387,35 +400,67 @@ static int ovs_ct_init_labels(struct nf_conn *ct, struct sw_flow_key *key,
 	/* Labels are included in the IPCTNL_MSG_CT_NEW event only if the
 	 * IPCT_LABEL bit is set in the event cache.
 	 */
-	nf_conntrack_event_cache(IPCT_LABEL, ct);
+	*events |= 1UL << IPCT_LABEL;
 
 	memcpy(&key->ct.labels, cl->bits, OVS_CT_LABELS_LEN);
 
 	return 0;
 }
 
+/* As nf_connlabels_replace(), but on the extension already looked up here
+ * and with the event left to the caller.
+ */
 static int ovs_ct_set_labels(struct nf_conn *ct, struct sw_flow_key *key,
 			     const struct ovs_key_ct_labels *labels,
-			     const struct ovs_key_ct_labels *mask)
+			     const struct ovs_key_ct_labels *mask,
+			     unsigned long *events)
 {
 	struct nf_conn_labels *cl;
-	int err;
+	bool changed = false;
+	u32 *dst;
+	int i;
 
 	cl = ovs_ct_get_conn_labels(ct);
 	if (!cl)
 		return -ENOSPC;
 
-	err = nf_connlabels_replace(ct, labels->ct_labels_32,
-				    mask->ct_labels_32,
-				    OVS_CT_LABELS_LEN_32);
-	if (err)
-		return err;
+	dst = (u32 *)cl->bits;
+	for (i = 0; i < OVS_CT_LABELS_LEN_32; i++) {
+		u32 old, new;
+
+		do {
+			old = READ_ONCE(dst[i]);
+			new = (old & ~mask->ct_labels_32[i]) |
+			      (labels->ct_labels_32[i] & mask->ct_labels_32[i]);
+			if (old == new)
+				break;
+		} while (cmpxchg(&dst[i], old, new) != old);
+
+		changed |= old != new;
+	}
+	if (changed)
+		*events |= 1UL << IPCT_LABEL;
 
 	memcpy(&key->ct.labels, cl->bits, OVS_CT_LABELS_LEN);
 
 	return 0;
 }
 
+/* Queues 'events' with one lookup of the event cache extension, rather than
+ * one per nf_conntrack_event_cache() call.
+ */
+static void ovs_ct_queue_events(struct nf_conntrack_ecache *ecache,
+				unsigned long events)
+{
+	unsigned int bit;
+
+	if (!ecache)
+		return;
+
+	for_each_set_bit(bit, &events, BITS_PER_LONG)
+		set_bit(bit, &ecache->cache);
+}
+
 /* 'skb' should already be pulled to nh_ofs. */
 static int ovs_ct_helper(struct sk_buff *skb, u16 proto)
 {
@@ -509,10 +554,14 @@ static int handle_fragments(struct net *net, struct sw_flow_key *key,
 	int err;
 
 	if (key->eth.type == htons(ETH_P_IP)) {
+		struct ovs_net *ovs_net = net_generic(net, ovs_net_id);
 		enum ip_defrag_users user = IP_DEFRAG_CONNTRACK_IN + zone;
 
 		memset(IPCB(skb), 0, sizeof(struct inet_skb_parm));
-		err = ip_defrag(net, skb, user);
+		if (likely(ovs_net->ct_frags))
+			err = ovs_ct_frag_gather(ovs_net->ct_frags, skb, zone);
+		else
+			err = ip_defrag(net, skb, user);
 		if (err)
 			return err;
 
@@ -737,6 +786,211 @@ static bool skb_nfct_cached(struct net *net,
 	return ct_executed;
 }
 
+/* Per-CPU cache of established UDP connections, indexed by skb hash and
+ * zone.  A hit attaches the connection to the packet and refreshes its
+ * timeout by the amount nf_conntrack_in() last did, without going through
+ * nf_conntrack_in() again.  TCP is not cached because conntrack has to track
+ * the window of every segment.
+ *
+ * Each entry holds a reference to its connection, dropped when the entry is
+ * replaced, found stale, or flushed by ovs_ct_cache_flush() when a namespace
+ * goes away, so that the cache cannot hold up conntrack teardown.  The
+ * flush may run on another CPU, so the owning CPU takes its own reference
+ * with atomic_inc_not_zero() and checks the connection again, as
+ * __nf_conntrack_find_get() does; the connection was live when it was read
+ * and its slab is RCU typesafe, so it is still a struct nf_conn.
+ */
+#define OVS_CT_CACHE_SHIFT	8
+#define OVS_CT_CACHE_ENTRIES	(1u << OVS_CT_CACHE_SHIFT)
+
+struct ovs_ct_cache_entry {
+	struct nf_conn *ct;
+	u32 hash;
+	u32 timeout;
+	u16 zone;
+	u8 dir;
+};
+
+struct ovs_ct_cache {
+	struct ovs_ct_cache_entry entries[OVS_CT_CACHE_ENTRIES];
+};
+
+static DEFINE_PER_CPU(struct ovs_ct_cache, ovs_ct_cache);
+
+static s32 ovs_ct_time_left(const struct nf_conn *ct)
+{
+#ifdef HAVE_NF_CONN_TIMER
+	return (s32)(ct->timeout.expires - jiffies);
+#else
+	return (s32)(ct->timeout - nfct_time_stamp);
+#endif
+}
+
+static bool ovs_ct_cacheable(const struct sw_flow_key *key,
+			     const struct ovs_conntrack_info *info)
+{
+	return key->ip.proto == IPPROTO_UDP &&
+	       key->ip.frag == OVS_FRAG_TYPE_NONE &&
+	       !(key->ct_state & OVS_CS_F_NAT_MASK) &&
+	       !info->force && !info->helper;
+}
+
+static struct ovs_ct_cache_entry *
+ovs_ct_cache_entry(const struct ovs_conntrack_info *info, u32 hash)
+{
+	u32 index = hash_32(hash ^ info->zone.id, OVS_CT_CACHE_SHIFT);
+
+	return &this_cpu_ptr(&ovs_ct_cache)->entries[index];
+}
+
+/* Whether 'ct' is still an established UDP connection in 'info''s zone
+ * whose 'dir' tuple is the packet described by 'key'.
+ */
+static bool ovs_ct_cache_valid(struct net *net, const struct nf_conn *ct,
+			       u8 dir, const struct sw_flow_key *key,
+			       const struct ovs_conntrack_info *info)
+{
+	const struct nf_conntrack_tuple *t = &ct->tuplehash[dir].tuple;
+
+	if (!nf_ct_is_confirmed(ct) || nf_ct_is_dying(ct) ||
+	    ovs_ct_time_left(ct) <= 0 ||
+	    !test_bit(IPS_ASSURED_BIT, &ct->status) || nfct_help(ct) ||
+	    !net_eq(net, read_pnet(&ct->ct_net)) ||
+	    !nf_ct_zone_equal_any(info->ct, nf_ct_zone(ct)))
+		return false;
+
+	if (t->dst.protonum != key->ip.proto ||
+	    t->src.u.all != key->tp.src || t->dst.u.all != key->tp.dst)
+		return false;
+
+	if (key->eth.type == htons(ETH_P_IP))
+		return nf_ct_l3num(ct) == NFPROTO_IPV4 &&
+		       t->src.u3.ip == key->ipv4.addr.src &&
+		       t->dst.u3.ip == key->ipv4.addr.dst;
+	if (key->eth.type == htons(ETH_P_IPV6))
+		return nf_ct_l3num(ct) == NFPROTO_IPV6 &&
+		       ipv6_addr_equal(&t->src.u3.in6, &key->ipv6.addr.src) &&
+		       ipv6_addr_equal(&t->dst.u3.in6, &key->ipv6.addr.dst);
+	return false;
+}
+
+/* Whether UDP packet 'skb', pulled to its network header, would pass the
+ * length and checksum checks nf_conntrack_in() does in PRE_ROUTING, so that
+ * a cache hit does not turn a packet conntrack would mark invalid into an
+ * established one.  IPv6 checksums that the device has not verified are
+ * left to nf_conntrack_in().
+ */
+static bool ovs_ct_cache_csum_ok(struct net *net, const struct sw_flow_key *key,
+				 struct sk_buff *skb)
+{
+	unsigned int dataoff = skb_transport_offset(skb);
+	const struct udphdr *uh = udp_hdr(skb);
+	unsigned int udplen = ntohs(uh->len);
+
+	if (udplen > skb->len - dataoff || udplen < sizeof(*uh))
+		return false;
+
+	if (!net->ct.sysctl_checksum || skb_csum_unnecessary(skb))
+		return true;
+	if (key->eth.type != htons(ETH_P_IP))
+		return false;
+
+	return !uh->check ||
+	       !nf_ip_checksum(skb, NF_INET_PRE_ROUTING, dataoff, IPPROTO_UDP);
+}
+
+/* Attaches the cached connection for 'skb', if there is one.  Returns true
+ * if it did, in place of nf_conntrack_in().
+ */
+static bool ovs_ct_cache_lookup(struct net *net, const struct sw_flow_key *key,
+				const struct ovs_conntrack_info *info,
+				struct sk_buff *skb)
+{
+	struct ovs_ct_cache_entry *e;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	u32 hash;
+
+	if (!ovs_ct_cacheable(key, info))
+		return false;
+
+	hash = skb_get_hash(skb);
+	e = ovs_ct_cache_entry(info, hash);
+	ct = READ_ONCE(e->ct);
+	if (!ct || e->hash != hash || e->zone != info->zone.id ||
+	    !ovs_ct_cache_csum_ok(net, key, skb))
+		return false;
+
+	if (unlikely(!atomic_inc_not_zero(&ct->ct_general.use)))
+		return false;
+	if (!ovs_ct_cache_valid(net, ct, e->dir, key, info)) {
+		if (cmpxchg(&e->ct, ct, NULL) == ct)
+			nf_ct_put(ct);
+		nf_ct_put(ct);
+		return false;
+	}
+
+	ctinfo = e->dir == IP_CT_DIR_ORIGINAL ? IP_CT_ESTABLISHED
+					      : IP_CT_ESTABLISHED_REPLY;
+	nf_ct_refresh_acct(ct, ctinfo, skb, e->timeout);
+
+	if (skb_nfct(skb))
+		nf_conntrack_put(skb_nfct(skb));
+	nf_ct_set(skb, ct, ctinfo);
+	return true;
+}
+
+/* Remembers the connection nf_conntrack_in() just attached to 'skb'. */
+static void ovs_ct_cache_update(const struct sw_flow_key *key,
+				const struct ovs_conntrack_info *info,
+				struct sk_buff *skb)
+{
+	struct ovs_ct_cache_entry *e;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	u32 hash;
+
+	if (!ovs_ct_cacheable(key, info))
+		return;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (!ct || (ctinfo != IP_CT_ESTABLISHED &&
+		    ctinfo != IP_CT_ESTABLISHED_REPLY) ||
+	    !nf_ct_is_confirmed(ct) ||
+	    !test_bit(IPS_ASSURED_BIT, &ct->status) || nfct_help(ct) ||
+	    nf_ct_protonum(ct) != IPPROTO_UDP)
+		return;
+
+	hash = skb_get_hash(skb);
+	e = ovs_ct_cache_entry(info, hash);
+	e->hash = hash;
+	e->timeout = max_t(s32, ovs_ct_time_left(ct), 0);
+	e->zone = info->zone.id;
+	e->dir = CTINFO2DIR(ctinfo);
+
+	nf_conntrack_get(&ct->ct_general);
+	ct = xchg(&e->ct, ct);
+	if (ct)
+		nf_ct_put(ct);
+}
+
+/* Drops every cached connection on every CPU. */
+static void ovs_ct_cache_flush(void)
+{
+	struct ovs_ct_cache *cache;
+	struct nf_conn *ct;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(&ovs_ct_cache, cpu);
+		for (i = 0; i < OVS_CT_CACHE_ENTRIES; i++) {
+			ct = xchg(&cache->entries[i].ct, NULL);
+			if (ct)
+				nf_ct_put(ct);
+		}
+	}
+}
+
 #ifdef CONFIG_NF_NAT_NEEDED
 /* Modelled after nf_nat_ipv[46]_fn().
  * range is only used for new, uninitialized NAT state.
@@ -954,7 +1208,11 @@ static int __ovs_ct_lookup(struct net *net, struct sw_flow_key *key,
 	enum ip_conntrack_info ctinfo;
 	struct nf_conn *ct;
 
-	if (!cached) {
+	if (!cached && ovs_ct_cache_lookup(net, key, info, skb)) {
+		key->ct_state = 0;
+		ovs_ct_update_key(skb, info, key, true, true);
+		cached = true;
+	} else if (!cached) {
 		struct nf_conn *tmpl = info->ct;
 		int err;
 
@@ -979,6 +1237,7 @@ static int __ovs_ct_lookup(struct net *net, struct sw_flow_key *key,
 
 		/* Update the key, but keep the NAT flags. */
 		ovs_ct_update_key(skb, info, key, true, true);
+		ovs_ct_cache_update(key, info, skb);
 	}
 
 	ct = nf_ct_get(skb, &ctinfo);
@@ -1076,12 +1335,270 @@ static bool labels_nonzero(const struct ovs_key_ct_labels *labels)
 	return false;
 }
 
+/* Per-zone connection limits.
+ *
+ * Zones with a limit of their own, and zones that commit while a default
+ * limit is set, have an entry that counts the connections committed in
+ * them.  The count is a per-CPU counter: a commit reserves its connection
+ * in it before confirming, which both checks and counts it, and gives the
+ * reservation back if the connection is not confirmed after all.
+ *
+ * Conntrack has no hook for the datapath to learn that a connection went
+ * away, so each commit also leaves a record of its connection on a per-CPU
+ * list of the entry, as nf_conncount does.  Every OVS_CT_LIMIT_GC_INTERVAL
+ * the sweep moves those records to the entry's own list and looks up up to
+ * OVS_CT_LIMIT_GC_BATCH of the oldest ones, counting down the connections
+ * that are gone.  The sweep also drops the entries that only followed the
+ * default limit and are not needed any more.  Connections committed before
+ * their zone had an entry are not counted.
+ *
+ * Entries are looked up under RCU and added or removed under 'info->lock'.
+ * The datapath and netlink requests add entries, and only the sweep removes
+ * them, so the sweep may keep using an entry outside RCU.  An entry's own
+ * list is only touched by the sweep.
+ */
+#define CT_LIMIT_HASH_BUCKETS 512
+#define OVS_CT_LIMIT_GC_INTERVAL HZ
+#define OVS_CT_LIMIT_GC_BATCH 1024	/* Lookups per entry per sweep. */
+
+struct ovs_ct_limit_conn {
+	union {
+		struct llist_node llnode;	/* In 'new_conns'. */
+		struct list_head node;		/* In 'conns'. */
+	};
+	struct nf_conntrack_tuple tuple;
+	struct nf_conntrack_zone zone;
+	const struct nf_conn *ct;	/* Identity only, not referenced. */
+};
+
+struct ovs_ct_limit {
+	struct hlist_node hlist_node;
+	struct rcu_head rcu;
+	struct percpu_counter count;	/* Including reservations. */
+	struct llist_head __percpu *new_conns;
+	struct list_head conns;		/* Oldest first, sweep only. */
+	u32 n_conns;			/* Length of 'conns'. */
+	u32 limit;
+	u16 zone;
+	bool dflt;		/* Follows the default limit. */
+	bool dead;		/* Being removed from 'info->limits'. */
+};
+
+struct ovs_ct_limit_info {
+	u32 default_limit;
+	spinlock_t lock;
+	struct hlist_head *limits;
+	struct delayed_work gc;
+	struct net *net;
+};
+
+static struct hlist_head *ct_limit_bucket(const struct ovs_ct_limit_info *info,
+					  u16 zone)
+{
+	return &info->limits[zone & (CT_LIMIT_HASH_BUCKETS - 1)];
+}
+
+static struct ovs_ct_limit *ct_limit_find(const struct ovs_ct_limit_info *info,
+					  u16 zone)
+{
+	struct ovs_ct_limit *ct_limit;
+
+	hlist_for_each_entry_rcu(ct_limit, ct_limit_bucket(info, zone),
+				 hlist_node)
+		if (ct_limit->zone == zone)
+			return ct_limit;
+
+	return NULL;
+}
+
+/* Adds an entry for 'zone' that follows the default limit.  Must be called
+ * with 'info->lock' held.
+ */
+static struct ovs_ct_limit *ct_limit_add(struct ovs_ct_limit_info *info,
+					 u16 zone, gfp_t gfp)
+{
+	struct ovs_ct_limit *ct_limit;
+	int cpu;
+
+	ct_limit = kzalloc(sizeof(*ct_limit), gfp);
+	if (!ct_limit)
+		return NULL;
+
+	ct_limit->new_conns = alloc_percpu_gfp(struct llist_head, gfp);
+	if (!ct_limit->new_conns)
+		goto err_free;
+	if (percpu_counter_init(&ct_limit->count, 0, gfp))
+		goto err_free_percpu;
+
+	for_each_possible_cpu(cpu)
+		init_llist_head(per_cpu_ptr(ct_limit->new_conns, cpu));
+	INIT_LIST_HEAD(&ct_limit->conns);
+	ct_limit->zone = zone;
+	ct_limit->dflt = true;
+	hlist_add_head_rcu(&ct_limit->hlist_node, ct_limit_bucket(info, zone));
+
+	return ct_limit;
+
+err_free_percpu:
+	free_percpu(ct_limit->new_conns);
+err_free:
+	kfree(ct_limit);
+	return NULL;
+}
+
+static void ct_limit_free(struct ovs_ct_limit *ct_limit)
+{
+	struct ovs_ct_limit_conn *conn, *next;
+	struct llist_node *first;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		first = llist_del_all(per_cpu_ptr(ct_limit->new_conns, cpu));
+		llist_for_each_entry_safe(conn, next, first, llnode)
+			kfree(conn);
+	}
+	list_for_each_entry_safe(conn, next, &ct_limit->conns, node)
+		kfree(conn);
+	percpu_counter_destroy(&ct_limit->count);
+	free_percpu(ct_limit->new_conns);
+	kfree(ct_limit);
+}
+
+static void ct_limit_free_rcu(struct rcu_head *rcu)
+{
+	ct_limit_free(container_of(rcu, struct ovs_ct_limit, rcu));
+}
+
+/* Must be called with 'info->lock' held. */
+static void ct_limit_del(struct ovs_ct_limit *ct_limit)
+{
+	hlist_del_rcu(&ct_limit->hlist_node);
+	call_rcu(&ct_limit->rcu, ct_limit_free_rcu);
+}
+
+/* Called with rcu_read_lock.  Returns the entry for 'zone', adding one if
+ * the zone only follows the default limit, or NULL if the zone is not
+ * limited.
+ */
+static struct ovs_ct_limit *ct_limit_get(struct ovs_ct_limit_info *info,
+					 u16 zone)
+{
+	struct ovs_ct_limit *ct_limit;
+
+	ct_limit = ct_limit_find(info, zone);
+	if (ct_limit || !READ_ONCE(info->default_limit))
+		return ct_limit;
+
+	spin_lock(&info->lock);
+	ct_limit = ct_limit_find(info, zone);
+	if (!ct_limit)
+		ct_limit = ct_limit_add(info, zone, GFP_ATOMIC);
+	spin_unlock(&info->lock);
+
+	return ct_limit;
+}
+
+/* Whether the connection 'conn' was committed for still exists. */
+static bool ct_limit_conn_alive(struct net *net,
+				const struct ovs_ct_limit_conn *conn)
+{
+	struct nf_conntrack_tuple_hash *h;
+	struct nf_conn *ct;
+	bool alive;
+
+	h = nf_conntrack_find_get(net, &conn->zone, &conn->tuple);
+	if (!h)
+		return false;
+
+	ct = nf_ct_tuplehash_to_ctrack(h);
+	alive = ct == conn->ct && !nf_ct_is_dying(ct);
+	nf_ct_put(ct);
+	return alive;
+}
+
+/* Called with rcu_read_lock.  Reserves room for a new connection in 'zone'.
+ * Returns NULL if the zone is not limited, ERR_PTR(-ENOMEM) if it is at its
+ * limit or the record cannot be allocated, and otherwise the entry the
+ * connection is counted in, with '*connp' set to its record.  The caller
+ * must pass both to ovs_ct_count_limit() once the connection is confirmed,
+ * or to ovs_ct_unreserve_limit() if it is not.
+ */
+static struct ovs_ct_limit *ovs_ct_check_limit(struct net *net, u16 zone,
+					       struct ovs_ct_limit_conn **connp)
+{
+	struct ovs_net *ovs_net = net_generic(net, ovs_net_id);
+	struct ovs_ct_limit_info *info = ovs_net->ct_limit_info;
+	struct ovs_ct_limit_conn *conn;
+	struct ovs_ct_limit *ct_limit;
+	u32 limit;
+
+	if (!info)
+		return NULL;
+
+	conn = kmalloc(sizeof(*conn), GFP_ATOMIC);
+	if (!conn)
+		return ERR_PTR(-ENOMEM);
+
+	for (;;) {
+		ct_limit = ct_limit_get(info, zone);
+		if (!ct_limit) {
+			kfree(conn);
+			return NULL;
+		}
+
+		percpu_counter_inc(&ct_limit->count);
+		/* Pairs with the barrier in ct_limit_sweep(): either the sweep
+		 * sees this reservation, or this sees the entry going away.
+		 */
+		smp_mb();
+		if (likely(!READ_ONCE(ct_limit->dead)))
+			break;
+		percpu_counter_dec(&ct_limit->count);
+	}
+
+	limit = ct_limit->dflt ? READ_ONCE(info->default_limit)
+			       : READ_ONCE(ct_limit->limit);
+	if (limit && percpu_counter_compare(&ct_limit->count, limit) > 0) {
+		percpu_counter_dec(&ct_limit->count);
+		kfree(conn);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	*connp = conn;
+	return ct_limit;
+}
+
+/* Gives back a reservation made by ovs_ct_check_limit(). */
+static void ovs_ct_unreserve_limit(struct ovs_ct_limit *ct_limit,
+				   struct ovs_ct_limit_conn *conn)
+{
+	percpu_counter_dec(&ct_limit->count);
+	kfree(conn);
+}
+
+/* Called with rcu_read_lock.  Records 'ct', just confirmed, as the
+ * connection reserved for in 'ct_limit'.
+ */
+static void ovs_ct_count_limit(struct ovs_ct_limit *ct_limit,
+			       struct ovs_ct_limit_conn *conn,
+			       const struct nf_conn *ct)
+{
+	conn->tuple = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	conn->zone = *nf_ct_zone(ct);
+	conn->ct = ct;
+	llist_add(&conn->llnode, this_cpu_ptr(ct_limit->new_conns));
+}
+
 /* Lookup connection and confirm if unconfirmed. */
 static int ovs_ct_commit(struct net *net, struct sw_flow_key *key,
 			 const struct ovs_conntrack_info *info,
 			 struct sk_buff *skb)
 {
+	struct ovs_ct_limit_conn *limit_conn = NULL;
+	struct ovs_ct_limit *ct_limit = NULL;
+	struct nf_conntrack_ecache *ecache;
 	enum ip_conntrack_info ctinfo;
+	unsigned long events = 0;
 	struct nf_conn *ct;
 	int err;
 
@@ -1094,6 +1611,16 @@ static int ovs_ct_commit(struct net *net, struct sw_flow_key *key,
 	if (!ct)
 		return 0;
 
+	if (!nf_ct_is_confirmed(ct)) {
+		ct_limit = ovs_ct_check_limit(net, info->zone.id,
+					      &limit_conn);
+		if (IS_ERR(ct_limit)) {
+			net_warn_ratelimited("openvswitch: zone: %u exceeds conntrack limit\n",
+					     info->zone.id);
+			return PTR_ERR(ct_limit);
+		}
+	}
+
 	/* Set the conntrack event mask if given.  NEW and DELETE events have
 	 * their own groups, but the NFNLGRP_CONNTRACK_UPDATE group listener
 	 * typically would receive many kinds of updates.  Setting the event
@@ -1101,41 +1628,50 @@ static int ovs_ct_commit(struct net *net, struct sw_flow_key *key,
 	 * remain in effect for the lifetime of the connection unless changed
 	 * by a further CT action with both the commit flag and the eventmask
 	 * option. */
-	if (info->have_eventmask) {
-		struct nf_conntrack_ecache *cache = nf_ct_ecache_find(ct);
-
-		if (cache)
-			cache->ctmask = info->eventmask;
-	}
+	ecache = nf_ct_ecache_find(ct);
+	if (info->have_eventmask && ecache)
+		ecache->ctmask = info->eventmask;
 
 	/* Apply changes before confirming the connection so that the initial
 	 * conntrack NEW netlink event carries the values given in the CT
-	 * action.
+	 * action.  The events they cause are queued together at the end.
 	 */
 	if (info->mark.mask) {
 		err = ovs_ct_set_mark(ct, key, info->mark.value,
-				      info->mark.mask);
+				      info->mark.mask, &events);
 		if (err)
-			return err;
+			goto err_unreserve;
 	}
 	if (!nf_ct_is_confirmed(ct)) {
 		err = ovs_ct_init_labels(ct, key, &info->labels.value,
-					 &info->labels.mask);
+					 &info->labels.mask, &events);
 		if (err)
-			return err;
+			goto err_unreserve;
 	} else if (labels_nonzero(&info->labels.mask)) {
 		err = ovs_ct_set_labels(ct, key, &info->labels.value,
-					&info->labels.mask);
+					&info->labels.mask, &events);
 		if (err)
-			return err;
+			goto err_unreserve;
 	}
+	if (events)
+		ovs_ct_queue_events(ecache, events);
 	/* This will take care of sending queued events even if the connection
 	 * is already confirmed.
 	 */
-	if (nf_conntrack_confirm(skb) != NF_ACCEPT)
-		return -EINVAL;
+	if (nf_conntrack_confirm(skb) != NF_ACCEPT) {
+		err = -EINVAL;
+		goto err_unreserve;
+	}
+
+	if (ct_limit)
+		ovs_ct_count_limit(ct_limit, limit_conn, ct);
 
 	return 0;
+
+err_unreserve:
+	if (ct_limit)
+		ovs_ct_unreserve_limit(ct_limit, limit_conn);
+	return err;
 }
 
 /* Trim the skb to the length specified by the IP/IPv6 header,
@@ -1682,6 +2218,12 @@ int ovs_ct_action_to_attr(const struct ovs_conntrack_info *ct_info,
 	return 0;
 }
 
+/* Returns true if the ct action 'ct_info' may rewrite the packet. */
+bool ovs_ct_action_nat(const struct ovs_conntrack_info *ct_info)
+{
+	return ct_info->nat != 0;
+}
+
 void ovs_ct_free_action(const struct nlattr *a)
 {
 	struct ovs_conntrack_info *ct_info = nla_data(a);
@@ -1697,6 +2239,493 @@ static void __ovs_ct_free_action(struct ovs_conntrack_info *ct_info)
 		nf_ct_tmpl_free(ct_info->ct);
 }
 
+/* Collects the connections committed to 'ct_limit' since the last sweep
+ * and looks up the oldest few, counting down those that went away.  Only
+ * sleeps between lookups, holding no lock.
+ */
+static void ct_limit_sweep_one(struct ovs_ct_limit_info *info,
+			       struct ovs_ct_limit *ct_limit)
+{
+	struct ovs_ct_limit_conn *conn, *next;
+	struct llist_node *first;
+	u32 n, dropped = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		first = llist_del_all(per_cpu_ptr(ct_limit->new_conns, cpu));
+		first = llist_reverse_order(first);
+		llist_for_each_entry_safe(conn, next, first, llnode) {
+			list_add_tail(&conn->node, &ct_limit->conns);
+			ct_limit->n_conns++;
+		}
+	}
+
+	n = min_t(u32, ct_limit->n_conns, OVS_CT_LIMIT_GC_BATCH);
+	while (n--) {
+		conn = list_first_entry(&ct_limit->conns,
+					struct ovs_ct_limit_conn, node);
+		if (ct_limit_conn_alive(info->net, conn)) {
+			list_move_tail(&conn->node, &ct_limit->conns);
+		} else {
+			list_del(&conn->node);
+			ct_limit->n_conns--;
+			kfree(conn);
+			dropped++;
+		}
+		if (!(n % 64))
+			cond_resched();
+	}
+
+	if (dropped)
+		percpu_counter_sub(&ct_limit->count, dropped);
+}
+
+static struct ovs_ct_limit *ct_limit_first(struct hlist_head *head)
+{
+	struct ovs_ct_limit *ct_limit;
+
+	rcu_read_lock();
+	ct_limit = hlist_entry_safe(rcu_dereference(hlist_first_rcu(head)),
+				    struct ovs_ct_limit, hlist_node);
+	rcu_read_unlock();
+
+	return ct_limit;
+}
+
+static struct ovs_ct_limit *ct_limit_next(struct ovs_ct_limit *ct_limit)
+{
+	rcu_read_lock();
+	ct_limit = hlist_entry_safe(
+		rcu_dereference(hlist_next_rcu(&ct_limit->hlist_node)),
+		struct ovs_ct_limit, hlist_node);
+	rcu_read_unlock();
+
+	return ct_limit;
+}
+
+/* Counts down the connections that went away in every entry, then drops the
+ * entries that are not needed any more.  Entries added meanwhile at the
+ * head of a bucket are left for the next sweep.
+ */
+static void ct_limit_sweep(struct work_struct *work)
+{
+	struct ovs_ct_limit_info *info = container_of(to_delayed_work(work),
+						      struct ovs_ct_limit_info,
+						      gc);
+	struct ovs_ct_limit *ct_limit;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < CT_LIMIT_HASH_BUCKETS; i++) {
+		for (ct_limit = ct_limit_first(&info->limits[i]); ct_limit;
+		     ct_limit = ct_limit_next(ct_limit))
+			ct_limit_sweep_one(info, ct_limit);
+		cond_resched();
+	}
+
+	spin_lock_bh(&info->lock);
+	for (i = 0; i < CT_LIMIT_HASH_BUCKETS; i++)
+		hlist_for_each_entry_safe(ct_limit, n, &info->limits[i],
+					  hlist_node) {
+			if (!ct_limit->dflt)
+				continue;
+			if (!info->default_limit) {
+				WRITE_ONCE(ct_limit->dead, true);
+				ct_limit_del(ct_limit);
+				continue;
+			}
+			/* Pairs with the barrier in ovs_ct_check_limit(). */
+			WRITE_ONCE(ct_limit->dead, true);
+			smp_mb();
+			if (percpu_counter_sum(&ct_limit->count))
+				WRITE_ONCE(ct_limit->dead, false);
+			else
+				ct_limit_del(ct_limit);
+		}
+	spin_unlock_bh(&info->lock);
+
+	schedule_delayed_work(&info->gc, OVS_CT_LIMIT_GC_INTERVAL);
+}
+
+static struct ovs_ct_limit_info *ovs_ct_limit_init(struct net *net)
+{
+	struct ovs_ct_limit_info *info;
+	int i;
+
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (!info)
+		return NULL;
+
+	info->limits = kmalloc_array(CT_LIMIT_HASH_BUCKETS,
+				     sizeof(struct hlist_head), GFP_KERNEL);
+	if (!info->limits) {
+		kfree(info);
+		return NULL;
+	}
+	for (i = 0; i < CT_LIMIT_HASH_BUCKETS; i++)
+		INIT_HLIST_HEAD(&info->limits[i]);
+
+	spin_lock_init(&info->lock);
+	info->net = net;
+	INIT_DELAYED_WORK(&info->gc, ct_limit_sweep);
+	schedule_delayed_work(&info->gc, OVS_CT_LIMIT_GC_INTERVAL);
+
+	return info;
+}
+
+/* Called after an RCU grace period, once no packet can look 'info' up. */
+static void ovs_ct_limit_exit(struct ovs_ct_limit_info *info)
+{
+	struct ovs_ct_limit *ct_limit;
+	struct hlist_node *next;
+	int i;
+
+	if (!info)
+		return;
+
+	cancel_delayed_work_sync(&info->gc);
+	for (i = 0; i < CT_LIMIT_HASH_BUCKETS; i++)
+		hlist_for_each_entry_safe(ct_limit, next, &info->limits[i],
+					  hlist_node) {
+			hlist_del(&ct_limit->hlist_node);
+			ct_limit_free(ct_limit);
+		}
+	kfree(info->limits);
+	kfree(info);
+}
+
+static bool check_zone_id(int zone_id, u16 *pzone)
+{
+	if (zone_id >= 0 && zone_id <= U16_MAX) {
+		*pzone = (u16)zone_id;
+		return true;
+	}
+	return false;
+}
+
+
+static struct sk_buff *
+ovs_ct_limit_cmd_reply_start(struct genl_info *info, u8 cmd,
+			     struct ovs_header **ovs_reply_header)
+{
+	struct ovs_header *ovs_header = info->userhdr;
+	struct sk_buff *skb;
+
+	skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!skb)
+		return ERR_PTR(-ENOMEM);
+
+	*ovs_reply_header = genlmsg_put(skb, info->snd_portid, info->snd_seq,
+					&dp_ct_limit_genl_family, 0, cmd);
+	if (!*ovs_reply_header) {
+		nlmsg_free(skb);
+		return ERR_PTR(-EMSGSIZE);
+	}
+	(*ovs_reply_header)->dp_ifindex = ovs_header->dp_ifindex;
+
+	return skb;
+}
+
+/* Calls 'cb' with each &struct ovs_zone_limit in 'nla'. */
+static int ct_limit_for_each(struct nlattr *nla,
+			     int (*cb)(const struct ovs_zone_limit *, void *),
+			     void *aux)
+{
+	const struct ovs_zone_limit *zone_limit = nla_data(nla);
+	int rem = nla_len(nla);
+	int err;
+
+	for (; rem >= sizeof(*zone_limit);
+	     rem -= NLA_ALIGN(sizeof(*zone_limit)), zone_limit++) {
+		err = cb(zone_limit, aux);
+		if (err)
+			return err;
+	}
+	if (rem)
+		OVS_NLERR(true, "zone limit has %d unknown bytes", rem);
+
+	return 0;
+}
+
+static int ct_limit_set_one(const struct ovs_zone_limit *zone_limit,
+			    void *aux)
+{
+	struct ovs_ct_limit_info *info = aux;
+	struct ovs_ct_limit *ct_limit;
+	u16 zone;
+
+	if (zone_limit->zone_id == OVS_ZONE_LIMIT_DEFAULT_ZONE) {
+		WRITE_ONCE(info->default_limit, zone_limit->limit);
+		return 0;
+	}
+	if (!check_zone_id(zone_limit->zone_id, &zone)) {
+		OVS_NLERR(true, "zone id is out of range");
+		return 0;
+	}
+
+	spin_lock_bh(&info->lock);
+	ct_limit = ct_limit_find(info, zone);
+	if (!ct_limit)
+		ct_limit = ct_limit_add(info, zone, GFP_ATOMIC);
+	if (ct_limit) {
+		WRITE_ONCE(ct_limit->limit, zone_limit->limit);
+		ct_limit->dflt = false;
+	}
+	spin_unlock_bh(&info->lock);
+
+	return ct_limit ? 0 : -ENOMEM;
+}
+
+static int ct_limit_del_one(const struct ovs_zone_limit *zone_limit,
+			    void *aux)
+{
+	struct ovs_ct_limit_info *info = aux;
+	struct ovs_ct_limit *ct_limit;
+	u16 zone;
+
+	if (zone_limit->zone_id == OVS_ZONE_LIMIT_DEFAULT_ZONE) {
+		WRITE_ONCE(info->default_limit, 0);
+		return 0;
+	}
+	if (!check_zone_id(zone_limit->zone_id, &zone)) {
+		OVS_NLERR(true, "zone id is out of range");
+		return 0;
+	}
+
+	/* The zone goes back to the default limit.  Its entry keeps counting
+	 * until the next sweep drops it, if nothing needs it then.
+	 */
+	spin_lock_bh(&info->lock);
+	ct_limit = ct_limit_find(info, zone);
+	if (ct_limit)
+		ct_limit->dflt = true;
+	spin_unlock_bh(&info->lock);
+
+	return 0;
+}
+
+static int ct_limit_put(struct sk_buff *reply, int zone_id, u32 limit,
+			u32 count)
+{
+	struct ovs_zone_limit zone_limit = {
+		.zone_id = zone_id,
+		.limit = limit,
+		.count = count,
+	};
+
+	return nla_put_nohdr(reply, sizeof(zone_limit), &zone_limit);
+}
+
+struct ct_limit_get_arg {
+	struct ovs_ct_limit_info *info;
+	struct sk_buff *reply;
+};
+
+static int ct_limit_get_one(const struct ovs_zone_limit *zone_limit,
+			    void *aux)
+{
+	struct ct_limit_get_arg *arg = aux;
+	struct ovs_ct_limit_info *info = arg->info;
+	struct ovs_ct_limit *ct_limit;
+	u32 limit = info->default_limit;
+	u32 count = 0;
+	u16 zone;
+
+	if (zone_limit->zone_id == OVS_ZONE_LIMIT_DEFAULT_ZONE)
+		return ct_limit_put(arg->reply, OVS_ZONE_LIMIT_DEFAULT_ZONE,
+				    limit, 0);
+	if (!check_zone_id(zone_limit->zone_id, &zone)) {
+		OVS_NLERR(true, "zone id is out of range");
+		return 0;
+	}
+
+	rcu_read_lock();
+	ct_limit = ct_limit_find(info, zone);
+	if (ct_limit) {
+		if (!ct_limit->dflt)
+			limit = ct_limit->limit;
+		count = percpu_counter_sum_positive(&ct_limit->count);
+	}
+	rcu_read_unlock();
+
+	return ct_limit_put(arg->reply, zone, limit, count);
+}
+
+static int ct_limit_get_all(struct ovs_ct_limit_info *info,
+			    struct sk_buff *reply)
+{
+	struct ovs_ct_limit *ct_limit;
+	u32 count;
+	int err;
+	int i;
+
+	err = ct_limit_put(reply, OVS_ZONE_LIMIT_DEFAULT_ZONE,
+			   info->default_limit, 0);
+	if (err)
+		return err;
+
+	rcu_read_lock();
+	for (i = 0; i < CT_LIMIT_HASH_BUCKETS; i++) {
+		hlist_for_each_entry_rcu(ct_limit, &info->limits[i],
+					 hlist_node) {
+			if (ct_limit->dflt)
+				continue;
+			count = percpu_counter_sum_positive(&ct_limit->count);
+			err = ct_limit_put(reply, ct_limit->zone,
+					   ct_limit->limit, count);
+			if (err)
+				goto out;
+		}
+	}
+out:
+	rcu_read_unlock();
+	return err;
+}
+
+static struct ovs_ct_limit_info *ct_limit_info_get(struct sk_buff *skb)
+{
+	struct ovs_net *ovs_net = net_generic(sock_net(skb->sk), ovs_net_id);
+
+	return ovs_net->ct_limit_info;
+}
+
+static int ovs_ct_limit_cmd_set(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr **a = info->attrs;
+	struct ovs_ct_limit_info *ct_limit_info = ct_limit_info_get(skb);
+	struct ovs_header *ovs_reply_header;
+	struct sk_buff *reply;
+	int err;
+
+	if (!ct_limit_info)
+		return -ENOMEM;
+	if (!a[OVS_CT_LIMIT_ATTR_ZONE_LIMIT])
+		return -EINVAL;
+
+	reply = ovs_ct_limit_cmd_reply_start(info, OVS_CT_LIMIT_CMD_SET,
+					     &ovs_reply_header);
+	if (IS_ERR(reply))
+		return PTR_ERR(reply);
+
+	err = ct_limit_for_each(a[OVS_CT_LIMIT_ATTR_ZONE_LIMIT],
+				ct_limit_set_one, ct_limit_info);
+	if (err) {
+		nlmsg_free(reply);
+		return err;
+	}
+
+	genlmsg_end(reply, ovs_reply_header);
+	return genlmsg_reply(reply, info);
+}
+
+static int ovs_ct_limit_cmd_del(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr **a = info->attrs;
+	struct ovs_ct_limit_info *ct_limit_info = ct_limit_info_get(skb);
+	struct ovs_header *ovs_reply_header;
+	struct sk_buff *reply;
+
+	if (!ct_limit_info)
+		return -ENOMEM;
+	if (!a[OVS_CT_LIMIT_ATTR_ZONE_LIMIT])
+		return -EINVAL;
+
+	reply = ovs_ct_limit_cmd_reply_start(info, OVS_CT_LIMIT_CMD_DEL,
+					     &ovs_reply_header);
+	if (IS_ERR(reply))
+		return PTR_ERR(reply);
+
+	ct_limit_for_each(a[OVS_CT_LIMIT_ATTR_ZONE_LIMIT], ct_limit_del_one,
+			  ct_limit_info);
+
+	genlmsg_end(reply, ovs_reply_header);
+	return genlmsg_reply(reply, info);
+}
+
+static int ovs_ct_limit_cmd_get(struct sk_buff *skb, struct genl_info *info)
+{
+	struct nlattr **a = info->attrs;
+	struct ovs_ct_limit_info *ct_limit_info = ct_limit_info_get(skb);
+	struct ovs_header *ovs_reply_header;
+	struct ct_limit_get_arg arg;
+	struct nlattr *nla_reply;
+	struct sk_buff *reply;
+	int err;
+
+	if (!ct_limit_info)
+		return -ENOMEM;
+
+	reply = ovs_ct_limit_cmd_reply_start(info, OVS_CT_LIMIT_CMD_GET,
+					     &ovs_reply_header);
+	if (IS_ERR(reply))
+		return PTR_ERR(reply);
+
+	nla_reply = nla_nest_start(reply, OVS_CT_LIMIT_ATTR_ZONE_LIMIT);
+	if (!nla_reply) {
+		err = -EMSGSIZE;
+		goto exit_err;
+	}
+
+	if (a[OVS_CT_LIMIT_ATTR_ZONE_LIMIT]) {
+		arg.info = ct_limit_info;
+		arg.reply = reply;
+		err = ct_limit_for_each(a[OVS_CT_LIMIT_ATTR_ZONE_LIMIT],
+					ct_limit_get_one, &arg);
+	} else {
+		err = ct_limit_get_all(ct_limit_info, reply);
+	}
+	if (err)
+		goto exit_err;
+
+	nla_nest_end(reply, nla_reply);
+	genlmsg_end(reply, ovs_reply_header);
+	return genlmsg_reply(reply, info);
+
+exit_err:
+	nlmsg_free(reply);
+	return err;
+}
+
+static const struct nla_policy ct_limit_policy[OVS_CT_LIMIT_ATTR_MAX + 1] = {
+	[OVS_CT_LIMIT_ATTR_ZONE_LIMIT] = { .type = NLA_NESTED, },
+};
+
+static struct genl_ops ct_limit_genl_ops[] = {
+	{ .cmd = OVS_CT_LIMIT_CMD_SET,
+	  .flags = GENL_UNS_ADMIN_PERM, /* Requires CAP_NET_ADMIN privilege. */
+	  .policy = ct_limit_policy,
+	  .doit = ovs_ct_limit_cmd_set,
+	},
+	{ .cmd = OVS_CT_LIMIT_CMD_DEL,
+	  .flags = GENL_UNS_ADMIN_PERM, /* Requires CAP_NET_ADMIN privilege. */
+	  .policy = ct_limit_policy,
+	  .doit = ovs_ct_limit_cmd_del,
+	},
+	{ .cmd = OVS_CT_LIMIT_CMD_GET,
+	  .flags = 0,		  /* OK for unprivileged users. */
+	  .policy = ct_limit_policy,
+	  .doit = ovs_ct_limit_cmd_get,
+	},
+};
+
+static struct genl_multicast_group ovs_ct_limit_multicast_group = {
+	.name = OVS_CT_LIMIT_MCGROUP,
+};
+
+struct genl_family dp_ct_limit_genl_family __ro_after_init = {
+	.hdrsize = sizeof(struct ovs_header),
+	.name = OVS_CT_LIMIT_FAMILY,
+	.version = OVS_CT_LIMIT_VERSION,
+	.maxattr = OVS_CT_LIMIT_ATTR_MAX,
+	.netnsok = true,
+	.parallel_ops = true,
+	.ops = ct_limit_genl_ops,
+	.n_ops = ARRAY_SIZE(ct_limit_genl_ops),
+	.mcgrps = &ovs_ct_limit_multicast_group,
+	.n_mcgrps = 1,
+	.module = THIS_MODULE,
+};
+
 void ovs_ct_init(struct net *net)
 {
 	unsigned int n_bits = sizeof(struct ovs_key_ct_labels) * BITS_PER_BYTE;
@@ -1708,6 +2737,14 @@ void ovs_ct_init(struct net *net)
 	} else {
 		ovs_net->xt_label = true;
 	}
+
+	ovs_net->ct_frags = ovs_ct_frags_alloc();
+	if (!ovs_net->ct_frags)
+		OVS_NLERR(true, "Failed to allocate ct fragment table");
+
+	ovs_net->ct_limit_info = ovs_ct_limit_init(net);
+	if (!ovs_net->ct_limit_info)
+		OVS_NLERR(true, "Failed to allocate ct limit table");
 }
 
 void ovs_ct_exit(struct net *net)
@@ -1716,6 +2753,17 @@ void ovs_ct_exit(struct net *net)
 
 	if (ovs_net->xt_label)
 		nf_connlabels_put(net);
+
+	/* Wait out packets of the datapaths destroyed by ovs_exit_net(). */
+	synchronize_rcu();
+
+	/* The cache is shared by all namespaces; entries of the others are
+	 * refilled by their next packets.  This also empties it on module
+	 * exit, which runs this for every namespace.
+	 */
+	ovs_ct_cache_flush();
+	ovs_ct_frags_free(ovs_net->ct_frags);
+	ovs_ct_limit_exit(ovs_net->ct_limit_info);
 }
 
 #endif /* CONFIG_NF_CONNTRACK */
@@ -28,6 +28,9 @@ int ovs_ct_copy_action(struct net *, const struct nlattr *,
 		       const struct sw_flow_key *, struct sw_flow_actions **,
 		       bool log);
 int ovs_ct_action_to_attr(const struct ovs_conntrack_info *, struct sk_buff *);
+bool ovs_ct_action_nat(const struct ovs_conntrack_info *);
+
+extern struct genl_family dp_ct_limit_genl_family;
 
 int ovs_ct_execute(struct net *, struct sk_buff *, struct sw_flow_key *,
 		   const struct ovs_conntrack_info *);
@@ -66,6 +69,11 @@ static inline int ovs_ct_action_to_attr(const struct ovs_conntrack_info *info,
 	return -ENOTSUPP;
 }
 
+static inline bool ovs_ct_action_nat(const struct ovs_conntrack_info *info)
+{
+	return false;
+}
+
 static inline int ovs_ct_execute(struct net *net, struct sk_buff *skb,
 				 struct sw_flow_key *key,
 				 const struct ovs_conntrack_info *info)
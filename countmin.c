@@ -59,4 +59,53 @@ void delete_countmin_sketch(struct countmin_sketch* this) {
     kfree(this->masks);
     kfree(this->data);
     kfree(this);
+}
+
+struct countmin_sketch* countmin_sketch_resize(struct countmin_sketch* this, int w) {
+    struct countmin_sketch* sketch;
+    if (w <= 0) {
+        return NULL;
+    }
+    sketch = new (struct countmin_sketch);
+    if (!sketch) {
+        return NULL;
+    }
+    sketch->w = w;
+    sketch->d = this->d;
+    sketch->masks = newarr(uint32_t, this->d);
+    sketch->data = newarr(elemtype, w * this->d);
+    if (!sketch->masks || !sketch->data) {
+        delete_countmin_sketch(sketch);
+        return NULL;
+    }
+    memcpy(sketch->masks, this->masks, this->d * sizeof(uint32_t));
+    return sketch;
+}
+
+// Folding: (x % w) % (w / k) == x % (w / k), so each counter of 'other'
+// lands in the same bucket the key would have hashed to in 'this'.
+// Expanding: the k counters j of 'this' with j % other->w == b all inherit
+// bucket b, which is the only old bucket any of their keys could have hit.
+int countmin_sketch_merge(struct countmin_sketch* this, struct countmin_sketch* other) {
+    int i, j;
+    if (this->d != other->d || (other->w % this->w != 0 && this->w % other->w != 0)) {
+        return -1;
+    }
+    for (i = 0; i < this->d; ++i) {
+        if (this->masks[i] != other->masks[i]) {
+            return -1;
+        }
+    }
+    for (i = 0; i < this->d; ++i) {
+        if (other->w >= this->w) {
+            for (j = 0; j < other->w; ++j) {
+                this->data[this->w * i + j % this->w] += other->data[other->w * i + j];
+            }
+        } else {
+            for (j = 0; j < this->w; ++j) {
+                this->data[this->w * i + j] += other->data[other->w * i + j % other->w];
+            }
+        }
+    }
+    return 0;
 }
\ No newline at end of file
@@ -17,4 +17,11 @@ elemtype countmin_sketch_query(struct countmin_sketch* this, struct flow_key* ke
 
 void delete_countmin_sketch(struct countmin_sketch* this);
 
+// Width changes. A resized sketch shares the row masks of 'this', so counters
+// of a wider sketch can be folded into a narrower one whose width divides it,
+// and a sketch can be expanded into one whose width is a multiple of its own.
+struct countmin_sketch* countmin_sketch_resize(struct countmin_sketch* this, int w);
+
+int countmin_sketch_merge(struct countmin_sketch* this, struct countmin_sketch* other);
+
 #endif
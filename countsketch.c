@@ -51,9 +51,15 @@ struct countsketch_sketch* new_countsketch_sketch(int w, int d) {
 void delete_countsketch_sketch(struct countsketch_sketch* this) {
     int i = 0;
     for (i = 0; i < this->d; i++) {
-        delete_countsketch_line(this->lines[i]);
+        if (this->lines[i]) {
+            delete_countsketch_line(this->lines[i]);
+        }
     }
     kfree(this->lines);
+    if (this->heap) {
+        delete_hash_heap(this->heap);
+    }
+    kfree(this);
 }
 
 elemtype countsketch_sketch_forcequery(struct countsketch_sketch* this, struct flow_key* key) {
@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2015 Nicira, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/kconfig.h>
+
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+
+#include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/random.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <net/ip.h>
+
+#include "ct_frag.h"
+
+/* IPv4 reassembly for the conntrack action.
+ *
+ * Fragments wait in shards that each have their own lock, LRU list and
+ * memory budget, rather than in the namespace-wide IP defrag table.  The
+ * shard is picked from the fields that every fragment of a datagram carries,
+ * so fragments that reach different CPUs still meet, and there are as many
+ * shards as CPUs so that unrelated datagrams rarely share a lock.
+ *
+ * A shard that goes over its budget frees its least recently touched queues.
+ * Queues are also accounted to their conntrack zone, and one zone may use at
+ * most half of a shard, so a flood of fragments in one zone cannot push out
+ * the datagrams of the others.
+ */
+
+#define OVS_FRAG_BUCKETS	64
+#define OVS_FRAG_ZONE_BUCKETS	16
+#define OVS_FRAG_TIMEOUT	(30 * HZ)
+#define OVS_FRAG_MEM		(4 * 1024 * 1024)
+#define OVS_FRAG_SHARD_MEM_MIN	(256 * 1024)
+
+struct ovs_frag_cb {
+	int offset;
+	int end;
+};
+#define OVS_FRAG_CB(skb) ((struct ovs_frag_cb *)(skb)->cb)
+
+/* Memory of the queues of one zone in a shard, while it has any. */
+struct ovs_frag_zone {
+	struct hlist_node node;
+	u16 zone;
+	unsigned int mem;
+};
+
+struct ovs_frag_queue {
+	struct hlist_node hash_node;
+	struct list_head lru_node;
+	__be32 saddr;
+	__be32 daddr;
+	__be16 id;
+	u8 protocol;
+	bool last_in;
+	u16 zone;
+	u16 max_size;		/* Largest fragment, for refragmentation. */
+	struct ovs_frag_zone *zone_acct;
+	struct sk_buff *fragments;	/* Sorted by offset. */
+	int len;		/* Payload length of the datagram, once known. */
+	int meat;		/* Payload bytes received. */
+	unsigned int mem;
+	unsigned long expires;
+};
+
+struct ovs_frag_shard {
+	spinlock_t lock;
+	struct list_head lru;
+	unsigned int mem;
+	struct hlist_head zones[OVS_FRAG_ZONE_BUCKETS];
+	struct hlist_head buckets[OVS_FRAG_BUCKETS];
+} ____cacheline_aligned_in_smp;
+
+struct ovs_ct_frags {
+	struct delayed_work gc;
+	u32 hash_seed;
+	unsigned int shard_mem;
+	unsigned int n_shards;
+	struct ovs_frag_shard shards[];
+};
+
+static struct ovs_frag_zone *frag_zone_find(struct ovs_frag_shard *s,
+					    u16 zone)
+{
+	struct ovs_frag_zone *z;
+
+	hlist_for_each_entry(z, &s->zones[zone & (OVS_FRAG_ZONE_BUCKETS - 1)],
+			     node)
+		if (z->zone == zone)
+			return z;
+	return NULL;
+}
+
+static unsigned int frag_zone_mem(struct ovs_frag_shard *s, u16 zone)
+{
+	struct ovs_frag_zone *z = frag_zone_find(s, zone);
+
+	return z ? z->mem : 0;
+}
+
+static void frag_account(struct ovs_frag_shard *s, struct ovs_frag_queue *q,
+			 unsigned int mem)
+{
+	q->mem += mem;
+	s->mem += mem;
+	q->zone_acct->mem += mem;
+}
+
+static void frag_unlink(struct ovs_frag_shard *s, struct ovs_frag_queue *q)
+{
+	struct ovs_frag_zone *z = q->zone_acct;
+
+	hlist_del(&q->hash_node);
+	list_del(&q->lru_node);
+	s->mem -= q->mem;
+	z->mem -= q->mem;
+	if (!z->mem) {
+		hlist_del(&z->node);
+		kfree(z);
+	}
+}
+
+static void frag_kill(struct ovs_frag_shard *s, struct ovs_frag_queue *q)
+{
+	frag_unlink(s, q);
+	kfree_skb_list(q->fragments);
+	kfree(q);
+}
+
+/* Frees queues from the cold end of the LRU list while they have expired or
+ * the shard could not take 'extra' more bytes.
+ */
+static void frag_evict(struct ovs_ct_frags *f, struct ovs_frag_shard *s,
+		       unsigned int extra)
+{
+	struct ovs_frag_queue *q, *n;
+
+	list_for_each_entry_safe(q, n, &s->lru, lru_node) {
+		if (s->mem + extra <= f->shard_mem &&
+		    time_before(jiffies, q->expires))
+			break;
+		frag_kill(s, q);
+	}
+}
+
+static struct ovs_frag_queue *frag_find(struct ovs_frag_shard *s,
+					struct hlist_head *head,
+					const struct iphdr *iph, u16 zone)
+{
+	struct ovs_frag_queue *q;
+
+	hlist_for_each_entry(q, head, hash_node) {
+		if (q->id != iph->id || q->saddr != iph->saddr ||
+		    q->daddr != iph->daddr || q->protocol != iph->protocol ||
+		    q->zone != zone)
+			continue;
+
+		if (time_before(jiffies, q->expires))
+			return q;
+
+		frag_kill(s, q);
+		break;
+	}
+
+	q = kzalloc(sizeof(*q), GFP_ATOMIC);
+	if (!q)
+		return NULL;
+
+	q->zone_acct = frag_zone_find(s, zone);
+	if (!q->zone_acct) {
+		q->zone_acct = kzalloc(sizeof(*q->zone_acct), GFP_ATOMIC);
+		if (!q->zone_acct) {
+			kfree(q);
+			return NULL;
+		}
+		q->zone_acct->zone = zone;
+		hlist_add_head(&q->zone_acct->node,
+			       &s->zones[zone & (OVS_FRAG_ZONE_BUCKETS - 1)]);
+	}
+
+	q->saddr = iph->saddr;
+	q->daddr = iph->daddr;
+	q->id = iph->id;
+	q->protocol = iph->protocol;
+	q->zone = zone;
+	q->expires = jiffies + OVS_FRAG_TIMEOUT;
+	hlist_add_head(&q->hash_node, head);
+	list_add_tail(&q->lru_node, &s->lru);
+	frag_account(s, q, sizeof(*q));
+
+	return q;
+}
+
+/* Joins the fragments of 'q' into one datagram in 'skb', which must be one of
+ * them.  The payload of the others is chained on the frag_list, as
+ * ip_defrag() does, so that ip_do_fragment() can split it the same way again.
+ * Frees all the fragments, 'skb' included, on error.
+ */
+static int frag_reasm(struct ovs_frag_queue *q, struct sk_buff *skb)
+{
+	struct sk_buff *head = q->fragments;
+	struct sk_buff *fp, **nextp;
+	struct iphdr *iph;
+	int ihl;
+
+	/* The caller goes on using 'skb', so it has to become the head. */
+	if (head != skb) {
+		fp = skb_clone(skb, GFP_ATOMIC);
+		if (!fp)
+			goto err;
+
+		fp->next = skb->next;
+		for (nextp = &q->fragments; *nextp != skb;
+		     nextp = &(*nextp)->next)
+			;
+		*nextp = fp;
+
+		skb_morph(skb, head);
+		skb->next = head->next;
+		q->fragments = skb;
+		consume_skb(head);
+		head = skb;
+	}
+
+	ihl = ip_hdrlen(head);
+	if (ihl + q->len > 65535)
+		goto err;
+
+	if (skb_unclone(head, GFP_ATOMIC) ||
+	    (skb_has_frag_list(head) && __skb_linearize(head)) ||
+	    pskb_trim(head, ihl + OVS_FRAG_CB(head)->end))
+		goto err;
+
+	for (fp = head->next; fp; fp = fp->next) {
+		int plen = OVS_FRAG_CB(fp)->end - OVS_FRAG_CB(fp)->offset;
+
+		if ((skb_has_frag_list(fp) && __skb_linearize(fp)) ||
+		    !pskb_pull(fp, ip_hdrlen(fp)) || pskb_trim(fp, plen))
+			goto err;
+
+		head->data_len += fp->len;
+		head->len += fp->len;
+		head->truesize += fp->truesize;
+	}
+	skb_shinfo(head)->frag_list = head->next;
+	head->next = NULL;
+
+	iph = ip_hdr(head);
+	iph->tot_len = htons(head->len);
+	iph->frag_off = 0;
+	ip_send_check(iph);
+	head->ip_summed = CHECKSUM_NONE;
+
+	memset(IPCB(head), 0, sizeof(*IPCB(head)));
+	IPCB(head)->frag_max_size = q->max_size;
+	return 0;
+
+err:
+	kfree_skb_list(q->fragments);
+	return -ENOMEM;
+}
+
+/* Queues IPv4 fragment 'skb', whose data starts at the IP header, for
+ * reassembly in 'zone'.  Returns 0 with the whole datagram in 'skb' once the
+ * last fragment is in, -EINPROGRESS if 'skb' was queued, or another negative
+ * errno if 'skb' was freed.  Must be called with bottom halves disabled.
+ */
+int ovs_ct_frag_gather(struct ovs_ct_frags *f, struct sk_buff *skb, u16 zone)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	int ihl = ip_hdrlen(skb);
+	struct ovs_frag_shard *s;
+	struct ovs_frag_queue *q;
+	struct sk_buff *prev, *next;
+	int offset, end, err;
+	u32 hash;
+
+	/* Longer packets have been trimmed to tot_len by the caller, so only
+	 * the bytes actually present may count, as in ip_frag_queue().
+	 */
+	if (ntohs(iph->tot_len) > skb->len) {
+		kfree_skb(skb);
+		return -EINVAL;
+	}
+
+	offset = (ntohs(iph->frag_off) & IP_OFFSET) << 3;
+	end = offset + skb->len - ihl;
+	if (iph->frag_off & htons(IP_MF))
+		end &= ~7;
+	if (end <= offset || ihl + end > 65535) {
+		kfree_skb(skb);
+		return -EINVAL;
+	}
+
+	skb_orphan(skb);
+	BUILD_BUG_ON(sizeof(struct ovs_frag_cb) > FIELD_SIZEOF(struct sk_buff, cb));
+	OVS_FRAG_CB(skb)->offset = offset;
+	OVS_FRAG_CB(skb)->end = end;
+
+	hash = jhash_3words((__force u32)iph->saddr, (__force u32)iph->daddr,
+			    ((__force u32)iph->id << 16) | iph->protocol,
+			    f->hash_seed ^ zone);
+	s = &f->shards[hash & (f->n_shards - 1)];
+
+	spin_lock(&s->lock);
+	if (frag_zone_mem(s, zone) + skb->truesize > f->shard_mem / 2) {
+		err = -ENOMEM;
+		goto drop;
+	}
+	frag_evict(f, s, skb->truesize);
+
+	q = frag_find(s, &s->buckets[(hash >> 16) & (OVS_FRAG_BUCKETS - 1)],
+		      iph, zone);
+	if (!q) {
+		err = -ENOMEM;
+		goto drop;
+	}
+
+	prev = NULL;
+	for (next = q->fragments; next; next = next->next) {
+		if (OVS_FRAG_CB(next)->offset >= offset)
+			break;
+		prev = next;
+	}
+
+	err = -EINVAL;
+	if (next && OVS_FRAG_CB(next)->offset == offset &&
+	    OVS_FRAG_CB(next)->end == end)
+		goto drop;	/* Duplicate. */
+	if ((prev && OVS_FRAG_CB(prev)->end > offset) ||
+	    (next && end > OVS_FRAG_CB(next)->offset))
+		goto kill;
+	if (!(iph->frag_off & htons(IP_MF))) {
+		if (next || (q->last_in && end != q->len))
+			goto kill;
+		q->last_in = true;
+		q->len = end;
+	} else if (q->last_in && end > q->len) {
+		goto kill;
+	}
+
+	skb->next = next;
+	if (prev)
+		prev->next = skb;
+	else
+		q->fragments = skb;
+	q->meat += end - offset;
+	q->max_size = max_t(u16, q->max_size, ntohs(iph->tot_len));
+	frag_account(s, q, skb->truesize);
+	list_move_tail(&q->lru_node, &s->lru);
+
+	if (!q->last_in || q->meat != q->len) {
+		spin_unlock(&s->lock);
+		return -EINPROGRESS;
+	}
+
+	frag_unlink(s, q);
+	spin_unlock(&s->lock);
+
+	err = frag_reasm(q, skb);
+	kfree(q);
+	return err;
+
+kill:
+	frag_kill(s, q);
+drop:
+	spin_unlock(&s->lock);
+	kfree_skb(skb);
+	return err;
+}
+
+/* Expired queues are otherwise only freed when their shard sees traffic. */
+static void frag_gc(struct work_struct *work)
+{
+	struct ovs_ct_frags *f = container_of(to_delayed_work(work),
+					      struct ovs_ct_frags, gc);
+	unsigned int i;
+
+	for (i = 0; i < f->n_shards; i++) {
+		struct ovs_frag_shard *s = &f->shards[i];
+		struct ovs_frag_queue *q, *n;
+
+		spin_lock_bh(&s->lock);
+		list_for_each_entry_safe(q, n, &s->lru, lru_node)
+			if (time_after_eq(jiffies, q->expires))
+				frag_kill(s, q);
+		spin_unlock_bh(&s->lock);
+	}
+
+	schedule_delayed_work(&f->gc, OVS_FRAG_TIMEOUT);
+}
+
+struct ovs_ct_frags *ovs_ct_frags_alloc(void)
+{
+	unsigned int n_shards = roundup_pow_of_two(num_possible_cpus());
+	struct ovs_ct_frags *f;
+	unsigned int i;
+
+	f = vzalloc(sizeof(*f) + n_shards * sizeof(struct ovs_frag_shard));
+	if (!f)
+		return NULL;
+
+	f->n_shards = n_shards;
+	f->shard_mem = max_t(unsigned int, OVS_FRAG_MEM / n_shards,
+			     OVS_FRAG_SHARD_MEM_MIN);
+	get_random_bytes(&f->hash_seed, sizeof(f->hash_seed));
+	for (i = 0; i < n_shards; i++) {
+		struct ovs_frag_shard *s = &f->shards[i];
+
+		spin_lock_init(&s->lock);
+		INIT_LIST_HEAD(&s->lru);
+	}
+
+	INIT_DELAYED_WORK(&f->gc, frag_gc);
+	schedule_delayed_work(&f->gc, OVS_FRAG_TIMEOUT);
+	return f;
+}
+
+void ovs_ct_frags_free(struct ovs_ct_frags *f)
+{
+	unsigned int i;
+
+	if (!f)
+		return;
+
+	cancel_delayed_work_sync(&f->gc);
+	for (i = 0; i < f->n_shards; i++) {
+		struct ovs_frag_shard *s = &f->shards[i];
+		struct ovs_frag_queue *q, *n;
+
+		list_for_each_entry_safe(q, n, &s->lru, lru_node)
+			frag_kill(s, q);
+	}
+	vfree(f);
+}
+
+#endif /* CONFIG_NF_CONNTRACK */
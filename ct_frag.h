@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2015 Nicira, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef OVS_CT_FRAG_H
+#define OVS_CT_FRAG_H 1
+
+#include <linux/skbuff.h>
+#include <linux/types.h>
+
+struct ovs_ct_frags;
+
+struct ovs_ct_frags *ovs_ct_frags_alloc(void);
+void ovs_ct_frags_free(struct ovs_ct_frags *);
+
+int ovs_ct_frag_gather(struct ovs_ct_frags *, struct sk_buff *, u16 zone);
+
+#endif /* ct_frag.h */
@@ -39,6 +39,7 @@
 #include <linux/version.h>
 #include <linux/ethtool.h>
 #include <linux/wait.h>
+#include <linux/vmalloc.h>
 #include <asm/div64.h>
 #include <linux/highmem.h>
 #include <linux/netfilter_bridge.h>
@@ -58,6 +59,7 @@
 #include "flow_table.h"
 #include "flow_netlink.h"
 #include "gso.h"
+#include "upcall_ring.h"
 #include "vport-internal_dev.h"
 #include "vport-netdev.h"
 #include "countmax.h"
@@ -68,6 +70,8 @@
 
 unsigned int ovs_net_id __read_mostly;
 
+DEFINE_STATIC_KEY_FALSE(ovs_dp_stage_stats_key);
+
 static struct genl_family dp_packet_genl_family;
 static struct genl_family dp_flow_genl_family;
 static struct genl_family dp_datapath_genl_family;
@@ -210,6 +214,8 @@ static void destroy_dp_rcu(struct rcu_head *rcu)
 
 	ovs_flow_tbl_destroy(&dp->table);
 	free_percpu(dp->stats_percpu);
+	free_percpu(dp->stage_stats);
+	free_percpu(dp->pending_misses);
 	kfree(dp->ports);
 	kfree(dp);
 }
@@ -261,58 +267,286 @@ void ovs_dp_detach_port(struct vport *p)
 }
 
 
+/* Hashes the fields of 'key' that identify a miss to userspace.  The same
+ * hash is computed over the unmasked key of a flow being installed, so these
+ * must be fields that userspace echoes back from the upcall key.
+ */
+static u32 dp_miss_hash(const struct sw_flow_key *key)
+{
+	u32 hash;
+
+	hash = jhash_3words(key->recirc_id, key->phy.in_port,
+			    (__force u32)key->eth.type, 0);
+	if (key->eth.type == htons(ETH_P_IP))
+		hash = jhash2((const u32 *)&key->ipv4.addr,
+			      sizeof(key->ipv4.addr) / sizeof(u32), hash);
+	else if (key->eth.type == htons(ETH_P_IPV6))
+		hash = jhash2((const u32 *)&key->ipv6.addr,
+			      sizeof(key->ipv6.addr) / sizeof(u32), hash);
+	else
+		return jhash(key->eth.src, 2 * ETH_ALEN, hash);
+
+	return jhash_2words(key->ip.proto,
+			    (__force u32)key->tp.src << 16 |
+			    (__force u32)key->tp.dst, hash);
+}
+
+static struct dp_pending_miss *dp_pending_miss(struct dp_pending_misses *pm,
+					       u32 hash)
+{
+	return &pm->entries[hash & (DP_PENDING_MISSES - 1)];
+}
+
+/* Forgets the pending miss with 'hash' on every CPU, now that a flow for it
+ * is installed.  Called with ovs_mutex.
+ */
+static void dp_clear_pending_miss(struct datapath *dp, u32 hash)
+{
+	struct dp_pending_miss *pending;
+	int cpu;
+
+	if (!hash || !(dp->user_features & OVS_DP_F_MISS_DEDUP))
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pending = dp_pending_miss(per_cpu_ptr(dp->pending_misses, cpu),
+					  hash);
+		if (READ_ONCE(pending->hash) == hash)
+			WRITE_ONCE(pending->hash, 0);
+	}
+}
+
+/* Decides whether a miss for 'key' on input port 'p' goes to userspace.  A
+ * miss is dropped if it is pending on this CPU (see struct dp_pending_miss),
+ * or if 'p' is over its upcall rate.
+ */
+static bool dp_upcall_admit(struct datapath *dp, struct vport *p,
+			    const struct sw_flow_key *key)
+{
+	struct dp_pending_miss *pending = NULL;
+	struct dp_stats_percpu *stats;
+	unsigned long now = jiffies;
+	bool repeat = false;
+	u32 hash = 0;
+
+	if (dp->user_features & OVS_DP_F_MISS_DEDUP)
+		hash = dp_miss_hash(key);
+
+	if (hash) {
+		pending = dp_pending_miss(this_cpu_ptr(dp->pending_misses),
+					  hash);
+		repeat = READ_ONCE(pending->hash) == hash &&
+			 time_before(now, pending->last +
+					  DP_PENDING_MISS_WINDOW);
+		if (repeat) {
+			pending->last = now;
+			if (time_before(now, pending->first +
+					     DP_PENDING_MISS_WINDOW) &&
+			    pending->n_dropped < DP_PENDING_MISS_DROPS) {
+				pending->n_dropped++;
+				stats = this_cpu_ptr(dp->stats_percpu);
+				u64_stats_update_begin(&stats->syncp);
+				stats->n_upcall_dedup++;
+				u64_stats_update_end(&stats->syncp);
+				return false;
+			}
+		}
+	}
+
+	if (!ovs_vport_upcall_allowed(p)) {
+		stats = this_cpu_ptr(dp->stats_percpu);
+		u64_stats_update_begin(&stats->syncp);
+		stats->n_upcall_ratelimited++;
+		u64_stats_update_end(&stats->syncp);
+		return false;
+	}
+
+	if (pending) {
+		if (!repeat) {
+			WRITE_ONCE(pending->hash, hash);
+			pending->first = now;
+			pending->last = now;
+		}
+		pending->n_dropped = 0;
+	}
+	return true;
+}
+
+DEFINE_PER_CPU(const struct sw_flow *, ovs_dp_recirc_from);
+
 // static int collecting = 0;
 // static uint32_t packet_count = 0;
 // static uint32_t begin_jiffies = 0;
 // static uint32_t end_jiffies = 0;
-/* Must be called with rcu_read_lock. */
-void ovs_dp_process_packet(struct sk_buff *skb, struct sw_flow_key *key)
+/* Executes 'flow' on 'skb', or sends 'skb' to userspace as a miss if 'flow'
+ * is NULL.  Returns true if there was a flow.
+ */
+static bool dp_process_flow(struct datapath *dp, struct sk_buff *skb,
+			    struct sw_flow_key *key, struct sw_flow *flow)
 {
-	const struct vport *p = OVS_CB(skb)->input_vport;
-	struct datapath *dp = p->dp;
-	struct sw_flow *flow;
+	struct vport *p = OVS_CB(skb)->input_vport;
+	const struct sw_flow *from;
 	struct sw_flow_actions *sf_acts;
-	struct dp_stats_percpu *stats;
-	u64 *stats_counter;
-	u32 n_mask_hit;
+	cycles_t start;
 
-	stats = this_cpu_ptr(dp->stats_percpu);
-	my_label_sketch(p->dev->name, skb, key);
-	/* Look up flow. */
-	flow = ovs_flow_tbl_lookup_stats(&dp->table, key, skb_get_hash(skb),
-					 &n_mask_hit);
 	if (unlikely(!flow)) {
 		struct dp_upcall_info upcall;
 		int error;
 
+		if (!dp_upcall_admit(dp, p, key)) {
+			kfree_skb(skb);
+			return false;
+		}
+
 		memset(&upcall, 0, sizeof(upcall));
 		upcall.cmd = OVS_PACKET_CMD_MISS;
 		upcall.portid = ovs_vport_find_upcall_portid(p, skb);
 		upcall.mru = OVS_CB(skb)->mru;
+		start = ovs_dp_stage_begin();
 		error = ovs_dp_upcall(dp, skb, key, &upcall, 0);
+		ovs_dp_stage_end(dp, DP_STAGE_UPCALL, start);
 		if (unlikely(error))
 			kfree_skb(skb);
 		else
 			consume_skb(skb);
-		stats_counter = &stats->n_missed;
-		goto out;
+		return false;
 	}
-	OVS_CB(skb)->input_vport->dev->name;
 	//countmax_sketch_update(countmax, &empty_key,1);
 	ovs_flow_stats_update(flow, key->tp.flags, skb);
 	sf_acts = rcu_dereference(flow->sf_acts);
+
+	/* Conntrack may reassemble fragments, which changes the key in ways
+	 * the recirculation cache does not account for.
+	 */
+	from = __this_cpu_read(ovs_dp_recirc_from);
+	__this_cpu_write(ovs_dp_recirc_from,
+			 sf_acts->ct_recirc &&
+			 key->ip.frag == OVS_FRAG_TYPE_NONE ? flow : NULL);
+	start = ovs_dp_stage_begin();
 	ovs_execute_actions(dp, skb, sf_acts, key);
+	ovs_dp_stage_end(dp, DP_STAGE_EXECUTE, start);
+	__this_cpu_write(ovs_dp_recirc_from, from);
 
-	stats_counter = &stats->n_hit;
+	return true;
+}
 
-out:
+static void dp_stats_account(struct datapath *dp, u64 n_hit, u64 n_missed,
+			     u32 n_mask_hit)
+{
+	struct dp_stats_percpu *stats = this_cpu_ptr(dp->stats_percpu);
 
-	/* Update datapath statistics. */
 	u64_stats_update_begin(&stats->syncp);
-	(*stats_counter)++;
+	stats->n_hit += n_hit;
+	stats->n_missed += n_missed;
 	stats->n_mask_hit += n_mask_hit;
 	u64_stats_update_end(&stats->syncp);
+}
+
+static void __ovs_dp_process_packet(struct sk_buff *skb,
+				    struct sw_flow_key *key,
+				    const struct sw_flow *from)
+{
+	const struct vport *p = OVS_CB(skb)->input_vport;
+	struct datapath *dp = p->dp;
+	struct sw_flow *flow;
+	u32 n_mask_hit;
+	cycles_t start;
+
+	start = ovs_dp_stage_begin();
+	my_label_sketch(p->dev->name, skb, key);
+	ovs_dp_stage_end(dp, DP_STAGE_SKETCH, start);
+
+	/* Look up flow. */
+	start = ovs_dp_stage_begin();
+	if (from)
+		flow = ovs_flow_tbl_lookup_recirc(&dp->table, from, key,
+						  skb_get_hash(skb),
+						  &n_mask_hit);
+	else
+		flow = ovs_flow_tbl_lookup_stats(&dp->table, key,
+						 skb_get_hash(skb),
+						 &n_mask_hit);
+	ovs_dp_stage_end(dp, DP_STAGE_LOOKUP, start);
+
+	if (dp_process_flow(dp, skb, key, flow))
+		dp_stats_account(dp, 1, 0, n_mask_hit);
+	else
+		dp_stats_account(dp, 0, 1, n_mask_hit);
+}
+
+/* Must be called with rcu_read_lock. */
+void ovs_dp_process_packet(struct sk_buff *skb, struct sw_flow_key *key)
+{
+	__ovs_dp_process_packet(skb, key, NULL);
+}
+
+/* Processes 'skb' recirculated by the flow 'from', which may be NULL if it
+ * was not recirculated right after conntrack.  Must be called with
+ * rcu_read_lock.
+ */
+void ovs_dp_process_recirc(struct sk_buff *skb, struct sw_flow_key *key,
+			   const struct sw_flow *from)
+{
+	__ovs_dp_process_packet(skb, key, from);
+}
+
+/* Like ovs_dp_process_packet(), for 'n' packets received on ports of 'dp',
+ * with one batched flow lookup.  'n' must not exceed FLOW_TBL_BATCH_MAX.  The
+ * lookup stage is accounted as one sample per batch.  Must be called with
+ * rcu_read_lock and bottom halves disabled.
+ */
+void ovs_dp_process_packet_batch(struct datapath *dp, struct sk_buff **skbs,
+				 struct sw_flow_key *keys, int n)
+{
+	struct sw_flow *flows[FLOW_TBL_BATCH_MAX];
+	u32 hashes[FLOW_TBL_BATCH_MAX];
+	u64 n_hit = 0;
+	u32 n_mask_hit;
+	cycles_t start;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		const struct vport *p = OVS_CB(skbs[i])->input_vport;
+
+		start = ovs_dp_stage_begin();
+		my_label_sketch(p->dev->name, skbs[i], &keys[i]);
+		ovs_dp_stage_end(dp, DP_STAGE_SKETCH, start);
+		hashes[i] = skb_get_hash(skbs[i]);
+	}
 
+	start = ovs_dp_stage_begin();
+	ovs_flow_tbl_lookup_batch(&dp->table, keys, hashes, flows, n,
+				  &n_mask_hit);
+	ovs_dp_stage_end(dp, DP_STAGE_LOOKUP, start);
+
+	for (i = 0; i < n; i++)
+		n_hit += dp_process_flow(dp, skbs[i], &keys[i], flows[i]);
+
+	dp_stats_account(dp, n_hit, n - n_hit, n_mask_hit);
+}
+
+/* Must be called with rcu_read_lock and bottom halves disabled. */
+void __ovs_dp_stage_account(struct datapath *dp, enum dp_stage stage,
+			    cycles_t start)
+{
+	struct dp_stage_stats_percpu *stats;
+	struct ovs_dp_stage_stats *s;
+	u64 cycles = get_cycles() - start;
+	int bucket;
+
+	if (!(dp->user_features & OVS_DP_F_STAGE_STATS))
+		return;
+
+	bucket = cycles ? min_t(int, ilog2(cycles),
+				OVS_DP_STAGE_HIST_BUCKETS - 1) : 0;
+	stats = this_cpu_ptr(dp->stage_stats);
+	s = &stats->stage[stage];
+
+	u64_stats_update_begin(&stats->syncp);
+	s->n_samples++;
+	s->n_cycles += cycles;
+	s->hist[bucket]++;
+	u64_stats_update_end(&stats->syncp);
 }
 
 int ovs_dp_upcall(struct datapath *dp, struct sk_buff *skb,
@@ -328,9 +562,13 @@ int ovs_dp_upcall(struct datapath *dp, struct sk_buff *skb,
 		goto err;
 	}
 
-	if (!skb_is_gso(skb))
-		err = queue_userspace_packet(dp, skb, key, upcall_info, cutlen);
-	else
+	if (!skb_is_gso(skb)) {
+		err = ovs_upcall_ring_queue(ovs_dp_get_net(dp), get_dpifindex(dp),
+					    skb, key, upcall_info, cutlen);
+		if (err)
+			err = queue_userspace_packet(dp, skb, key, upcall_info,
+						     cutlen);
+	} else
 		err = queue_gso_packets(dp, skb, key, upcall_info, cutlen);
 	if (err)
 		goto err;
@@ -693,11 +931,15 @@ static struct genl_family dp_packet_genl_family __ro_after_init = {
 };
 
 static void get_dp_stats(const struct datapath *dp, struct ovs_dp_stats *stats,
-			 struct ovs_dp_megaflow_stats *mega_stats)
+			 struct ovs_dp_megaflow_stats *mega_stats,
+			 struct ovs_dp_miss_stats *miss_stats,
+			 struct ovs_dp_deferred_stats *deferred_stats)
 {
 	int i;
 
 	memset(mega_stats, 0, sizeof(*mega_stats));
+	memset(miss_stats, 0, sizeof(*miss_stats));
+	memset(deferred_stats, 0, sizeof(*deferred_stats));
 
 	stats->n_flows = ovs_flow_tbl_count(&dp->table);
 	mega_stats->n_masks = ovs_flow_tbl_num_masks(&dp->table);
@@ -720,6 +962,42 @@ static void get_dp_stats(const struct datapath *dp, struct ovs_dp_stats *stats,
 		stats->n_missed += local_stats.n_missed;
 		stats->n_lost += local_stats.n_lost;
 		mega_stats->n_mask_hit += local_stats.n_mask_hit;
+		miss_stats->n_dedup += local_stats.n_upcall_dedup;
+		miss_stats->n_ratelimited += local_stats.n_upcall_ratelimited;
+		deferred_stats->n_deferred += local_stats.n_deferred;
+		deferred_stats->n_dropped += local_stats.n_deferred_dropped;
+		deferred_stats->n_recursion_dropped +=
+			local_stats.n_recursion_dropped;
+		deferred_stats->max_depth = max(deferred_stats->max_depth,
+						local_stats.deferred_depth_max);
+	}
+}
+
+static void get_dp_stage_stats(const struct datapath *dp, enum dp_stage stage,
+			       struct ovs_dp_stage_stats *stats)
+{
+	int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for_each_possible_cpu(i) {
+		const struct dp_stage_stats_percpu *percpu_stats;
+		const struct ovs_dp_stage_stats *s;
+		struct ovs_dp_stage_stats local;
+		unsigned int start;
+
+		percpu_stats = per_cpu_ptr(dp->stage_stats, i);
+		s = &percpu_stats->stage[stage];
+
+		do {
+			start = u64_stats_fetch_begin_irq(&percpu_stats->syncp);
+			local = *s;
+		} while (u64_stats_fetch_retry_irq(&percpu_stats->syncp, start));
+
+		stats->n_samples += local.n_samples;
+		stats->n_cycles += local.n_cycles;
+		for (j = 0; j < OVS_DP_STAGE_HIST_BUCKETS; j++)
+			stats->hist[j] += local.hist[j];
 	}
 }
 
@@ -940,6 +1218,7 @@ static int ovs_flow_cmd_new(struct sk_buff *skb, struct genl_info *info)
 	struct sw_flow_actions *acts;
 	struct sw_flow_match match;
 	u32 ufid_flags = ovs_nla_get_ufid_flags(a[OVS_FLOW_ATTR_UFID_FLAGS]);
+	u32 miss_hash;
 	int error;
 	bool log = !a[OVS_FLOW_ATTR_PROBE];
 
@@ -980,6 +1259,7 @@ static int ovs_flow_cmd_new(struct sk_buff *skb, struct genl_info *info)
 	if (ovs_identifier_is_key(&new_flow->id))
 		match.key = new_flow->id.unmasked_key;
 
+	miss_hash = dp_miss_hash(&new_flow->key);
 	ovs_flow_mask_key(&new_flow->key, &new_flow->key, true, &mask);
 
 	/* Validate actions. */
@@ -1018,6 +1298,7 @@ static int ovs_flow_cmd_new(struct sk_buff *skb, struct genl_info *info)
 			acts = NULL;
 			goto err_unlock_ovs;
 		}
+		dp_clear_pending_miss(dp, miss_hash);
 
 		if (unlikely(reply)) {
 			error = ovs_flow_cmd_fill_info(new_flow,
@@ -1403,6 +1684,428 @@ unlock:
 	return err;
 }
 
+/* One operation of an OVS_FLOW_CMD_BATCH request. */
+struct flow_batch_op {
+	bool del;
+	int error;
+	struct sw_flow *new_flow;	/* Put: flow to insert, until inserted. */
+	struct sw_flow_actions *acts;	/* Put: actions, until installed. */
+	struct sw_flow_actions *old_acts; /* Put: replaced actions. */
+	struct sw_flow *flow;		/* Del: flow removed from the table. */
+	struct sw_flow_match match;
+	struct sw_flow_mask mask;	/* Put only. */
+	struct sw_flow_key key;		/* Del by key only. */
+	struct sw_flow_id ufid;		/* Del by UFID only. */
+	bool ufid_present;
+	u32 miss_hash;			/* Put: dp_miss_hash() of the key. */
+};
+
+static int flow_batch_parse_put(struct net *net, struct flow_batch_op *op,
+				struct nlattr **a)
+{
+	bool log = !a[OVS_FLOW_ATTR_PROBE];
+	struct sw_flow *new_flow;
+	int error;
+
+	if (!a[OVS_FLOW_ATTR_KEY] || !a[OVS_FLOW_ATTR_ACTIONS])
+		return -EINVAL;
+
+	new_flow = ovs_flow_alloc();
+	if (IS_ERR(new_flow))
+		return PTR_ERR(new_flow);
+
+	ovs_match_init(&op->match, &new_flow->key, false, &op->mask);
+	error = ovs_nla_get_match(net, &op->match, a[OVS_FLOW_ATTR_KEY],
+				  a[OVS_FLOW_ATTR_MASK], log);
+	if (error)
+		goto err_free_flow;
+
+	error = ovs_nla_get_identifier(&new_flow->id, a[OVS_FLOW_ATTR_UFID],
+				       &new_flow->key, log);
+	if (error)
+		goto err_free_flow;
+
+	/* unmasked key is needed to match when ufid is not used. */
+	if (ovs_identifier_is_key(&new_flow->id))
+		op->match.key = new_flow->id.unmasked_key;
+
+	op->miss_hash = dp_miss_hash(&new_flow->key);
+	ovs_flow_mask_key(&new_flow->key, &new_flow->key, true, &op->mask);
+
+	error = ovs_nla_copy_actions(net, a[OVS_FLOW_ATTR_ACTIONS],
+				     &new_flow->key, &op->acts, log);
+	if (error) {
+		OVS_NLERR(log, "Flow actions may not be safe on all matching packets.");
+		op->acts = NULL;
+		goto err_free_flow;
+	}
+
+	op->new_flow = new_flow;
+	return 0;
+
+err_free_flow:
+	ovs_flow_free(new_flow, false);
+	return error;
+}
+
+static int flow_batch_parse_del(struct net *net, struct flow_batch_op *op,
+				struct nlattr **a)
+{
+	bool log = !a[OVS_FLOW_ATTR_PROBE];
+
+	op->del = true;
+	op->ufid_present = ovs_nla_get_ufid(&op->ufid, a[OVS_FLOW_ATTR_UFID],
+					    log);
+	if (op->ufid_present)
+		return 0;
+
+	/* Unlike OVS_FLOW_CMD_DEL, a batch never flushes the table. */
+	if (!a[OVS_FLOW_ATTR_KEY])
+		return -EINVAL;
+
+	ovs_match_init(&op->match, &op->key, true, NULL);
+	return ovs_nla_get_match(net, &op->match, a[OVS_FLOW_ATTR_KEY], NULL,
+				 log);
+}
+
+/* Called with ovs_mutex. */
+static int flow_batch_put(struct datapath *dp, struct flow_batch_op *op,
+			  bool excl)
+{
+	struct sw_flow *new_flow = op->new_flow;
+	struct sw_flow *flow = NULL;
+	int error;
+
+	/* Check if this is a duplicate flow */
+	if (ovs_identifier_is_ufid(&new_flow->id))
+		flow = ovs_flow_tbl_lookup_ufid(&dp->table, &new_flow->id);
+	if (!flow)
+		flow = ovs_flow_tbl_lookup(&dp->table, &new_flow->key);
+	if (likely(!flow)) {
+		rcu_assign_pointer(new_flow->sf_acts, op->acts);
+		op->acts = NULL;
+
+		error = ovs_flow_tbl_insert(&dp->table, new_flow, &op->mask);
+		if (unlikely(error))
+			return error;
+		dp_clear_pending_miss(dp, op->miss_hash);
+
+		op->new_flow = NULL;
+		return 0;
+	}
+
+	if (unlikely(excl))
+		return -EEXIST;
+
+	/* The flow identifier has to be the same for flow updates.
+	 * Look for any overlapping flow.
+	 */
+	if (unlikely(!ovs_flow_cmp(flow, &op->match))) {
+		if (ovs_identifier_is_key(&flow->id))
+			flow = ovs_flow_tbl_lookup_exact(&dp->table,
+							 &op->match);
+		else /* UFID matches but key is different */
+			flow = NULL;
+		if (!flow)
+			return -ENOENT;
+	}
+
+	op->old_acts = ovsl_dereference(flow->sf_acts);
+	rcu_assign_pointer(flow->sf_acts, op->acts);
+	op->acts = NULL;
+	return 0;
+}
+
+/* Called with ovs_mutex. */
+static int flow_batch_del(struct datapath *dp, struct flow_batch_op *op)
+{
+	struct sw_flow *flow;
+
+	if (op->ufid_present)
+		flow = ovs_flow_tbl_lookup_ufid(&dp->table, &op->ufid);
+	else
+		flow = ovs_flow_tbl_lookup_exact(&dp->table, &op->match);
+	if (unlikely(!flow))
+		return -ENOENT;
+
+	ovs_flow_tbl_remove(&dp->table, flow);
+	op->flow = flow;
+	return 0;
+}
+
+static void flow_batch_free(struct flow_batch_op *ops, int n_ops)
+{
+	int i;
+
+	for (i = 0; i < n_ops; i++) {
+		struct flow_batch_op *op = &ops[i];
+
+		if (op->new_flow)
+			ovs_flow_free(op->new_flow, false);
+		if (op->acts)
+			ovs_nla_free_flow_actions(op->acts);
+		if (op->old_acts)
+			ovs_nla_free_flow_actions_rcu(op->old_acts);
+		if (op->flow)
+			ovs_flow_free(op->flow, true);
+	}
+	vfree(ops);
+}
+
+static int ovs_flow_cmd_batch(struct sk_buff *skb, struct genl_info *info)
+{
+	struct net *net = sock_net(skb->sk);
+	struct nlattr **a = info->attrs;
+	struct ovs_header *ovs_header = info->userhdr;
+	bool excl = info->nlhdr->nlmsg_flags & (NLM_F_CREATE | NLM_F_EXCL);
+	struct ovs_header *reply_header;
+	struct flow_batch_op *ops;
+	struct sk_buff *reply;
+	struct datapath *dp;
+	struct nlattr *nla;
+	s32 *status;
+	int n_ops = 0;
+	int error;
+	int rem;
+	int i;
+
+	if (!a[OVS_FLOW_ATTR_BATCH])
+		return -EINVAL;
+
+	nla_for_each_nested(nla, a[OVS_FLOW_ATTR_BATCH], rem)
+		n_ops++;
+	if (!n_ops || n_ops > OVS_FLOW_BATCH_MAX)
+		return -EINVAL;
+
+	ops = vzalloc(n_ops * sizeof(*ops));
+	if (!ops)
+		return -ENOMEM;
+
+	reply = genlmsg_new(NLMSG_ALIGN(sizeof(struct ovs_header)) +
+			    nla_total_size(n_ops * sizeof(s32)), GFP_KERNEL);
+	if (!reply) {
+		error = -ENOMEM;
+		goto err_free_ops;
+	}
+
+	/* Validate every operation before taking the lock. */
+	i = 0;
+	nla_for_each_nested(nla, a[OVS_FLOW_ATTR_BATCH], rem) {
+		struct nlattr *op_attrs[OVS_FLOW_ATTR_MAX + 1];
+		struct flow_batch_op *op = &ops[i++];
+
+		op->error = nla_parse_nested(op_attrs, OVS_FLOW_ATTR_MAX, nla,
+					     flow_policy, NULL);
+		if (op->error)
+			continue;
+
+		switch (nla_type(nla)) {
+		case OVS_FLOW_BATCH_ATTR_PUT:
+			op->error = flow_batch_parse_put(net, op, op_attrs);
+			break;
+		case OVS_FLOW_BATCH_ATTR_DEL:
+			op->error = flow_batch_parse_del(net, op, op_attrs);
+			break;
+		default:
+			op->error = -EINVAL;
+			break;
+		}
+	}
+
+	ovs_lock();
+	dp = get_dp(net, ovs_header->dp_ifindex);
+	if (unlikely(!dp)) {
+		ovs_unlock();
+		error = -ENODEV;
+		goto err_free_reply;
+	}
+
+	ovs_flow_tbl_batch_begin(&dp->table);
+	for (i = 0; i < n_ops; i++) {
+		struct flow_batch_op *op = &ops[i];
+
+		if (op->error)
+			continue;
+		if (op->del)
+			op->error = flow_batch_del(dp, op);
+		else
+			op->error = flow_batch_put(dp, op, excl);
+	}
+	ovs_flow_tbl_batch_end(&dp->table);
+	ovs_unlock();
+
+	reply_header = genlmsg_put(reply, info->snd_portid, info->snd_seq,
+				   &dp_flow_genl_family, 0,
+				   OVS_FLOW_CMD_BATCH);
+	BUG_ON(!reply_header);
+	reply_header->dp_ifindex = ovs_header->dp_ifindex;
+
+	nla = nla_reserve(reply, OVS_FLOW_ATTR_BATCH_STATUS,
+			  n_ops * sizeof(s32));
+	BUG_ON(!nla);
+	status = nla_data(nla);
+	for (i = 0; i < n_ops; i++)
+		status[i] = ops[i].error;
+	genlmsg_end(reply, reply_header);
+
+	flow_batch_free(ops, n_ops);
+	return genlmsg_reply(reply, info);
+
+err_free_reply:
+	kfree_skb(reply);
+err_free_ops:
+	flow_batch_free(ops, n_ops);
+	return error;
+}
+
+/* Called with RCU read lock. */
+static int ovs_flow_cmd_fill_gen(struct sk_buff *skb, int dp_ifindex,
+				 u32 portid, u32 seq, u64 gen)
+{
+	struct ovs_header *ovs_header;
+
+	ovs_header = genlmsg_put(skb, portid, seq, &dp_flow_genl_family,
+				 NLM_F_MULTI, OVS_FLOW_CMD_NEW);
+	if (!ovs_header)
+		return -EMSGSIZE;
+
+	ovs_header->dp_ifindex = dp_ifindex;
+
+	if (nla_put_u64_64bit(skb, OVS_FLOW_ATTR_DUMP_GEN, gen,
+			      OVS_FLOW_ATTR_PAD)) {
+		genlmsg_cancel(skb, ovs_header);
+		return -EMSGSIZE;
+	}
+
+	genlmsg_end(skb, ovs_header);
+	return 0;
+}
+
+static bool flow_changed_since(const struct sw_flow *flow, unsigned long gen)
+{
+	/* A packet that raced with the dump that started 'gen' may carry
+	 * the generation before it, so allow for one generation of slack.
+	 */
+	return !gen || READ_ONCE(flow->stats_gen) + 1 >= gen;
+}
+
+/* Called with RCU read lock.  Sets up the dump position in cb->args[0] and
+ * cb->args[1], the bucket to stop at in cb->args[2] and the generation to
+ * dump changes since in cb->args[3].
+ *
+ * Only a shard gets a bucket bound, computed from the instance the dump
+ * starts on.  An unsharded dump runs to the end of whatever instance it
+ * finds on each call, so a table expansion does not cut it short.
+ */
+static int ovs_flow_cmd_dump_start(struct sk_buff *skb,
+				   struct netlink_callback *cb,
+				   struct nlattr **a,
+				   const struct table_instance *ti,
+				   int dp_ifindex)
+{
+	u32 n_buckets = ti->n_buckets;
+
+	cb->args[2] = U32_MAX;
+	if (a[OVS_FLOW_ATTR_DUMP_SHARD]) {
+		const struct ovs_flow_dump_shard *shard;
+
+		shard = nla_data(a[OVS_FLOW_ATTR_DUMP_SHARD]);
+		if (!shard->n_shards || shard->index >= shard->n_shards)
+			return -EINVAL;
+
+		cb->args[0] = div_u64((u64)n_buckets * shard->index,
+				      shard->n_shards);
+		cb->args[2] = div_u64((u64)n_buckets * (shard->index + 1),
+				      shard->n_shards);
+	}
+
+	if (a[OVS_FLOW_ATTR_DUMP_GEN]) {
+		cb->args[3] = nla_get_u64(a[OVS_FLOW_ATTR_DUMP_GEN]);
+		return ovs_flow_cmd_fill_gen(skb, dp_ifindex,
+					     NETLINK_CB(cb->skb).portid,
+					     cb->nlh->nlmsg_seq,
+					     ovs_flow_stats_gen_next());
+	}
+
+	return 0;
+}
+
+/* Most stats deltas that fit into one attribute. */
+#define OVS_FLOW_STATS_DELTAS_MAX \
+	((U16_MAX - NLA_HDRLEN) / sizeof(struct ovs_flow_stats_delta))
+
+/* Called with RCU read lock.  Fills one message with as many stats deltas as
+ * fit, from the position in 'cb'.  Returns 0 at the end of the dump.
+ */
+static int ovs_flow_cmd_dump_packed(struct sk_buff *skb,
+				    struct netlink_callback *cb,
+				    struct table_instance *ti, int dp_ifindex)
+{
+	struct ovs_header *ovs_header;
+	struct nlattr *deltas;
+	struct sw_flow *flow;
+	u32 bucket, obj;
+	int n = 0;
+
+	ovs_header = genlmsg_put(skb, NETLINK_CB(cb->skb).portid,
+				 cb->nlh->nlmsg_seq, &dp_flow_genl_family,
+				 NLM_F_MULTI, OVS_FLOW_CMD_NEW);
+	if (!ovs_header)
+		return -EMSGSIZE;
+
+	ovs_header->dp_ifindex = dp_ifindex;
+
+	deltas = nla_reserve_64bit(skb, OVS_FLOW_ATTR_STATS_DELTAS, 0,
+				   OVS_FLOW_ATTR_PAD);
+	if (!deltas) {
+		genlmsg_cancel(skb, ovs_header);
+		return -EMSGSIZE;
+	}
+
+	while (skb_tailroom(skb) >= sizeof(struct ovs_flow_stats_delta) &&
+	       n < OVS_FLOW_STATS_DELTAS_MAX) {
+		struct ovs_flow_stats_delta *delta;
+		struct ovs_flow_stats stats;
+		__be16 tcp_flags;
+		unsigned long used;
+
+		bucket = cb->args[0];
+		obj = cb->args[1];
+		flow = ovs_flow_tbl_dump_next(ti, cb->args[2], &bucket, &obj);
+		if (!flow)
+			break;
+
+		cb->args[0] = bucket;
+		cb->args[1] = obj;
+
+		if (!ovs_identifier_is_ufid(&flow->id) ||
+		    !flow_changed_since(flow, cb->args[3]))
+			continue;
+
+		ovs_flow_stats_get(flow, &stats, &used, &tcp_flags);
+
+		delta = (struct ovs_flow_stats_delta *)
+			__skb_put(skb, sizeof(*delta));
+		memset(delta, 0, sizeof(*delta));
+		memcpy(delta->ufid, flow->id.ufid, flow->id.ufid_len);
+		delta->ufid_len = flow->id.ufid_len;
+		delta->n_packets = stats.n_packets;
+		delta->n_bytes = stats.n_bytes;
+		delta->used = used ? ovs_flow_used_time(used) : 0;
+		delta->tcp_flags = (u8)ntohs(tcp_flags);
+		n++;
+	}
+
+	if (!n) {
+		genlmsg_cancel(skb, ovs_header);
+		return 0;
+	}
+
+	deltas->nla_len = skb_tail_pointer(skb) - (unsigned char *)deltas;
+	genlmsg_end(skb, ovs_header);
+	return 0;
+}
+
 static int ovs_flow_cmd_dump(struct sk_buff *skb, struct netlink_callback *cb)
 {
 	struct nlattr *a[__OVS_FLOW_ATTR_MAX];
@@ -1426,17 +2129,35 @@ static int ovs_flow_cmd_dump(struct sk_buff *skb, struct netlink_callback *cb)
 	}
 
 	ti = rcu_dereference(dp->table.ti);
+	if (!cb->args[4]) {
+		err = ovs_flow_cmd_dump_start(skb, cb, a, ti,
+					      ovs_header->dp_ifindex);
+		if (err) {
+			rcu_read_unlock();
+			return err;
+		}
+		cb->args[4] = 1;
+	}
+
+	if (a[OVS_FLOW_ATTR_DUMP_PACKED]) {
+		err = ovs_flow_cmd_dump_packed(skb, cb, ti,
+					       ovs_header->dp_ifindex);
+		rcu_read_unlock();
+		return err && !skb->len ? err : skb->len;
+	}
+
 	for (;;) {
 		struct sw_flow *flow;
 		u32 bucket, obj;
 
 		bucket = cb->args[0];
 		obj = cb->args[1];
-		flow = ovs_flow_tbl_dump_next(ti, &bucket, &obj);
+		flow = ovs_flow_tbl_dump_next(ti, cb->args[2], &bucket, &obj);
 		if (!flow)
 			break;
 
-		if (ovs_flow_cmd_fill_info(flow, ovs_header->dp_ifindex, skb,
+		if (flow_changed_since(flow, cb->args[3]) &&
+		    ovs_flow_cmd_fill_info(flow, ovs_header->dp_ifindex, skb,
 					   NETLINK_CB(cb->skb).portid,
 					   cb->nlh->nlmsg_seq, NLM_F_MULTI,
 					   OVS_FLOW_CMD_NEW, ufid_flags) < 0)
@@ -1457,6 +2178,11 @@ static const struct nla_policy flow_policy[OVS_FLOW_ATTR_MAX + 1] = {
 	[OVS_FLOW_ATTR_PROBE] = { .type = NLA_FLAG },
 	[OVS_FLOW_ATTR_UFID] = { .type = NLA_UNSPEC, .len = 1 },
 	[OVS_FLOW_ATTR_UFID_FLAGS] = { .type = NLA_U32 },
+	[OVS_FLOW_ATTR_DUMP_SHARD] = { .type = NLA_UNSPEC,
+				       .len = sizeof(struct ovs_flow_dump_shard) },
+	[OVS_FLOW_ATTR_DUMP_GEN] = { .type = NLA_U64 },
+	[OVS_FLOW_ATTR_DUMP_PACKED] = { .type = NLA_FLAG },
+	[OVS_FLOW_ATTR_BATCH] = { .type = NLA_NESTED },
 };
 
 static struct genl_ops dp_flow_genl_ops[] = {
@@ -1481,6 +2207,11 @@ static struct genl_ops dp_flow_genl_ops[] = {
 	  .policy = flow_policy,
 	  .doit = ovs_flow_cmd_set,
 	},
+	{ .cmd = OVS_FLOW_CMD_BATCH,
+	  .flags = GENL_UNS_ADMIN_PERM, /* Requires CAP_NET_ADMIN privilege. */
+	  .policy = flow_policy,
+	  .doit = ovs_flow_cmd_batch,
+	},
 };
 
 static struct genl_family dp_flow_genl_family __ro_after_init = {
@@ -1504,11 +2235,45 @@ static size_t ovs_dp_cmd_msg_size(void)
 	msgsize += nla_total_size(IFNAMSIZ);
 	msgsize += nla_total_size_64bit(sizeof(struct ovs_dp_stats));
 	msgsize += nla_total_size_64bit(sizeof(struct ovs_dp_megaflow_stats));
+	msgsize += nla_total_size_64bit(sizeof(struct ovs_dp_miss_stats));
+	msgsize += nla_total_size_64bit(sizeof(struct ovs_dp_deferred_stats));
 	msgsize += nla_total_size(sizeof(u32)); /* OVS_DP_ATTR_USER_FEATURES */
+	msgsize += nla_total_size(sizeof(u32)); /* OVS_DP_ATTR_DEFERRED_LIMIT */
+
+	/* OVS_DP_ATTR_STAGE_STATS */
+	msgsize += nla_total_size(0);
+	msgsize += DP_STAGE_MAX *
+		   nla_total_size_64bit(sizeof(struct ovs_dp_stage_stats));
 
 	return msgsize;
 }
 
+/* Called with ovs_mutex. */
+static int ovs_dp_cmd_fill_stage_stats(const struct datapath *dp,
+				       struct sk_buff *skb)
+{
+	struct ovs_dp_stage_stats stats;
+	struct nlattr *start;
+	int stage;
+
+	start = nla_nest_start(skb, OVS_DP_ATTR_STAGE_STATS);
+	if (!start)
+		return -EMSGSIZE;
+
+	for (stage = 0; stage < DP_STAGE_MAX; stage++) {
+		get_dp_stage_stats(dp, stage, &stats);
+		if (nla_put_64bit(skb, OVS_DP_STAGE_ATTR_SKETCH + stage,
+				  sizeof(stats), &stats,
+				  OVS_DP_STAGE_ATTR_PAD)) {
+			nla_nest_cancel(skb, start);
+			return -EMSGSIZE;
+		}
+	}
+
+	nla_nest_end(skb, start);
+	return 0;
+}
+
 /* Called with ovs_mutex. */
 static int ovs_dp_cmd_fill_info(struct datapath *dp, struct sk_buff *skb,
 				u32 portid, u32 seq, u32 flags, u8 cmd)
@@ -1516,6 +2281,8 @@ static int ovs_dp_cmd_fill_info(struct datapath *dp, struct sk_buff *skb,
 	struct ovs_header *ovs_header;
 	struct ovs_dp_stats dp_stats;
 	struct ovs_dp_megaflow_stats dp_megaflow_stats;
+	struct ovs_dp_miss_stats dp_miss_stats;
+	struct ovs_dp_deferred_stats dp_deferred_stats;
 	int err;
 
 	ovs_header = genlmsg_put(skb, portid, seq, &dp_datapath_genl_family,
@@ -1529,7 +2296,8 @@ static int ovs_dp_cmd_fill_info(struct datapath *dp, struct sk_buff *skb,
 	if (err)
 		goto nla_put_failure;
 
-	get_dp_stats(dp, &dp_stats, &dp_megaflow_stats);
+	get_dp_stats(dp, &dp_stats, &dp_megaflow_stats, &dp_miss_stats,
+		     &dp_deferred_stats);
 	if (nla_put_64bit(skb, OVS_DP_ATTR_STATS, sizeof(struct ovs_dp_stats),
 			  &dp_stats, OVS_DP_ATTR_PAD))
 		goto nla_put_failure;
@@ -1539,9 +2307,26 @@ static int ovs_dp_cmd_fill_info(struct datapath *dp, struct sk_buff *skb,
 			  &dp_megaflow_stats, OVS_DP_ATTR_PAD))
 		goto nla_put_failure;
 
+	if (nla_put_64bit(skb, OVS_DP_ATTR_MISS_STATS,
+			  sizeof(struct ovs_dp_miss_stats),
+			  &dp_miss_stats, OVS_DP_ATTR_PAD))
+		goto nla_put_failure;
+
+	if (nla_put_64bit(skb, OVS_DP_ATTR_DEFERRED_STATS,
+			  sizeof(struct ovs_dp_deferred_stats),
+			  &dp_deferred_stats, OVS_DP_ATTR_PAD))
+		goto nla_put_failure;
+
 	if (nla_put_u32(skb, OVS_DP_ATTR_USER_FEATURES, dp->user_features))
 		goto nla_put_failure;
 
+	if (nla_put_u32(skb, OVS_DP_ATTR_DEFERRED_LIMIT, dp->deferred_limit))
+		goto nla_put_failure;
+
+	if (dp->user_features & OVS_DP_F_STAGE_STATS &&
+	    ovs_dp_cmd_fill_stage_stats(dp, skb))
+		goto nla_put_failure;
+
 	genlmsg_end(skb, ovs_header);
 	return 0;
 
@@ -1574,6 +2359,20 @@ static struct datapath *lookup_datapath(struct net *net,
 	return dp ? dp : ERR_PTR(-ENODEV);
 }
 
+/* Keeps 'ovs_dp_stage_stats_key' enabled while any datapath collects stage
+ * stats.  May sleep.
+ */
+static void ovs_dp_set_user_features(struct datapath *dp, u32 user_features)
+{
+	if ((dp->user_features ^ user_features) & OVS_DP_F_STAGE_STATS) {
+		if (user_features & OVS_DP_F_STAGE_STATS)
+			static_branch_inc(&ovs_dp_stage_stats_key);
+		else
+			static_branch_dec(&ovs_dp_stage_stats_key);
+	}
+	dp->user_features = user_features;
+}
+
 static void ovs_dp_reset_user_features(struct sk_buff *skb, struct genl_info *info)
 {
 	struct datapath *dp;
@@ -1583,13 +2382,35 @@ static void ovs_dp_reset_user_features(struct sk_buff *skb, struct genl_info *in
 		return;
 
 	WARN(dp->user_features, "Dropping previously announced user features\n");
-	dp->user_features = 0;
+	ovs_dp_set_user_features(dp, 0);
+}
+
+/* Called with ovs_mutex. */
+static int ovs_dp_set_deferred_limit(struct datapath *dp, struct nlattr *a[])
+{
+	u32 limit;
+	int err;
+
+	if (!a[OVS_DP_ATTR_DEFERRED_LIMIT])
+		return 0;
+
+	limit = nla_get_u32(a[OVS_DP_ATTR_DEFERRED_LIMIT]);
+	if (!limit || limit > OVS_DP_DEFERRED_LIMIT_MAX)
+		return -EINVAL;
+
+	err = ovs_deferred_actions_reserve(limit);
+	if (err)
+		return err;
+
+	WRITE_ONCE(dp->deferred_limit, limit);
+	return 0;
 }
 
 static void ovs_dp_change(struct datapath *dp, struct nlattr *a[])
 {
 	if (a[OVS_DP_ATTR_USER_FEATURES])
-		dp->user_features = nla_get_u32(a[OVS_DP_ATTR_USER_FEATURES]);
+		ovs_dp_set_user_features(dp,
+					 nla_get_u32(a[OVS_DP_ATTR_USER_FEATURES]));
 }
 
 static int ovs_dp_cmd_new(struct sk_buff *skb, struct genl_info *info)
@@ -1616,6 +2437,7 @@ static int ovs_dp_cmd_new(struct sk_buff *skb, struct genl_info *info)
 		goto err_free_reply;
 
 	ovs_dp_set_net(dp, sock_net(skb->sk));
+	dp->deferred_limit = DP_DEFERRED_LIMIT_DEFAULT;
 
 	/* Allocate table. */
 	err = ovs_flow_tbl_init(&dp->table);
@@ -1628,11 +2450,23 @@ static int ovs_dp_cmd_new(struct sk_buff *skb, struct genl_info *info)
 		goto err_destroy_table;
 	}
 
+	dp->stage_stats = netdev_alloc_pcpu_stats(struct dp_stage_stats_percpu);
+	if (!dp->stage_stats) {
+		err = -ENOMEM;
+		goto err_destroy_percpu;
+	}
+
+	dp->pending_misses = alloc_percpu(struct dp_pending_misses);
+	if (!dp->pending_misses) {
+		err = -ENOMEM;
+		goto err_destroy_stage_stats;
+	}
+
 	dp->ports = kmalloc(DP_VPORT_HASH_BUCKETS * sizeof(struct hlist_head),
 			    GFP_KERNEL);
 	if (!dp->ports) {
 		err = -ENOMEM;
-		goto err_destroy_percpu;
+		goto err_destroy_pending_misses;
 	}
 
 	for (i = 0; i < DP_VPORT_HASH_BUCKETS; i++)
@@ -1651,6 +2485,10 @@ static int ovs_dp_cmd_new(struct sk_buff *skb, struct genl_info *info)
 	/* So far only local changes have been made, now need the lock. */
 	ovs_lock();
 
+	err = ovs_dp_set_deferred_limit(dp, a);
+	if (err)
+		goto err_destroy_ports_array;
+
 	vport = new_vport(&parms);
 	if (IS_ERR(vport)) {
 		err = PTR_ERR(vport);
@@ -1683,7 +2521,12 @@ static int ovs_dp_cmd_new(struct sk_buff *skb, struct genl_info *info)
 
 err_destroy_ports_array:
 	ovs_unlock();
+	ovs_dp_set_user_features(dp, 0);
 	kfree(dp->ports);
+err_destroy_pending_misses:
+	free_percpu(dp->pending_misses);
+err_destroy_stage_stats:
+	free_percpu(dp->stage_stats);
 err_destroy_percpu:
 	free_percpu(dp->stats_percpu);
 err_destroy_table:
@@ -1717,6 +2560,8 @@ static void __dp_destroy(struct datapath *dp)
 	 */
 	ovs_dp_detach_port(ovs_vport_ovsl(dp, OVSP_LOCAL));
 
+	ovs_dp_set_user_features(dp, 0);
+
 	/* RCU destroy the flow table */
 	call_rcu(&dp->rcu, destroy_dp_rcu);
 }
@@ -1769,6 +2614,10 @@ static int ovs_dp_cmd_set(struct sk_buff *skb, struct genl_info *info)
 	if (IS_ERR(dp))
 		goto err_unlock_free;
 
+	err = ovs_dp_set_deferred_limit(dp, info->attrs);
+	if (err)
+		goto err_unlock_free;
+
 	ovs_dp_change(dp, info->attrs);
 
 	err = ovs_dp_cmd_fill_info(dp, reply, info->snd_portid,
@@ -1842,6 +2691,7 @@ static const struct nla_policy datapath_policy[OVS_DP_ATTR_MAX + 1] = {
 	[OVS_DP_ATTR_NAME] = { .type = NLA_NUL_STRING, .len = IFNAMSIZ - 1 },
 	[OVS_DP_ATTR_UPCALL_PID] = { .type = NLA_U32 },
 	[OVS_DP_ATTR_USER_FEATURES] = { .type = NLA_U32 },
+	[OVS_DP_ATTR_DEFERRED_LIMIT] = { .type = NLA_U32 },
 };
 
 static struct genl_ops dp_datapath_genl_ops[] = {
@@ -1912,6 +2762,10 @@ static int ovs_vport_cmd_fill_info(struct vport *vport, struct sk_buff *skb,
 	if (ovs_vport_get_upcall_portids(vport, skb))
 		goto nla_put_failure;
 
+	if (nla_put_u32(skb, OVS_VPORT_ATTR_UPCALL_RATE,
+			READ_ONCE(vport->upcall_limiter.rate)))
+		goto nla_put_failure;
+
 	err = ovs_vport_get_options(vport, skb);
 	if (err == -EMSGSIZE)
 		goto error;
@@ -2068,6 +2922,10 @@ restart:
 		goto exit_unlock_free;
 	}
 
+	if (a[OVS_VPORT_ATTR_UPCALL_RATE])
+		ovs_vport_set_upcall_rate(vport,
+			nla_get_u32(a[OVS_VPORT_ATTR_UPCALL_RATE]));
+
 	err = ovs_vport_cmd_fill_info(vport, reply, info->snd_portid,
 				      info->snd_seq, 0, OVS_VPORT_CMD_NEW);
 	BUG_ON(err < 0);
@@ -2125,6 +2983,10 @@ static int ovs_vport_cmd_set(struct sk_buff *skb, struct genl_info *info)
 			goto exit_unlock_free;
 	}
 
+	if (a[OVS_VPORT_ATTR_UPCALL_RATE])
+		ovs_vport_set_upcall_rate(vport,
+			nla_get_u32(a[OVS_VPORT_ATTR_UPCALL_RATE]));
+
 	err = ovs_vport_cmd_fill_info(vport, reply, info->snd_portid,
 				      info->snd_seq, 0, OVS_VPORT_CMD_NEW);
 	BUG_ON(err < 0);
@@ -2263,6 +3125,7 @@ static const struct nla_policy vport_policy[OVS_VPORT_ATTR_MAX + 1] = {
 	[OVS_VPORT_ATTR_PORT_NO] = { .type = NLA_U32 },
 	[OVS_VPORT_ATTR_TYPE] = { .type = NLA_U32 },
 	[OVS_VPORT_ATTR_UPCALL_PID] = { .type = NLA_U32 },
+	[OVS_VPORT_ATTR_UPCALL_RATE] = { .type = NLA_U32 },
 	[OVS_VPORT_ATTR_OPTIONS] = { .type = NLA_NESTED },
 };
 
@@ -2309,6 +3172,9 @@ static struct genl_family *dp_genl_families[] = {
 	&dp_vport_genl_family,
 	&dp_flow_genl_family,
 	&dp_packet_genl_family,
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+	&dp_ct_limit_genl_family,
+#endif
 };
 
 static void dp_unregister_genl(int n_families)
@@ -2338,12 +3204,32 @@ error:
 	return err;
 }
 
+static void ovs_dp_masks_rebalance(struct work_struct *work)
+{
+	struct ovs_net *ovs_net = container_of(work, struct ovs_net,
+					       masks_rebalance.work);
+	struct datapath *dp;
+
+	ovs_lock();
+	list_for_each_entry(dp, &ovs_net->dps, list_node) {
+		ovs_flow_masks_rebalance(&dp->table);
+		ovs_flow_tbl_migrate(&dp->table);
+	}
+	ovs_unlock();
+
+	schedule_delayed_work(&ovs_net->masks_rebalance,
+			      msecs_to_jiffies(DP_MASKS_REBALANCE_INTERVAL));
+}
+
 static int __net_init ovs_init_net(struct net *net)
 {
 	struct ovs_net *ovs_net = net_generic(net, ovs_net_id);
 
 	INIT_LIST_HEAD(&ovs_net->dps);
 	INIT_WORK(&ovs_net->dp_notify_work, ovs_dp_notify_wq);
+	INIT_DELAYED_WORK(&ovs_net->masks_rebalance, ovs_dp_masks_rebalance);
+	schedule_delayed_work(&ovs_net->masks_rebalance,
+			      msecs_to_jiffies(DP_MASKS_REBALANCE_INTERVAL));
 	ovs_ct_init(net);
 	ovs_netns_frags_init(net);
 	ovs_netns_frags6_init(net);
@@ -2382,9 +3268,9 @@ static void __net_exit ovs_exit_net(struct net *dnet)
 	struct net *net;
 	LIST_HEAD(head);
 
+	cancel_delayed_work_sync(&ovs_net->masks_rebalance);
 	ovs_netns_frags6_exit(dnet);
 	ovs_netns_frags_exit(dnet);
-	ovs_ct_exit(dnet);
 	ovs_lock();
 	list_for_each_entry_safe(dp, dp_next, &ovs_net->dps, list_node)
 		__dp_destroy(dp);
@@ -2402,6 +3288,7 @@ static void __net_exit ovs_exit_net(struct net *dnet)
 
 	ovs_unlock();
 
+	ovs_ct_exit(dnet);
 	cancel_work_sync(&ovs_net->dp_notify_work);
 }
 
@@ -2436,10 +3323,14 @@ static int __init dp_init(void)
 	if (err)
 		goto error_flow_exit;
 
-	err = register_pernet_device(&ovs_net_ops);
+	err = ovs_netdev_rx_init();
 	if (err)
 		goto error_vport_exit;
 
+	err = register_pernet_device(&ovs_net_ops);
+	if (err)
+		goto error_netdev_rx_exit;
+
 	err = compat_init();
 	if (err)
 		goto error_netns_exit;
@@ -2452,9 +3343,13 @@ static int __init dp_init(void)
 	if (err)
 		goto error_unreg_notifier;
 
+	err = ovs_upcall_ring_init();
+	if (err)
+		goto error_unreg_netdev;
+
 	err = dp_register_genl();
 	if (err < 0)
-		goto error_unreg_netdev;
+		goto error_upcall_ring_exit;
 	err = init_filter_sketch(10,2,10);
 	if(err)
 		goto error_filter_sketch;
@@ -2468,6 +3363,8 @@ error_sketch_report:
 	sketch_report_clean();
 error_filter_sketch:
 	clean_filter_sketch();
+error_upcall_ring_exit:
+	ovs_upcall_ring_exit();
 error_unreg_netdev:
 	ovs_netdev_exit();
 error_unreg_notifier:
@@ -2476,6 +3373,9 @@ error_compat_exit:
 	compat_exit();
 error_netns_exit:
 	unregister_pernet_device(&ovs_net_ops);
+	rcu_barrier();
+error_netdev_rx_exit:
+	ovs_netdev_rx_exit();
 error_vport_exit:
 	ovs_vport_exit();
 error_flow_exit:
@@ -2497,11 +3397,13 @@ static void dp_cleanup(void)
 	//sketch_report_clean();
 	//delete_countmax_sketch(countmax);
 	dp_unregister_genl(ARRAY_SIZE(dp_genl_families));
+	ovs_upcall_ring_exit();
 	ovs_netdev_exit();
 	unregister_netdevice_notifier(&ovs_dp_device_notifier);
 	compat_exit();
 	unregister_pernet_device(&ovs_net_ops);
 	rcu_barrier();
+	ovs_netdev_rx_exit();
 	ovs_vport_exit();
 	ovs_flow_exit();
 	ovs_internal_dev_rtnl_link_unregister();
@@ -24,7 +24,9 @@
 #include <linux/mutex.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
+#include <linux/jump_label.h>
 #include <linux/u64_stats_sync.h>
+#include <asm/timex.h>
 #include <net/net_namespace.h>
 #include <net/ip_tunnels.h>
 
@@ -32,8 +34,12 @@
 #include "flow.h"
 #include "flow_table.h"
 
+struct ovs_ct_frags;
+struct ovs_ct_limit_info;
+
 #define DP_MAX_PORTS           USHRT_MAX
 #define DP_VPORT_HASH_BUCKETS  1024
+#define DP_MASKS_REBALANCE_INTERVAL 4000 /* msecs */
 
 /**
  * struct dp_stats_percpu - per-cpu packet processing statistics for a given
@@ -49,12 +55,68 @@
  * @n_mask_hit: Number of masks looked up for flow match.
  *   @n_mask_hit / (@n_hit + @n_missed)  will be the average masks looked
  *   up per packet.
+ * @n_upcall_dedup: Number of misses dropped as repeats of a pending miss.
+ * @n_upcall_ratelimited: Number of misses dropped over the upcall rate of
+ * their input port.
+ * @n_deferred: Number of actions deferred.
+ * @n_deferred_dropped: Number of actions dropped because the deferred action
+ * FIFO was full.
+ * @n_recursion_dropped: Number of packets dropped over the recursion limit.
+ * @deferred_depth_max: Largest number of actions deferred for one packet.
  */
 struct dp_stats_percpu {
 	u64 n_hit;
 	u64 n_missed;
 	u64 n_lost;
 	u64 n_mask_hit;
+	u64 n_upcall_dedup;
+	u64 n_upcall_ratelimited;
+	u64 n_deferred;
+	u64 n_deferred_dropped;
+	u64 n_recursion_dropped;
+	u64 deferred_depth_max;
+	struct u64_stats_sync syncp;
+};
+
+/* Misses recently sent to userspace, by dp_miss_hash().  With
+ * %OVS_DP_F_MISS_DEDUP, a miss whose hash went up less than
+ * DP_PENDING_MISS_WINDOW ago is dropped to give userspace time to install a
+ * flow, but at most DP_PENDING_MISS_DROPS in a row and only within
+ * DP_PENDING_MISS_WINDOW of the first upcall.  A miss still pending after
+ * that is one userspace is not installing a flow for (slow path, flow limit)
+ * and goes up like any other.  Installing a flow clears its entry.
+ */
+#define DP_PENDING_MISS_SHIFT	8
+#define DP_PENDING_MISSES	(1u << DP_PENDING_MISS_SHIFT)
+#define DP_PENDING_MISS_WINDOW	(HZ / 10)
+#define DP_PENDING_MISS_DROPS	32
+
+struct dp_pending_miss {
+	u32 hash;
+	u32 n_dropped;		/* Misses dropped since the last upcall. */
+	unsigned long first;	/* Jiffies of the first upcall. */
+	unsigned long last;	/* Jiffies of the last miss. */
+};
+
+struct dp_pending_misses {
+	struct dp_pending_miss entries[DP_PENDING_MISSES];
+};
+
+enum dp_stage {
+	DP_STAGE_SKETCH,
+	DP_STAGE_LOOKUP,
+	DP_STAGE_EXECUTE,
+	DP_STAGE_UPCALL,
+	DP_STAGE_MAX
+};
+
+/**
+ * struct dp_stage_stats_percpu - per-cpu cycle histograms for the stages of
+ * ovs_dp_process_packet().  Only updated while %OVS_DP_F_STAGE_STATS is set.
+ * @stage: One histogram per &enum dp_stage.
+ */
+struct dp_stage_stats_percpu {
+	struct ovs_dp_stage_stats stage[DP_STAGE_MAX];
 	struct u64_stats_sync syncp;
 };
 
@@ -66,9 +128,13 @@ struct dp_stats_percpu {
  * @ports: Hash table for ports.  %OVSP_LOCAL port always exists.  Protected by
  * ovs_mutex and RCU.
  * @stats_percpu: Per-CPU datapath statistics.
+ * @stage_stats: Per-CPU per-stage cycle histograms.
+ * @pending_misses: Per-CPU table of recent misses.
  * @net: Reference to net namespace.
  * @max_headroom: the maximum headroom of all vports in this datapath; it will
  * be used by all the internal vports in this dp.
+ * @deferred_limit: Number of actions that may be deferred while executing the
+ * actions of one packet.
  *
  * Context: See the comment on locking at the top of datapath.c for additional
  * locking information.
@@ -85,6 +151,8 @@ struct datapath {
 
 	/* Stats. */
 	struct dp_stats_percpu __percpu *stats_percpu;
+	struct dp_stage_stats_percpu __percpu *stage_stats;
+	struct dp_pending_misses __percpu *pending_misses;
 
 	/* Network namespace ref. */
 	possible_net_t net;
@@ -92,8 +160,12 @@ struct datapath {
 	u32 user_features;
 
 	u32 max_headroom;
+
+	u32 deferred_limit;
 };
 
+#define DP_DEFERRED_LIMIT_DEFAULT 10
+
 /**
  * struct ovs_skb_cb - OVS data in skb CB
  * @input_vport: The original vport packet came in on. This value is cached
@@ -134,13 +206,20 @@ struct dp_upcall_info {
  * struct ovs_net - Per net-namespace data for ovs.
  * @dps: List of datapaths to enable dumping them all out.
  * Protected by genl_mutex.
+ * @masks_rebalance: Periodically reorders the mask arrays of @dps by usage.
+ * @ct_frags: IPv4 fragment reassembly for the conntrack action, or NULL to
+ * use the kernel's IP defrag.
+ * @ct_limit_info: Per-zone conntrack limits and connection counts.
  */
 struct ovs_net {
 	struct list_head dps;
 	struct work_struct dp_notify_work;
+	struct delayed_work masks_rebalance;
 
 	/* Module reference for configuring conntrack. */
 	bool xt_label;
+	struct ovs_ct_frags *ct_frags;
+	struct ovs_ct_limit_info *ct_limit_info;
 
 #ifdef HAVE_INET_FRAG_LRU_MOVE
 	struct net *net;
@@ -199,7 +278,39 @@ extern struct notifier_block ovs_dp_device_notifier;
 extern struct genl_family dp_vport_genl_family;
 extern struct genl_multicast_group ovs_dp_vport_multicast_group;
 
+/* Stage instrumentation.  The static key is enabled while any datapath has
+ * %OVS_DP_F_STAGE_STATS set, so the hooks are a patched-out jump otherwise.
+ */
+DECLARE_STATIC_KEY_FALSE(ovs_dp_stage_stats_key);
+
+void __ovs_dp_stage_account(struct datapath *dp, enum dp_stage stage,
+			    cycles_t start);
+
+static inline cycles_t ovs_dp_stage_begin(void)
+{
+	if (static_branch_unlikely(&ovs_dp_stage_stats_key))
+		return get_cycles();
+	return 0;
+}
+
+static inline void ovs_dp_stage_end(struct datapath *dp, enum dp_stage stage,
+				    cycles_t start)
+{
+	if (static_branch_unlikely(&ovs_dp_stage_stats_key) && start)
+		__ovs_dp_stage_account(dp, stage, start);
+}
+
 void ovs_dp_process_packet(struct sk_buff *skb, struct sw_flow_key *key);
+void ovs_dp_process_recirc(struct sk_buff *skb, struct sw_flow_key *key,
+			   const struct sw_flow *from);
+
+/* The flow whose actions are executing, while it is one that only runs
+ * conntrack and then recirculates (see sw_flow_actions.ct_recirc), otherwise
+ * NULL.  Its recirculation is looked up through the recirculation cache.
+ */
+DECLARE_PER_CPU(const struct sw_flow *, ovs_dp_recirc_from);
+void ovs_dp_process_packet_batch(struct datapath *dp, struct sk_buff **skbs,
+				 struct sw_flow_key *keys, int n);
 void ovs_dp_detach_port(struct vport *);
 int ovs_dp_upcall(struct datapath *, struct sk_buff *,
 		  const struct sw_flow_key *, const struct dp_upcall_info *,
@@ -216,6 +327,7 @@ void ovs_dp_notify_wq(struct work_struct *work);
 
 int action_fifos_init(void);
 void action_fifos_exit(void);
+int ovs_deferred_actions_reserve(unsigned int limit);
 
 /* 'KEY' must not have any bits set outside of the 'MASK' */
 #define OVS_MASKED(OLD, KEY, MASK) ((KEY) | ((OLD) & ~(MASK)))
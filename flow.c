@@ -41,6 +41,8 @@
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
 #include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/mpls.h>
@@ -67,69 +69,319 @@ u64 ovs_flow_used_time(unsigned long flow_jiffies)
 
 #define TCP_FLAGS_BE16(tp) (*(__be16 *)&tcp_flag_word(tp) & htons(0x0FFF))
 
+/*
+ * Flow statistics live in per-CPU arenas of FLOW_STATS_CHUNK-sized chunks,
+ * allocated on the CPU's node as they fill up.  A flow refers to them by
+ * 32-bit ids instead of carrying a pointer per possible CPU: 'stats_ids'
+ * holds (cpu + 1) << FLOW_STATS_SLOT_BITS | slot for the first CPUs that see
+ * the flow, and only flows seen on more CPUs get a 'stats_ext' array.
+ *
+ * Slots are allocated by their own CPU from the packet path and freed from
+ * any context once no reader can see them, under the arena lock.  New slots
+ * come from the lowest-numbered chunk with room, so after a flow storm the
+ * survivors pack into the low chunks and the others drain.  A chunk is freed
+ * once its last slot is, unless no other chunk has free slots, which keeps
+ * a single flow coming and going from reallocating it each time.
+ */
+#define FLOW_STATS_SLOT_BITS	20
+#define FLOW_STATS_SLOT_MASK	((1u << FLOW_STATS_SLOT_BITS) - 1)
+#define FLOW_STATS_MAX_CPU	((1u << (32 - FLOW_STATS_SLOT_BITS)) - 1)
+#define FLOW_STATS_CHUNK_SHIFT	8
+#define FLOW_STATS_CHUNK	(1u << FLOW_STATS_CHUNK_SHIFT)
+#define FLOW_STATS_MAX_CHUNKS	(1u << (FLOW_STATS_SLOT_BITS - \
+					FLOW_STATS_CHUNK_SHIFT))
+#define FLOW_STATS_NONE		U32_MAX
+
+/* Only the slots, so that a chunk is exactly 8KB on 64-bit instead of
+ * spilling into an order-2 allocation.  Its free list head and use count
+ * are kept in the arena's 'info' array.
+ */
+struct flow_stats_chunk {
+	struct flow_stats slots[FLOW_STATS_CHUNK];
+};
+
+struct flow_stats_chunk_info {
+	u32 free;			/* First free slot or FLOW_STATS_NONE. */
+	u32 n_used;
+};
+
+struct flow_stats_arena {
+	spinlock_t lock;
+	struct flow_stats_chunk **chunks; /* FLOW_STATS_MAX_CHUNKS entries. */
+	struct flow_stats_chunk_info *info; /* Same, for allocated chunks. */
+	unsigned long *present;		/* Allocated chunks. */
+	unsigned long *partial;		/* Allocated chunks with free slots. */
+};
+
+static struct flow_stats_arena __percpu *flow_stats_arenas;
+
+/* Slots released by ovs_flow_stats_clear(), freed after a grace period. */
+struct flow_stats_release {
+	struct rcu_head rcu;
+	u32 ids[FLOW_STATS_INLINE];
+	u32 *ext;
+};
+
+static struct flow_stats *flow_stats_slot(int cpu, u32 slot)
+{
+	struct flow_stats_arena *arena = per_cpu_ptr(flow_stats_arenas, cpu);
+	struct flow_stats_chunk *chunk;
+
+	chunk = READ_ONCE(arena->chunks[slot >> FLOW_STATS_CHUNK_SHIFT]);
+	return &chunk->slots[slot & (FLOW_STATS_CHUNK - 1)];
+}
+
+/* Must be called with the arena lock held.  Free slots are linked through
+ * their 'packet_count'.
+ */
+static struct flow_stats_chunk *flow_stats_chunk_alloc(int cpu)
+{
+	struct flow_stats_chunk *chunk;
+	u32 i;
+
+	chunk = kmalloc_node(sizeof(*chunk),
+			     GFP_NOWAIT | __GFP_NOWARN | __GFP_NOMEMALLOC,
+			     cpu_to_node(cpu));
+	if (!chunk)
+		return NULL;
+
+	for (i = 0; i < FLOW_STATS_CHUNK - 1; i++)
+		chunk->slots[i].packet_count = i + 1;
+	chunk->slots[i].packet_count = FLOW_STATS_NONE;
+	return chunk;
+}
+
+/* Must be called on 'cpu' with bottom halves disabled. */
+static u32 flow_stats_slot_alloc(int cpu)
+{
+	struct flow_stats_arena *arena = per_cpu_ptr(flow_stats_arenas, cpu);
+	struct flow_stats_chunk_info *info;
+	struct flow_stats_chunk *chunk;
+	u32 slot = FLOW_STATS_NONE;
+	u32 idx;
+
+	spin_lock(&arena->lock);
+	idx = find_first_bit(arena->partial, FLOW_STATS_MAX_CHUNKS);
+	if (idx < FLOW_STATS_MAX_CHUNKS) {
+		chunk = arena->chunks[idx];
+		info = &arena->info[idx];
+	} else {
+		idx = find_first_zero_bit(arena->present,
+					  FLOW_STATS_MAX_CHUNKS);
+		if (idx == FLOW_STATS_MAX_CHUNKS)
+			goto unlock;
+
+		chunk = flow_stats_chunk_alloc(cpu);
+		if (!chunk)
+			goto unlock;
+		info = &arena->info[idx];
+		info->free = 0;
+		info->n_used = 0;
+		WRITE_ONCE(arena->chunks[idx], chunk);
+		__set_bit(idx, arena->present);
+		__set_bit(idx, arena->partial);
+	}
+
+	slot = idx << FLOW_STATS_CHUNK_SHIFT | info->free;
+	info->free = chunk->slots[info->free].packet_count;
+	info->n_used++;
+	if (info->free == FLOW_STATS_NONE)
+		__clear_bit(idx, arena->partial);
+unlock:
+	spin_unlock(&arena->lock);
+	return slot;
+}
+
+static void flow_stats_slot_free(int cpu, u32 slot)
+{
+	struct flow_stats_arena *arena = per_cpu_ptr(flow_stats_arenas, cpu);
+	u32 idx = slot >> FLOW_STATS_CHUNK_SHIFT;
+	struct flow_stats_chunk_info *info;
+	struct flow_stats_chunk *chunk;
+
+	spin_lock_bh(&arena->lock);
+	chunk = arena->chunks[idx];
+	info = &arena->info[idx];
+	chunk->slots[slot & (FLOW_STATS_CHUNK - 1)].packet_count = info->free;
+	info->free = slot & (FLOW_STATS_CHUNK - 1);
+	info->n_used--;
+	__set_bit(idx, arena->partial);
+
+	/* No reader can see any slot of an empty chunk any more. */
+	if (!info->n_used &&
+	    (find_first_bit(arena->partial, idx) < idx ||
+	     find_next_bit(arena->partial, FLOW_STATS_MAX_CHUNKS, idx + 1) <
+	     FLOW_STATS_MAX_CHUNKS)) {
+		__clear_bit(idx, arena->partial);
+		__clear_bit(idx, arena->present);
+		WRITE_ONCE(arena->chunks[idx], NULL);
+		kfree(chunk);
+	}
+	spin_unlock_bh(&arena->lock);
+}
+
+static void flow_stats_release_ids(const u32 *ids, u32 *ext)
+{
+	int cpu;
+	int i;
+
+	for (i = 0; i < FLOW_STATS_INLINE; i++)
+		if (ids[i])
+			flow_stats_slot_free((ids[i] >> FLOW_STATS_SLOT_BITS) - 1,
+					     ids[i] & FLOW_STATS_SLOT_MASK);
+
+	if (!ext)
+		return;
+
+	for_each_possible_cpu(cpu)
+		if (ext[cpu])
+			flow_stats_slot_free(cpu, ext[cpu] - 1);
+	kfree(ext);
+}
+
+static void flow_stats_release_rcu(struct rcu_head *rcu)
+{
+	struct flow_stats_release *r;
+
+	r = container_of(rcu, struct flow_stats_release, rcu);
+	flow_stats_release_ids(r->ids, r->ext);
+	kfree(r);
+}
+
+/* Returns the stats of 'flow' for the current CPU, allocating them on the
+ * CPU's first packet, or NULL if that fails.
+ */
+static struct flow_stats *flow_stats_this_cpu(struct sw_flow *flow, int cpu)
+{
+	u32 tag = (u32)(cpu + 1) << FLOW_STATS_SLOT_BITS;
+	struct flow_stats *stats;
+	u32 *ext;
+	u32 slot;
+	int i;
+
+	for (i = 0; i < FLOW_STATS_INLINE; i++) {
+		u32 id = READ_ONCE(flow->stats_ids[i]);
+
+		if (id && (id & ~FLOW_STATS_SLOT_MASK) == tag)
+			return flow_stats_slot(cpu, id & FLOW_STATS_SLOT_MASK);
+	}
+
+	ext = rcu_dereference(flow->stats_ext);
+	if (ext && READ_ONCE(ext[cpu]))
+		return flow_stats_slot(cpu, READ_ONCE(ext[cpu]) - 1);
+
+	slot = flow_stats_slot_alloc(cpu);
+	if (slot == FLOW_STATS_NONE)
+		return NULL;
+
+	stats = flow_stats_slot(cpu, slot);
+	memset(stats, 0, sizeof(*stats));
+	u64_stats_init(&stats->syncp);
+
+	if (cpu < FLOW_STATS_MAX_CPU)
+		for (i = 0; i < FLOW_STATS_INLINE; i++)
+			if (!cmpxchg(&flow->stats_ids[i], 0, tag | slot))
+				return stats;
+
+	if (!ext) {
+		u32 *new_ext = kzalloc(nr_cpu_ids * sizeof(u32),
+				       GFP_NOWAIT | __GFP_NOWARN);
+
+		if (!new_ext)
+			goto err;
+
+		ext = cmpxchg((u32 __force **)&flow->stats_ext, NULL, new_ext);
+		if (ext)
+			kfree(new_ext);	/* Another CPU was first. */
+		else
+			ext = new_ext;
+	}
+	smp_wmb();
+	WRITE_ONCE(ext[cpu], slot + 1);
+	return stats;
+
+err:
+	flow_stats_slot_free(cpu, slot);
+	return NULL;
+}
+
+/* Stats generation, advanced by every dump of changed flows.  Each flow
+ * records the generation current at its latest packet in 'stats_gen'.
+ */
+static atomic_long_t flow_stats_gen = ATOMIC_LONG_INIT(1);
+
+/* Starts a new stats generation and returns it. */
+unsigned long ovs_flow_stats_gen_next(void)
+{
+	return atomic_long_inc_return(&flow_stats_gen);
+}
+
+static void flow_stats_shared_update(struct flow_stats_shared *shared,
+				     __be16 tcp_flags, int len)
+{
+	int old;
+
+	atomic64_inc(&shared->packet_count);
+	atomic64_add(len, &shared->byte_count);
+	WRITE_ONCE(shared->used, jiffies);
+
+	old = atomic_read(&shared->tcp_flags);
+	while ((old | (__force u16)tcp_flags) != old) {
+		int prev = atomic_cmpxchg(&shared->tcp_flags, old,
+					  old | (__force u16)tcp_flags);
+
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+/* Must be called with rcu_read_lock and bottom halves disabled. */
 void ovs_flow_stats_update(struct sw_flow *flow, __be16 tcp_flags,
 			   const struct sk_buff *skb)
 {
 	struct flow_stats *stats;
-	int node = numa_node_id();
-	int cpu = smp_processor_id();
 	int len = skb->len + (skb_vlan_tag_present(skb) ? VLAN_HLEN : 0);
+	unsigned long gen = atomic_long_read(&flow_stats_gen);
 
-	stats = rcu_dereference(flow->stats[cpu]);
-
-	/* Check if already have CPU-specific stats. */
-	if (likely(stats)) {
-		spin_lock(&stats->lock);
-		/* Mark if we write on the pre-allocated stats. */
-		if (cpu == 0 && unlikely(flow->stats_last_writer != cpu))
-			flow->stats_last_writer = cpu;
-	} else {
-		stats = rcu_dereference(flow->stats[0]); /* Pre-allocated. */
-		spin_lock(&stats->lock);
+	/* Only written once per flow and generation. */
+	if (READ_ONCE(flow->stats_gen) != gen)
+		WRITE_ONCE(flow->stats_gen, gen);
 
-		/* If the current CPU is the only writer on the
-		 * pre-allocated stats keep using them.
-		 */
-		if (unlikely(flow->stats_last_writer != cpu)) {
-			/* A previous locker may have already allocated the
-			 * stats, so we need to check again.  If CPU-specific
-			 * stats were already allocated, we update the pre-
-			 * allocated stats as we have already locked them.
-			 */
-			if (likely(flow->stats_last_writer != -1) &&
-			    likely(!rcu_access_pointer(flow->stats[cpu]))) {
-				/* Try to allocate CPU-specific stats. */
-				struct flow_stats *new_stats;
-
-				new_stats =
-					kmem_cache_alloc_node(flow_stats_cache,
-                                                              GFP_NOWAIT |
-                                                              __GFP_THISNODE |
-                                                              __GFP_NOWARN |
-							      __GFP_NOMEMALLOC,
-							      node);
-				if (likely(new_stats)) {
-					new_stats->used = jiffies;
-					new_stats->packet_count = 1;
-					new_stats->byte_count = len;
-					new_stats->tcp_flags = tcp_flags;
-					spin_lock_init(&new_stats->lock);
-
-					rcu_assign_pointer(flow->stats[cpu],
-							   new_stats);
-					goto unlock;
-				}
-			}
-			flow->stats_last_writer = cpu;
-		}
+	stats = flow_stats_this_cpu(flow, smp_processor_id());
+	if (unlikely(!stats)) {
+		flow_stats_shared_update(&flow->stats_shared, tcp_flags, len);
+		return;
 	}
 
-	stats->used = jiffies;
+	u64_stats_update_begin(&stats->syncp);
 	stats->packet_count++;
 	stats->byte_count += len;
-	stats->tcp_flags |= tcp_flags;
-unlock:
-	spin_unlock(&stats->lock);
+	u64_stats_update_end(&stats->syncp);
+	WRITE_ONCE(stats->used, jiffies);
+	WRITE_ONCE(stats->tcp_flags, stats->tcp_flags | tcp_flags);
+}
+
+static void flow_stats_add(const struct flow_stats *stats,
+			   struct ovs_flow_stats *ovs_stats,
+			   unsigned long *used, __be16 *tcp_flags)
+{
+	unsigned long stats_used;
+	u64 packets, bytes;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin_irq(&stats->syncp);
+		packets = stats->packet_count;
+		bytes = stats->byte_count;
+	} while (u64_stats_fetch_retry_irq(&stats->syncp, start));
+
+	stats_used = READ_ONCE(stats->used);
+	if (!*used || time_after(stats_used, *used))
+		*used = stats_used;
+	*tcp_flags |= READ_ONCE(stats->tcp_flags);
+	ovs_stats->n_packets += packets;
+	ovs_stats->n_bytes += bytes;
 }
 
 /* Must be called with rcu_read_lock or ovs_mutex. */
@@ -137,49 +389,138 @@ void ovs_flow_stats_get(const struct sw_flow *flow,
 			struct ovs_flow_stats *ovs_stats,
 			unsigned long *used, __be16 *tcp_flags)
 {
+	const struct flow_stats_shared *shared = &flow->stats_shared;
+	const u32 *ext;
 	int cpu;
+	int i;
 
-	*used = 0;
-	*tcp_flags = 0;
-	memset(ovs_stats, 0, sizeof(*ovs_stats));
+	ovs_stats->n_packets = atomic64_read(&shared->packet_count);
+	ovs_stats->n_bytes = atomic64_read(&shared->byte_count);
+	*used = READ_ONCE(shared->used);
+	*tcp_flags = (__force __be16)atomic_read(&shared->tcp_flags);
 
-	/* We open code this to make sure cpu 0 is always considered */
-	for (cpu = 0; cpu < nr_cpu_ids; cpu = cpumask_next(cpu, cpu_possible_mask)) {
-		struct flow_stats *stats = rcu_dereference_ovsl(flow->stats[cpu]);
+	for (i = 0; i < FLOW_STATS_INLINE; i++) {
+		u32 id = READ_ONCE(flow->stats_ids[i]);
 
-		if (stats) {
-			/* Local CPU may write on non-local stats, so we must
-			 * block bottom-halves here.
-			 */
-			spin_lock_bh(&stats->lock);
-			if (!*used || time_after(stats->used, *used))
-				*used = stats->used;
-			*tcp_flags |= stats->tcp_flags;
-			ovs_stats->n_packets += stats->packet_count;
-			ovs_stats->n_bytes += stats->byte_count;
-			spin_unlock_bh(&stats->lock);
+		if (id)
+			flow_stats_add(flow_stats_slot((id >> FLOW_STATS_SLOT_BITS) - 1,
+						       id & FLOW_STATS_SLOT_MASK),
+				       ovs_stats, used, tcp_flags);
+	}
+
+	ext = rcu_dereference_ovsl(flow->stats_ext);
+	if (!ext)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		u32 slot = READ_ONCE(ext[cpu]);
+
+		if (slot) {
+			smp_rmb();
+			flow_stats_add(flow_stats_slot(cpu, slot - 1),
+				       ovs_stats, used, tcp_flags);
 		}
 	}
 }
 
-/* Called with ovs_mutex. */
+/* Called with ovs_mutex.  The per-CPU stats cannot be zeroed under their
+ * writers, so they are detached and freed after a grace period instead; each
+ * CPU starts over with fresh stats on its next packet.
+ */
 void ovs_flow_stats_clear(struct sw_flow *flow)
+{
+	struct flow_stats_shared *shared = &flow->stats_shared;
+	struct flow_stats_release *r;
+	int i;
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (r) {
+		for (i = 0; i < FLOW_STATS_INLINE; i++)
+			r->ids[i] = xchg(&flow->stats_ids[i], 0);
+		r->ext = ovsl_dereference(flow->stats_ext);
+		RCU_INIT_POINTER(flow->stats_ext, NULL);
+		call_rcu(&r->rcu, flow_stats_release_rcu);
+	} else {
+		u32 ids[FLOW_STATS_INLINE];
+		u32 *ext;
+
+		for (i = 0; i < FLOW_STATS_INLINE; i++)
+			ids[i] = xchg(&flow->stats_ids[i], 0);
+		ext = ovsl_dereference(flow->stats_ext);
+		RCU_INIT_POINTER(flow->stats_ext, NULL);
+		synchronize_rcu();
+		flow_stats_release_ids(ids, ext);
+	}
+
+	atomic64_set(&shared->packet_count, 0);
+	atomic64_set(&shared->byte_count, 0);
+	WRITE_ONCE(shared->used, 0);
+	atomic_set(&shared->tcp_flags, 0);
+}
+
+/* Called once no reader can see 'flow' any more. */
+void ovs_flow_stats_free(struct sw_flow *flow)
+{
+	flow_stats_release_ids(flow->stats_ids,
+			       rcu_dereference_raw(flow->stats_ext));
+}
+
+int ovs_flow_stats_init(void)
 {
 	int cpu;
 
-	/* We open code this to make sure cpu 0 is always considered */
-	for (cpu = 0; cpu < nr_cpu_ids; cpu = cpumask_next(cpu, cpu_possible_mask)) {
-		struct flow_stats *stats = ovsl_dereference(flow->stats[cpu]);
-
-		if (stats) {
-			spin_lock_bh(&stats->lock);
-			stats->used = 0;
-			stats->packet_count = 0;
-			stats->byte_count = 0;
-			stats->tcp_flags = 0;
-			spin_unlock_bh(&stats->lock);
+	flow_stats_arenas = alloc_percpu(struct flow_stats_arena);
+	if (!flow_stats_arenas)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct flow_stats_arena *arena;
+
+		arena = per_cpu_ptr(flow_stats_arenas, cpu);
+		spin_lock_init(&arena->lock);
+		arena->chunks = vzalloc_node(FLOW_STATS_MAX_CHUNKS *
+					     sizeof(*arena->chunks),
+					     cpu_to_node(cpu));
+		arena->info = vzalloc_node(FLOW_STATS_MAX_CHUNKS *
+					   sizeof(*arena->info),
+					   cpu_to_node(cpu));
+		arena->present = kzalloc_node(BITS_TO_LONGS(FLOW_STATS_MAX_CHUNKS) *
+					      sizeof(long), GFP_KERNEL,
+					      cpu_to_node(cpu));
+		arena->partial = kzalloc_node(BITS_TO_LONGS(FLOW_STATS_MAX_CHUNKS) *
+					      sizeof(long), GFP_KERNEL,
+					      cpu_to_node(cpu));
+		if (!arena->chunks || !arena->info || !arena->present ||
+		    !arena->partial) {
+			ovs_flow_stats_exit();
+			return -ENOMEM;
 		}
 	}
+
+	return 0;
+}
+
+/* Called after all flows are freed. */
+void ovs_flow_stats_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct flow_stats_arena *arena;
+		int i;
+
+		arena = per_cpu_ptr(flow_stats_arenas, cpu);
+		kfree(arena->present);
+		kfree(arena->partial);
+		vfree(arena->info);
+		if (!arena->chunks)
+			continue;
+
+		for (i = 0; i < FLOW_STATS_MAX_CHUNKS; i++)
+			kfree(arena->chunks[i]);
+		vfree(arena->chunks);
+	}
+	free_percpu(flow_stats_arenas);
 }
 
 static int check_header(struct sk_buff *skb, int len)
@@ -788,6 +1129,13 @@ int ovs_flow_key_extract(const struct ip_tunnel_info *tun_info,
 {
 	int res, err;
 
+	/* Extraction only sets the fields defined for the packet, but the
+	 * flow table's exact-match cache compares the key whole from
+	 * 'tun_key' on, so clear it first.
+	 */
+	memset(&key->tun_key, 0,
+	       sizeof(*key) - offsetof(struct sw_flow_key, tun_key));
+
 	/* Extract metadata from packet. */
 	if (tun_info) {
 		key->tun_proto = ip_tunnel_info_af(tun_info);
@@ -803,9 +1151,7 @@ int ovs_flow_key_extract(const struct ip_tunnel_info *tun_info,
 			key->tun_opts_len = 0;
 		}
 	} else  {
-		key->tun_proto = 0;
 		key->tun_opts_len = 0;
-		memset(&key->tun_key, 0, sizeof(key->tun_key));
 	}
 
 	key->phy.priority = skb->priority;
@@ -21,6 +21,7 @@
 
 #include <linux/cache.h>
 #include <linux/kernel.h>
+#include <linux/llist.h>
 #include <linux/netlink.h>
 #include <linux/openvswitch.h>
 #include <linux/spinlock.h>
@@ -31,6 +32,7 @@
 #include <linux/jiffies.h>
 #include <linux/time.h>
 #include <linux/flex_array.h>
+#include <linux/u64_stats_sync.h>
 #include <net/inet_ecn.h>
 #include <net/ip_tunnels.h>
 #include <net/dst_metadata.h>
@@ -169,9 +171,13 @@ struct sw_flow_key_range {
 	unsigned short int end;
 };
 
+struct mask_filter;
+
 struct sw_flow_mask {
 	int ref_count;
 	struct rcu_head rcu;
+	struct hlist_head flows;	/* Flows using this mask, ovs_mutex. */
+	struct mask_filter __rcu *filter;
 	struct sw_flow_key_range range;
 	struct sw_flow_key key;
 };
@@ -192,39 +198,95 @@ struct sw_flow_id {
 	};
 };
 
+/* Maximum number of consecutive output actions replicated together. */
+#define OUTPUT_RUN_MAX 16
+
+/* One action of a compiled action list.  Actions are decoded once, when the
+ * flow is installed, so that executing them walks a flat array instead of
+ * netlink attributes.
+ */
+struct sw_flow_action_op {
+	u16 type;			/* OVS_ACTION_ATTR_*. */
+	u8 last;			/* Last action of its list. */
+	u8 run;				/* OUTPUT: outputs in a row from here. */
+	u32 port;			/* OUTPUT: port number. */
+	const struct nlattr *attr;	/* The action attribute. */
+	union {
+		const struct nlattr *l4; /* SET_MASKED: L4 set folded in. */
+		const struct sw_flow_prog *sub;	/* SAMPLE: nested actions. */
+	};
+};
+
+/* A compiled action list.  'actions' is the list itself, which is still
+ * reported to userspace by the userspace action.
+ */
+struct sw_flow_prog {
+	const struct nlattr *actions;
+	int actions_len;
+	int n_ops;
+	const struct sw_flow_action_op *ops;
+};
+
 struct sw_flow_actions {
 	struct rcu_head rcu;
 	size_t orig_len;	/* From flow_cmd_new netlink actions size */
 	u32 actions_len;
+	bool ct_recirc;		/* Only ct without NAT, then recirc. */
+	struct sw_flow_prog *prog; /* Compiled 'actions', top level first. */
 	struct nlattr actions[];
 };
 
+/* Per-CPU flow statistics, kept in per-CPU arenas (see flow.c).  Only ever
+ * written by the CPU that owns them, so updates need no lock; 'syncp' keeps
+ * the 64-bit counters consistent for readers on 32-bit hosts.
+ */
 struct flow_stats {
 	u64 packet_count;		/* Number of packets matched. */
 	u64 byte_count;			/* Number of bytes matched. */
 	unsigned long used;		/* Last used time (in jiffies). */
-	spinlock_t lock;		/* Lock for atomic stats update. */
+	struct u64_stats_sync syncp;
 	__be16 tcp_flags;		/* Union of seen TCP flags. */
 };
 
+/* Number of CPUs whose stats a flow indexes inline. */
+#define FLOW_STATS_INLINE	4
+
+/* Statistics of packets seen on a CPU whose own 'flow_stats' could not be
+ * allocated.  Shared by all CPUs, hence atomic.
+ */
+struct flow_stats_shared {
+	atomic64_t packet_count;
+	atomic64_t byte_count;
+	unsigned long used;
+	atomic_t tcp_flags;
+};
+
 struct sw_flow {
-	struct rcu_head rcu;
+	union {
+		struct rcu_head rcu;
+		struct llist_node dead_node;	/* Waiting to be freed. */
+	};
 	struct {
 		struct hlist_node node[2];
 		u32 hash;
 	} flow_table, ufid_table;
-	int stats_last_writer;		/* CPU id of the last writer on
-					 * 'stats[0]'.
-					 */
+	struct hlist_node mask_node;	/* In 'mask->flows'. */
 	struct sw_flow_key key;
 	struct sw_flow_id id;
 	struct sw_flow_mask *mask;
 	struct sw_flow_actions __rcu *sf_acts;
-	struct flow_stats __rcu *stats[]; /* One for each CPU.  First one
-					   * is allocated at flow creation time,
-					   * the rest are allocated on demand
-					   * while holding the 'stats[0].lock'.
-					   */
+	struct flow_stats_shared stats_shared;
+	unsigned long stats_gen;	/* Stats generation of the latest
+					 * packet, see ovs_flow_stats_gen_next().
+					 */
+	bool removed;			/* Unlinked from its table. */
+	u32 stats_ids[FLOW_STATS_INLINE];	/* CPU and arena slot of the
+						 * stats of the first CPUs to
+						 * see the flow, 0 if unused.
+						 */
+	u32 __rcu *stats_ext;		/* Arena slot + 1 by CPU id, for
+					 * flows seen on more CPUs.
+					 */
 };
 
 struct arp_eth_header {
@@ -271,6 +333,10 @@ void ovs_flow_stats_update(struct sw_flow *, __be16 tcp_flags,
 void ovs_flow_stats_get(const struct sw_flow *, struct ovs_flow_stats *,
 			unsigned long *used, __be16 *tcp_flags);
 void ovs_flow_stats_clear(struct sw_flow *);
+void ovs_flow_stats_free(struct sw_flow *);
+unsigned long ovs_flow_stats_gen_next(void);
+int ovs_flow_stats_init(void);
+void ovs_flow_stats_exit(void);
 u64 ovs_flow_used_time(unsigned long flow_jiffies);
 
 /* Update the non-metadata part of the flow key using skb. */
@@ -1922,6 +1922,8 @@ static struct sw_flow_actions *nla_alloc_flow_actions(int size, bool log)
 		return ERR_PTR(-ENOMEM);
 
 	sfa->actions_len = 0;
+	sfa->ct_recirc = false;
+	sfa->prog = NULL;
 	return sfa;
 }
 
@@ -1957,6 +1959,7 @@ void ovs_nla_free_flow_actions(struct sw_flow_actions *sf_acts)
 		}
 	}
 
+	kfree(sf_acts->prog);
 	kfree(sf_acts);
 }
 
@@ -2661,6 +2664,185 @@ static int __ovs_nla_copy_actions(struct net *net, const struct nlattr *attr,
 	return 0;
 }
 
+/* Returns true if 'sfa' runs conntrack without NAT one or more times and
+ * then recirculates, so that the key it recirculates differs from the key it
+ * matched only in recirc_id and the conntrack fields.
+ */
+static bool actions_ct_recirc(const struct sw_flow_actions *sfa)
+{
+	const struct nlattr *a;
+	int rem, n_ct = 0;
+
+	nla_for_each_attr(a, sfa->actions, sfa->actions_len, rem) {
+		switch (nla_type(a)) {
+		case OVS_ACTION_ATTR_CT:
+			if (ovs_ct_action_nat(nla_data(a)))
+				return false;
+			n_ct++;
+			break;
+
+		case OVS_ACTION_ATTR_RECIRC:
+			return n_ct && nla_is_last(a, rem);
+
+		default:
+			return false;
+		}
+	}
+
+	return false;
+}
+
+/* Returns the number of consecutive output actions, up to OUTPUT_RUN_MAX,
+ * starting at 'a'.
+ */
+static int output_run_len(const struct nlattr *a, int rem)
+{
+	int n = 1;
+
+	for (a = nla_next(a, &rem); rem > 0 && n < OUTPUT_RUN_MAX;
+	     a = nla_next(a, &rem)) {
+		if (nla_type(a) != OVS_ACTION_ATTR_OUTPUT)
+			break;
+		n++;
+	}
+	return n;
+}
+
+/* Returns the key of the masked set of TCP or UDP ports that directly
+ * follows action 'a', if 'a' is a masked set of IPv4 or IPv6 fields, so that
+ * the two can be applied together by set_l3_l4().
+ */
+static const struct nlattr *masked_set_l4_peer(const struct nlattr *a,
+					       int rem)
+{
+	int l3_type = nla_type(nla_data(a));
+	const struct nlattr *next;
+	int l4_type;
+
+	if (l3_type != OVS_KEY_ATTR_IPV4 && l3_type != OVS_KEY_ATTR_IPV6)
+		return NULL;
+
+	next = nla_next(a, &rem);
+	if (rem <= 0 ||
+	    (nla_type(next) != OVS_ACTION_ATTR_SET_MASKED &&
+	     nla_type(next) != OVS_ACTION_ATTR_SET_TO_MASKED))
+		return NULL;
+
+	l4_type = nla_type(nla_data(next));
+	if (l4_type != OVS_KEY_ATTR_TCP && l4_type != OVS_KEY_ATTR_UDP)
+		return NULL;
+
+	return nla_data(next);
+}
+
+/* Returns the actions nested in sample action 'a', with their length in
+ * '*len'.
+ */
+static const struct nlattr *sample_actions(const struct nlattr *a, int *len)
+{
+	*len = nla_len(a);
+	return nla_next(nla_data(a), len);
+}
+
+struct prog_builder {
+	struct sw_flow_prog *progs;
+	struct sw_flow_action_op *ops;
+	int n_progs;
+	int n_ops;
+};
+
+/* Counts the action lists in 'attr', nested ones included, and their
+ * actions.
+ */
+static void prog_count(const struct nlattr *attr, int len,
+		       struct prog_builder *b)
+{
+	const struct nlattr *a, *actions;
+	int rem, sub_len;
+
+	b->n_progs++;
+	nla_for_each_attr(a, attr, len, rem) {
+		b->n_ops++;
+		if (nla_type(a) == OVS_ACTION_ATTR_SAMPLE) {
+			actions = sample_actions(a, &sub_len);
+			prog_count(actions, sub_len, b);
+		}
+	}
+}
+
+/* Compiles the action list 'attr' into the next program of 'b'.  Nested
+ * lists are compiled after the list itself, so that its ops are contiguous.
+ */
+static const struct sw_flow_prog *prog_compile(struct prog_builder *b,
+					       const struct nlattr *attr,
+					       int len)
+{
+	struct sw_flow_prog *prog = &b->progs[b->n_progs++];
+	struct sw_flow_action_op *ops = &b->ops[b->n_ops];
+	const struct nlattr *a, *actions;
+	int i, rem, sub_len;
+
+	nla_for_each_attr(a, attr, len, rem)
+		b->n_ops++;
+
+	prog->actions = attr;
+	prog->actions_len = len;
+	prog->ops = ops;
+	prog->n_ops = 0;
+
+	nla_for_each_attr(a, attr, len, rem) {
+		struct sw_flow_action_op *op = &ops[prog->n_ops++];
+
+		op->type = nla_type(a);
+		op->attr = a;
+		switch (op->type) {
+		case OVS_ACTION_ATTR_OUTPUT:
+			op->port = nla_get_u32(a);
+			op->run = output_run_len(a, rem);
+			break;
+
+		case OVS_ACTION_ATTR_SET_MASKED:
+		case OVS_ACTION_ATTR_SET_TO_MASKED:
+			op->l4 = masked_set_l4_peer(a, rem);
+			if (op->l4)
+				a = nla_next(a, &rem);
+			break;
+		}
+		op->last = nla_is_last(a, rem);
+	}
+
+	for (i = 0; i < prog->n_ops; i++) {
+		if (ops[i].type == OVS_ACTION_ATTR_SAMPLE) {
+			actions = sample_actions(ops[i].attr, &sub_len);
+			ops[i].sub = prog_compile(b, actions, sub_len);
+		}
+	}
+
+	return prog;
+}
+
+/* Compiles the actions of 'sfa' into 'sfa->prog', for do_execute_actions(). */
+static int actions_compile(struct sw_flow_actions *sfa)
+{
+	struct prog_builder b = {};
+	int n_progs;
+
+	prog_count(sfa->actions, sfa->actions_len, &b);
+	n_progs = b.n_progs;
+	b.progs = kzalloc(n_progs * sizeof(*b.progs) +
+			  b.n_ops * sizeof(*b.ops), GFP_KERNEL);
+	if (!b.progs)
+		return -ENOMEM;
+
+	b.ops = (struct sw_flow_action_op *)(b.progs + n_progs);
+	b.n_progs = 0;
+	b.n_ops = 0;
+	prog_compile(&b, sfa->actions, sfa->actions_len);
+
+	sfa->prog = b.progs;
+	return 0;
+}
+
 /* 'key' must be the masked key. */
 int ovs_nla_copy_actions(struct net *net, const struct nlattr *attr,
 			 const struct sw_flow_key *key,
@@ -2675,8 +2857,12 @@ int ovs_nla_copy_actions(struct net *net, const struct nlattr *attr,
 	(*sfa)->orig_len = nla_len(attr);
 	err = __ovs_nla_copy_actions(net, attr, key, sfa, key->eth.type,
 				     key->eth.vlan.tci, log);
+	if (!err)
+		err = actions_compile(*sfa);
 	if (err)
 		ovs_nla_free_flow_actions(*sfa);
+	else
+		(*sfa)->ct_recirc = actions_ct_recirc(*sfa);
 
 	return err;
 }
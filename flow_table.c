@@ -28,6 +28,7 @@
 #include <linux/jhash.h>
 #include <linux/jiffies.h>
 #include <linux/llc.h>
+#include <linux/llist.h>
 #include <linux/module.h>
 #include <linux/in.h>
 #include <linux/rcupdate.h>
@@ -41,6 +42,9 @@
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
 #include <linux/rculist.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/ndisc.h>
@@ -50,13 +54,24 @@
 #define TBL_MIN_BUCKETS		1024
 #define MASK_ARRAY_SIZE_MIN	16
 #define REHASH_INTERVAL		(10 * 60 * HZ)
+#define TBL_MIGRATE_BUCKETS	16	/* Per table update. */
+#define TBL_MIGRATE_BUCKETS_IDLE	4096	/* Per periodic step. */
 
 #define MC_HASH_SHIFT		8
 #define MC_HASH_ENTRIES		(1u << MC_HASH_SHIFT)
 #define MC_HASH_SEGS		((sizeof(uint32_t) * 8) / MC_HASH_SHIFT)
 
+#define EMC_SEGS		2
+#define EMC_REAP_DELAY		HZ
+
+#define MASK_FILTER_BLOCK_SHIFT	9	/* 512 bits, one cache line. */
+#define MASK_FILTER_BLOCK_BITS	(1u << MASK_FILTER_BLOCK_SHIFT)
+#define MASK_FILTER_K		3
+#define MASK_FILTER_BLOCK_FLOWS	48	/* About 1.5% false positives. */
+#define MASK_FILTER_MAX_BLOCKS	(1u << 14)
+#define MASK_FILTER_SEED	0x9e3779b9
+
 static struct kmem_cache *flow_cache;
-struct kmem_cache *flow_stats_cache __read_mostly;
 
 static u16 range_n_bytes(const struct sw_flow_key_range *range)
 {
@@ -85,29 +100,13 @@ void ovs_flow_mask_key(struct sw_flow_key *dst, const struct sw_flow_key *src,
 struct sw_flow *ovs_flow_alloc(void)
 {
 	struct sw_flow *flow;
-	struct flow_stats *stats;
 
+	/* Per-CPU stats are allocated by ovs_flow_stats_update(). */
 	flow = kmem_cache_zalloc(flow_cache, GFP_KERNEL);
 	if (!flow)
 		return ERR_PTR(-ENOMEM);
 
-	flow->stats_last_writer = -1;
-
-	/* Initialize the default stat node. */
-	stats = kmem_cache_alloc_node(flow_stats_cache,
-				      GFP_KERNEL | __GFP_ZERO,
-				      node_online(0) ? 0 : NUMA_NO_NODE);
-	if (!stats)
-		goto err;
-
-	spin_lock_init(&stats->lock);
-
-	RCU_INIT_POINTER(flow->stats[0], stats);
-
 	return flow;
-err:
-	kmem_cache_free(flow_cache, flow);
-	return ERR_PTR(-ENOMEM);
 }
 
 int ovs_flow_tbl_count(const struct flow_table *table)
@@ -115,42 +114,32 @@ int ovs_flow_tbl_count(const struct flow_table *table)
 	return table->count;
 }
 
-static struct flex_array *alloc_buckets(unsigned int n_buckets)
+/* Buckets are vmalloc()ed rather than kept in a flex_array, which would cap
+ * a table at a few tens of thousands of cache-line-sized buckets.  The page
+ * alignment keeps each bucket on a single line.
+ */
+static struct flow_bucket *alloc_buckets(unsigned int n_buckets)
 {
-	struct flex_array *buckets;
-	int i, err;
+	struct flow_bucket *buckets;
+	int i;
 
-	buckets = flex_array_alloc(sizeof(struct hlist_head),
-				   n_buckets, GFP_KERNEL);
+	buckets = vzalloc(sizeof(*buckets) * (unsigned long)n_buckets);
 	if (!buckets)
 		return NULL;
 
-	err = flex_array_prealloc(buckets, 0, n_buckets, GFP_KERNEL);
-	if (err) {
-		flex_array_free(buckets);
-		return NULL;
-	}
-
 	for (i = 0; i < n_buckets; i++)
-		INIT_HLIST_HEAD((struct hlist_head *)
-					flex_array_get(buckets, i));
+		INIT_HLIST_HEAD(&buckets[i].head);
 
 	return buckets;
 }
 
 static void flow_free(struct sw_flow *flow)
 {
-	int cpu;
-
 	if (ovs_identifier_is_key(&flow->id))
 		kfree(flow->id.unmasked_key);
 	if (flow->sf_acts)
 		ovs_nla_free_flow_actions((struct sw_flow_actions __force *)flow->sf_acts);
-	/* We open code this to make sure cpu 0 is always considered */
-	for (cpu = 0; cpu < nr_cpu_ids; cpu = cpumask_next(cpu, cpu_possible_mask))
-		if (flow->stats[cpu])
-			kmem_cache_free(flow_stats_cache,
-					rcu_dereference_raw(flow->stats[cpu]));
+	ovs_flow_stats_free(flow);
 	kmem_cache_free(flow_cache, flow);
 }
 
@@ -161,20 +150,69 @@ static void rcu_free_flow_callback(struct rcu_head *rcu)
 	flow_free(flow);
 }
 
+/* Exact-match cache generation, shared by all tables.  An entry is valid
+ * only while it carries the current generation, and a hit on a 'removed'
+ * flow is a miss.  Flows that are freed while still linked from the caches
+ * wait on 'emc_graveyard' for the next bump, which happens at most once per
+ * EMC_REAP_DELAY, so removing flows does not flush the caches every time.
+ */
+static atomic_long_t emc_gen = ATOMIC_LONG_INIT(1);
+static LLIST_HEAD(emc_graveyard);
+
+static void emc_reap(struct work_struct *work);
+static DECLARE_DELAYED_WORK(emc_reap_work, emc_reap);
+
+/* Invalidates every cache entry.  Entries of the old generation are never
+ * returned again, so flows they point to may be freed after the usual RCU
+ * grace period.
+ */
+static void emc_invalidate(void)
+{
+	smp_wmb();	/* Pairs with smp_rmb() in emc_read_gen(). */
+	atomic_long_inc(&emc_gen);
+}
+
+/* Returns the cache generation a lookup must tag its results with.  It has
+ * to be read before the lookup: a flow found afterwards was either still
+ * linked under this generation, or is tagged with one that is already stale.
+ */
+static unsigned long emc_read_gen(void)
+{
+	unsigned long gen = atomic_long_read(&emc_gen);
+
+	smp_rmb();	/* Pairs with smp_wmb() in emc_invalidate(). */
+	return gen;
+}
+
+static void emc_reap(struct work_struct *work)
+{
+	struct llist_node *first = llist_del_all(&emc_graveyard);
+	struct sw_flow *flow, *next;
+
+	if (!first)
+		return;
+
+	emc_invalidate();
+	llist_for_each_entry_safe(flow, next, first, dead_node)
+		call_rcu(&flow->rcu, rcu_free_flow_callback);
+}
+
 void ovs_flow_free(struct sw_flow *flow, bool deferred)
 {
 	if (!flow)
 		return;
 
-	if (deferred)
-		call_rcu(&flow->rcu, rcu_free_flow_callback);
-	else
+	if (deferred) {
+		llist_add(&flow->dead_node, &emc_graveyard);
+		schedule_delayed_work(&emc_reap_work, EMC_REAP_DELAY);
+	} else {
 		flow_free(flow);
+	}
 }
 
-static void free_buckets(struct flex_array *buckets)
+static void free_buckets(struct flow_bucket *buckets)
 {
-	flex_array_free(buckets);
+	vfree(buckets);
 }
 
 
@@ -200,21 +238,31 @@ static struct table_instance *table_instance_alloc(int new_size)
 	ti->n_buckets = new_size;
 	ti->node_ver = 0;
 	ti->keep_flows = false;
+	ti->next = NULL;
+	ti->migrated = 0;
 	get_random_bytes(&ti->hash_seed, sizeof(u32));
 
 	return ti;
 }
 
+static void __mask_array_destroy(struct mask_array *ma)
+{
+	free_percpu(ma->masks_usage_stats);
+	kfree(ma->masks_usage_zero_cntr);
+	kfree(ma);
+}
+
 static void mask_array_rcu_cb(struct rcu_head *rcu)
 {
 	struct mask_array *ma = container_of(rcu, struct mask_array, rcu);
 
-	kfree(ma);
+	__mask_array_destroy(ma);
 }
 
 static struct mask_array *tbl_mask_array_alloc(int size)
 {
 	struct mask_array *new;
+	int cpu;
 
 	size = max(MASK_ARRAY_SIZE_MIN, size);
 	new = kzalloc(sizeof(struct mask_array) +
@@ -222,10 +270,29 @@ static struct mask_array *tbl_mask_array_alloc(int size)
 	if (!new)
 		return NULL;
 
+	new->masks_usage_zero_cntr = kcalloc(size, sizeof(u64), GFP_KERNEL);
+	if (!new->masks_usage_zero_cntr)
+		goto free_ma;
+
+	new->masks_usage_stats = __alloc_percpu(sizeof(struct mask_array_stats) +
+						sizeof(u64) * size,
+						__alignof__(u64));
+	if (!new->masks_usage_stats)
+		goto free_zero_cntr;
+
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(new->masks_usage_stats, cpu)->syncp);
+
 	new->count = 0;
 	new->max = size;
 
 	return new;
+
+free_zero_cntr:
+	kfree(new->masks_usage_zero_cntr);
+free_ma:
+	kfree(new);
+	return NULL;
 }
 
 static int tbl_mask_array_realloc(struct flow_table *tbl, int size)
@@ -256,6 +323,38 @@ static int tbl_mask_array_realloc(struct flow_table *tbl, int size)
 	return 0;
 }
 
+static void emc_free(struct flow_emc **emc)
+{
+	int cpu;
+
+	if (!emc)
+		return;
+
+	for_each_possible_cpu(cpu)
+		vfree(emc[cpu]);
+	kfree(emc);
+}
+
+static struct flow_emc **emc_alloc(void)
+{
+	struct flow_emc **emc;
+	int cpu;
+
+	emc = kcalloc(nr_cpu_ids, sizeof(*emc), GFP_KERNEL);
+	if (!emc)
+		return NULL;
+
+	for_each_possible_cpu(cpu) {
+		emc[cpu] = vzalloc_node(sizeof(struct flow_emc), cpu_to_node(cpu));
+		if (!emc[cpu]) {
+			emc_free(emc);
+			return NULL;
+		}
+	}
+
+	return emc;
+}
+
 int ovs_flow_tbl_init(struct flow_table *table)
 {
 	struct table_instance *ti, *ufid_ti;
@@ -266,9 +365,13 @@ int ovs_flow_tbl_init(struct flow_table *table)
 	if (!table->mask_cache)
 		return -ENOMEM;
 
+	table->emc = emc_alloc();
+	if (!table->emc)
+		goto free_mask_cache;
+
 	ma = tbl_mask_array_alloc(MASK_ARRAY_SIZE_MIN);
 	if (!ma)
-		goto free_mask_cache;
+		goto free_emc;
 
 	ti = table_instance_alloc(TBL_MIN_BUCKETS);
 	if (!ti)
@@ -284,12 +387,15 @@ int ovs_flow_tbl_init(struct flow_table *table)
 	table->last_rehash = jiffies;
 	table->count = 0;
 	table->ufid_count = 0;
+	table->in_batch = false;
 	return 0;
 
 free_ti:
 	__table_instance_destroy(ti);
 free_mask_array:
-	kfree(ma);
+	__mask_array_destroy(ma);
+free_emc:
+	emc_free(table->emc);
 free_mask_cache:
 	free_percpu(table->mask_cache);
 	return -ENOMEM;
@@ -312,12 +418,25 @@ static void table_instance_destroy(struct table_instance *ti,
 		return;
 
 	BUG_ON(!ufid_ti);
+
+	/* An instance being migrated into was never published and does not
+	 * own its flows.
+	 */
+	if (ti->next) {
+		__table_instance_destroy(ti->next);
+		ti->next = NULL;
+	}
+	if (ufid_ti->next) {
+		__table_instance_destroy(ufid_ti->next);
+		ufid_ti->next = NULL;
+	}
+
 	if (ti->keep_flows)
 		goto skip_flows;
 
 	for (i = 0; i < ti->n_buckets; i++) {
 		struct sw_flow *flow;
-		struct hlist_head *head = flex_array_get(ti->buckets, i);
+		struct hlist_head *head = &ti->buckets[i].head;
 		struct hlist_node *n;
 		int ver = ti->node_ver;
 		int ufid_ver = ufid_ti->node_ver;
@@ -326,6 +445,7 @@ static void table_instance_destroy(struct table_instance *ti,
 			hlist_del_rcu(&flow->flow_table.node[ver]);
 			if (ovs_identifier_is_ufid(&flow->id))
 				hlist_del_rcu(&flow->ufid_table.node[ufid_ver]);
+			hlist_del(&flow->mask_node);
 			ovs_flow_free(flow, deferred);
 		}
 	}
@@ -349,11 +469,12 @@ void ovs_flow_tbl_destroy(struct flow_table *table)
 	struct table_instance *ufid_ti = rcu_dereference_raw(table->ufid_ti);
 
 	free_percpu(table->mask_cache);
-	kfree(rcu_dereference_raw(table->mask_array));
+	emc_free(table->emc);
+	__mask_array_destroy(rcu_dereference_raw(table->mask_array));
 	table_instance_destroy(ti, ufid_ti, false);
 }
 
-struct sw_flow *ovs_flow_tbl_dump_next(struct table_instance *ti,
+struct sw_flow *ovs_flow_tbl_dump_next(struct table_instance *ti, u32 end,
 				       u32 *bucket, u32 *last)
 {
 	struct sw_flow *flow;
@@ -362,9 +483,10 @@ struct sw_flow *ovs_flow_tbl_dump_next(struct table_instance *ti,
 	int i;
 
 	ver = ti->node_ver;
-	while (*bucket < ti->n_buckets) {
+	end = min(end, ti->n_buckets);
+	while (*bucket < end) {
 		i = 0;
-		head = flex_array_get(ti->buckets, *bucket);
+		head = &ti->buckets[*bucket].head;
 		hlist_for_each_entry_rcu(flow, head, flow_table.node[ver]) {
 			if (i < *last) {
 				i++;
@@ -380,72 +502,222 @@ struct sw_flow *ovs_flow_tbl_dump_next(struct table_instance *ti,
 	return NULL;
 }
 
-static struct hlist_head *find_bucket(struct table_instance *ti, u32 hash)
+static u32 bucket_index(const struct table_instance *ti, u32 hash)
+{
+	return jhash_1word(hash, ti->hash_seed) & (ti->n_buckets - 1);
+}
+
+static struct flow_bucket *find_bucket(struct table_instance *ti, u32 hash)
+{
+	return &ti->buckets[bucket_index(ti, hash)];
+}
+
+static int bucket_slot(const struct flow_bucket *b, const struct sw_flow *flow)
+{
+	int i;
+
+	for (i = 0; i < BUCKET_SLOTS; i++)
+		if (rcu_access_pointer(b->flows[i]) == flow)
+			return i;
+
+	return -1;
+}
+
+static void bucket_slot_set(struct flow_bucket *b, int i,
+			    struct sw_flow *flow, u32 hash)
+{
+	WRITE_ONCE(b->hash[i], hash);
+	rcu_assign_pointer(b->flows[i], flow);
+}
+
+/* Must be called before 'flow' is linked on 'b->head'. */
+static void bucket_insert(struct flow_bucket *b, struct sw_flow *flow,
+			  u32 hash)
+{
+	int i = bucket_slot(b, NULL);
+
+	if (i >= 0)
+		bucket_slot_set(b, i, flow, hash);
+	WRITE_ONCE(b->n_flows, b->n_flows + 1);
+}
+
+/* Must be called after 'flow' is unlinked from 'b->head'.  If 'flow' held a
+ * slot and there are flows left that only live on the chain, one of them
+ * takes the slot before 'n_flows' drops, so that readers trusting the slots
+ * never miss a flow.
+ */
+static void bucket_remove(struct flow_bucket *b, struct sw_flow *flow,
+			  int ver, bool ufid)
+{
+	int i = bucket_slot(b, flow);
+
+	if (i >= 0) {
+		RCU_INIT_POINTER(b->flows[i], NULL);
+
+		if (b->n_flows > BUCKET_SLOTS) {
+			struct sw_flow *f;
+
+			if (ufid) {
+				hlist_for_each_entry(f, &b->head,
+						     ufid_table.node[ver])
+					if (bucket_slot(b, f) < 0)
+						break;
+				if (f)
+					bucket_slot_set(b, i, f,
+							f->ufid_table.hash);
+			} else {
+				hlist_for_each_entry(f, &b->head,
+						     flow_table.node[ver])
+					if (bucket_slot(b, f) < 0)
+						break;
+				if (f)
+					bucket_slot_set(b, i, f,
+							f->flow_table.hash);
+			}
+		}
+	}
+
+	smp_wmb();
+	WRITE_ONCE(b->n_flows, b->n_flows - 1);
+}
+
+/* True if every flow in 'b' is in its slots, false if the caller has to walk
+ * the chain instead.
+ */
+static bool bucket_slots_cover(const struct flow_bucket *b)
 {
-	hash = jhash_1word(hash, ti->hash_seed);
-	return flex_array_get(ti->buckets,
-				(hash & (ti->n_buckets - 1)));
+	unsigned int n = READ_ONCE(b->n_flows);
+
+	smp_rmb();
+	return n <= BUCKET_SLOTS;
 }
 
 static void table_instance_insert(struct table_instance *ti,
 				  struct sw_flow *flow)
 {
-	struct hlist_head *head;
+	struct flow_bucket *b;
 
-	head = find_bucket(ti, flow->flow_table.hash);
-	hlist_add_head_rcu(&flow->flow_table.node[ti->node_ver], head);
+	b = find_bucket(ti, flow->flow_table.hash);
+	bucket_insert(b, flow, flow->flow_table.hash);
+	hlist_add_head_rcu(&flow->flow_table.node[ti->node_ver], &b->head);
 }
 
 static void ufid_table_instance_insert(struct table_instance *ti,
 				       struct sw_flow *flow)
 {
-	struct hlist_head *head;
+	struct flow_bucket *b;
 
-	head = find_bucket(ti, flow->ufid_table.hash);
-	hlist_add_head_rcu(&flow->ufid_table.node[ti->node_ver], head);
+	b = find_bucket(ti, flow->ufid_table.hash);
+	bucket_insert(b, flow, flow->ufid_table.hash);
+	hlist_add_head_rcu(&flow->ufid_table.node[ti->node_ver], &b->head);
 }
 
-static void flow_table_copy_flows(struct table_instance *old,
-				  struct table_instance *new, bool ufid)
+static void table_instance_unlink(struct table_instance *ti,
+				  struct sw_flow *flow, bool ufid)
 {
-	int old_ver;
-	int i;
+	int ver = ti->node_ver;
 
-	old_ver = old->node_ver;
-	new->node_ver = !old_ver;
+	if (ufid) {
+		hlist_del_rcu(&flow->ufid_table.node[ver]);
+		bucket_remove(find_bucket(ti, flow->ufid_table.hash), flow,
+			      ver, true);
+	} else {
+		hlist_del_rcu(&flow->flow_table.node[ver]);
+		bucket_remove(find_bucket(ti, flow->flow_table.hash), flow,
+			      ver, false);
+	}
+}
 
-	/* Insert in new table. */
-	for (i = 0; i < old->n_buckets; i++) {
-		struct sw_flow *flow;
-		struct hlist_head *head;
+/* True if 'flow' is also linked into the instance 'ti' migrates to. */
+static bool flow_migrated(const struct table_instance *ti,
+			  const struct sw_flow *flow, bool ufid)
+{
+	u32 hash = ufid ? flow->ufid_table.hash : flow->flow_table.hash;
 
-		head = flex_array_get(old->buckets, i);
+	return ti->next && bucket_index(ti, hash) < ti->migrated;
+}
 
-		if (ufid)
-			hlist_for_each_entry(flow, head,
-					     ufid_table.node[old_ver])
-				ufid_table_instance_insert(new, flow);
-		else
-			hlist_for_each_entry(flow, head,
-					     flow_table.node[old_ver])
-				table_instance_insert(new, flow);
+/* Links 'flow' into 'ti', and into the instance 'ti' migrates to if the
+ * migration has already passed the flow's bucket.  Otherwise the migration
+ * picks it up when it gets there.
+ */
+static void table_link(struct table_instance *ti, struct sw_flow *flow,
+		       bool ufid)
+{
+	if (ufid) {
+		ufid_table_instance_insert(ti, flow);
+		if (flow_migrated(ti, flow, true))
+			ufid_table_instance_insert(ti->next, flow);
+	} else {
+		table_instance_insert(ti, flow);
+		if (flow_migrated(ti, flow, false))
+			table_instance_insert(ti->next, flow);
 	}
+}
 
-	old->keep_flows = true;
+static void table_unlink(struct table_instance *ti, struct sw_flow *flow,
+			 bool ufid)
+{
+	if (flow_migrated(ti, flow, ufid))
+		table_instance_unlink(ti->next, flow, ufid);
+	table_instance_unlink(ti, flow, ufid);
 }
 
-static struct table_instance *table_instance_rehash(struct table_instance *ti,
-						    int n_buckets, bool ufid)
+/* Starts moving the flows of '*tip' into a new instance of 'n_buckets'
+ * buckets with a fresh hash seed.  The new instance uses the other node
+ * version, so each flow can be linked into both while the move is going on.
+ * On allocation failure the table just stays as it is.
+ */
+static bool table_migration_start(struct table_instance __rcu **tip,
+				  unsigned int n_buckets)
 {
+	struct table_instance *ti = ovsl_dereference(*tip);
 	struct table_instance *new_ti;
 
 	new_ti = table_instance_alloc(n_buckets);
 	if (!new_ti)
-		return NULL;
+		return false;
+
+	new_ti->node_ver = !ti->node_ver;
+	ti->migrated = 0;
+	ti->next = new_ti;
+	return true;
+}
+
+/* Links the flows of up to 'n' more buckets of '*tip' into the instance it
+ * migrates to, and publishes that instance once every bucket is done.  This
+ * bounds the work of any single flow table update, unlike copying the whole
+ * table at once.
+ */
+static void table_migration_step(struct table_instance __rcu **tip,
+				 unsigned int n, bool ufid)
+{
+	struct table_instance *ti = ovsl_dereference(*tip);
+	int ver = ti->node_ver;
+
+	if (!ti->next)
+		return;
+
+	while (n-- && ti->migrated < ti->n_buckets) {
+		struct hlist_head *head = &ti->buckets[ti->migrated].head;
+		struct sw_flow *flow;
 
-	flow_table_copy_flows(ti, new_ti, ufid);
+		if (ufid)
+			hlist_for_each_entry(flow, head, ufid_table.node[ver])
+				ufid_table_instance_insert(ti->next, flow);
+		else
+			hlist_for_each_entry(flow, head, flow_table.node[ver])
+				table_instance_insert(ti->next, flow);
+		ti->migrated++;
+	}
+
+	if (ti->migrated < ti->n_buckets)
+		return;
 
-	return new_ti;
+	rcu_assign_pointer(*tip, ti->next);
+	ti->next = NULL;
+	ti->keep_flows = true;
+	call_rcu(&ti->rcu, flow_tbl_destroy_rcu_cb);
 }
 
 int ovs_flow_tbl_flush(struct flow_table *flow_table)
@@ -468,6 +740,7 @@ int ovs_flow_tbl_flush(struct flow_table *flow_table)
 	flow_table->last_rehash = jiffies;
 	flow_table->count = 0;
 	flow_table->ufid_count = 0;
+	emc_invalidate();
 
 	table_instance_destroy(old_ti, old_ufid_ti, true);
 	return 0;
@@ -522,6 +795,26 @@ static bool flow_cmp_masked_key(const struct sw_flow *flow,
 	return cmp_key(&flow->key, key, range->start, range->end);
 }
 
+/* Like flow_cmp_masked_key(), but applies 'mask' to 'key' on the fly, so the
+ * caller does not need a masked copy of the key.
+ */
+static bool flow_cmp_key_under_mask(const struct sw_flow *flow,
+				    const struct sw_flow_key *key,
+				    const struct sw_flow_mask *mask)
+{
+	int key_start = mask->range.start;
+	const long *cp1 = (const long *)((const u8 *)&flow->key + key_start);
+	const long *cp2 = (const long *)((const u8 *)key + key_start);
+	const long *mp = (const long *)((const u8 *)&mask->key + key_start);
+	long diffs = 0;
+	int i;
+
+	for (i = key_start; i < mask->range.end; i += sizeof(long))
+		diffs |= *cp1++ ^ (*cp2++ & *mp++);
+
+	return diffs == 0;
+}
+
 static bool ovs_flow_cmp_unmasked_key(const struct sw_flow *flow,
 				      const struct sw_flow_match *match)
 {
@@ -533,30 +826,251 @@ static bool ovs_flow_cmp_unmasked_key(const struct sw_flow *flow,
 	return cmp_key(flow->id.unmasked_key, key, key_start, key_end);
 }
 
+static void *mask_filter_zalloc(size_t size)
+{
+	if (size <= PAGE_SIZE)
+		return kzalloc(size, GFP_KERNEL);
+	return vzalloc(size);
+}
+
+static void mask_filter_zfree(void *p)
+{
+	if (is_vmalloc_addr(p))
+		vfree(p);
+	else
+		kfree(p);
+}
+
+static void mask_filter_free(struct mask_filter *filter)
+{
+	if (!filter)
+		return;
+
+	mask_filter_zfree(filter->counters);
+	mask_filter_zfree(filter->bits);
+	kfree(filter);
+}
+
+static void mask_filter_rcu_cb(struct rcu_head *rcu)
+{
+	mask_filter_free(container_of(rcu, struct mask_filter, rcu));
+}
+
+static struct mask_filter *mask_filter_alloc(unsigned int n_blocks)
+{
+	struct mask_filter *filter;
+
+	filter = kzalloc(sizeof(*filter), GFP_KERNEL);
+	if (!filter)
+		return NULL;
+
+	filter->n_blocks = n_blocks;
+	filter->bits = mask_filter_zalloc(n_blocks * MASK_FILTER_BLOCK_BITS / 8);
+	filter->counters = mask_filter_zalloc(n_blocks * MASK_FILTER_BLOCK_BITS);
+	if (!filter->bits || !filter->counters) {
+		mask_filter_free(filter);
+		return NULL;
+	}
+
+	return filter;
+}
+
+/* Fills 'bits' with the MASK_FILTER_K bit indexes for 'hash'.  They all fall
+ * into the same block, selected by the low bits of 'hash'.
+ */
+static void mask_filter_bits(const struct mask_filter *filter, u32 hash,
+			     unsigned int bits[MASK_FILTER_K])
+{
+	unsigned int base = (hash & (filter->n_blocks - 1)) *
+			    MASK_FILTER_BLOCK_BITS;
+	u32 h = jhash_1word(hash, MASK_FILTER_SEED);
+	int i;
+
+	for (i = 0; i < MASK_FILTER_K; i++) {
+		bits[i] = base + (h & (MASK_FILTER_BLOCK_BITS - 1));
+		h >>= MASK_FILTER_BLOCK_SHIFT;
+	}
+}
+
+static bool mask_filter_may_contain(const struct mask_filter *filter, u32 hash)
+{
+	unsigned int bits[MASK_FILTER_K];
+	int i;
+
+	mask_filter_bits(filter, hash, bits);
+	for (i = 0; i < MASK_FILTER_K; i++)
+		if (!test_bit(bits[i], filter->bits))
+			return false;
+
+	return true;
+}
+
+/* Counters saturate at U8_MAX and then stick, so a crowded bit can give a
+ * false positive but never a false negative.
+ */
+static void mask_filter_add(struct mask_filter *filter, u32 hash)
+{
+	unsigned int bits[MASK_FILTER_K];
+	int i;
+
+	mask_filter_bits(filter, hash, bits);
+	for (i = 0; i < MASK_FILTER_K; i++) {
+		u8 *c = &filter->counters[bits[i]];
+
+		if (*c == U8_MAX)
+			continue;
+		if ((*c)++ == 0)
+			set_bit(bits[i], filter->bits);
+	}
+	filter->n_flows++;
+}
+
+static void mask_filter_del(struct mask_filter *filter, u32 hash)
+{
+	unsigned int bits[MASK_FILTER_K];
+	int i;
+
+	mask_filter_bits(filter, hash, bits);
+	for (i = 0; i < MASK_FILTER_K; i++) {
+		u8 *c = &filter->counters[bits[i]];
+
+		if (*c == U8_MAX)
+			continue;
+		if (--(*c) == 0)
+			clear_bit(bits[i], filter->bits);
+	}
+	filter->n_flows--;
+}
+
+/* Rebuilds 'mask''s filter with twice the blocks from 'mask->flows'.  On
+ * allocation failure the old filter stays, only its accuracy suffers.
+ */
+static void mask_filter_grow(struct sw_flow_mask *mask)
+{
+	struct mask_filter *old = ovsl_dereference(mask->filter);
+	struct mask_filter *filter;
+	struct sw_flow *flow;
+
+	filter = mask_filter_alloc(old->n_blocks * 2);
+	if (!filter)
+		return;
+
+	hlist_for_each_entry(flow, &mask->flows, mask_node)
+		mask_filter_add(filter, flow->flow_table.hash);
+
+	rcu_assign_pointer(mask->filter, filter);
+	call_rcu(&old->rcu, mask_filter_rcu_cb);
+}
+
+/* Must be called before 'flow' becomes visible in the table. */
+static void mask_filter_insert(struct sw_flow *flow)
+{
+	struct sw_flow_mask *mask = flow->mask;
+	struct mask_filter *filter = ovsl_dereference(mask->filter);
+
+	if (filter &&
+	    filter->n_flows >= filter->n_blocks * MASK_FILTER_BLOCK_FLOWS &&
+	    filter->n_blocks < MASK_FILTER_MAX_BLOCKS) {
+		mask_filter_grow(mask);
+		filter = ovsl_dereference(mask->filter);
+	}
+
+	hlist_add_head(&flow->mask_node, &mask->flows);
+	if (filter)
+		mask_filter_add(filter, flow->flow_table.hash);
+}
+
+/* Must be called after 'flow' is unlinked from the table. */
+static void mask_filter_remove(struct sw_flow *flow)
+{
+	struct mask_filter *filter = ovsl_dereference(flow->mask->filter);
+
+	hlist_del(&flow->mask_node);
+	if (filter)
+		mask_filter_del(filter, flow->flow_table.hash);
+}
+
+/* Finds the flow with 'mask' whose masked key equals 'key' under 'mask'.
+ * 'hash' is the hash of the masked key.
+ */
+static struct sw_flow *bucket_lookup(struct table_instance *ti,
+				     const struct sw_flow_key *key,
+				     const struct sw_flow_mask *mask, u32 hash)
+{
+	struct flow_bucket *b = find_bucket(ti, hash);
+	struct sw_flow *flow;
+	int i;
+
+	if (bucket_slots_cover(b)) {
+		for (i = 0; i < BUCKET_SLOTS; i++) {
+			if (READ_ONCE(b->hash[i]) != hash)
+				continue;
+			flow = rcu_dereference_ovsl(b->flows[i]);
+			if (flow && flow->mask == mask &&
+			    flow->flow_table.hash == hash &&
+			    flow_cmp_key_under_mask(flow, key, mask))
+				return flow;
+		}
+		return NULL;
+	}
+
+	hlist_for_each_entry_rcu(flow, &b->head, flow_table.node[ti->node_ver]) {
+		if (flow->mask == mask && flow->flow_table.hash == hash &&
+		    flow_cmp_key_under_mask(flow, key, mask))
+			return flow;
+	}
+	return NULL;
+}
+
+/* Prefetches the flows in the bucket of 'hash' whose signature matches. */
+static void bucket_prefetch_flows(struct table_instance *ti, u32 hash)
+{
+	struct flow_bucket *b = find_bucket(ti, hash);
+	int i;
+
+	if (!bucket_slots_cover(b))
+		return;
+
+	for (i = 0; i < BUCKET_SLOTS; i++)
+		if (READ_ONCE(b->hash[i]) == hash)
+			prefetch(rcu_dereference(b->flows[i]));
+}
+
 static struct sw_flow *masked_flow_lookup(struct table_instance *ti,
 					  const struct sw_flow_key *unmasked,
 					  const struct sw_flow_mask *mask,
 					  u32 *n_mask_hit)
 {
-	struct sw_flow *flow;
-	struct hlist_head *head;
+	struct mask_filter *filter;
 	u32 hash;
 	struct sw_flow_key masked_key;
 
 	ovs_flow_mask_key(&masked_key, unmasked, false, mask);
 	hash = flow_hash(&masked_key, &mask->range);
-	head = find_bucket(ti, hash);
 	(*n_mask_hit)++;
-	hlist_for_each_entry_rcu(flow, head, flow_table.node[ti->node_ver]) {
-		if (flow->mask == mask && flow->flow_table.hash == hash &&
-		    flow_cmp_masked_key(flow, &masked_key, &mask->range))
-			return flow;
-	}
-	return NULL;
+
+	/* Skip the bucket walk if no flow with this mask can match. */
+	filter = rcu_dereference_ovsl(mask->filter);
+	if (filter && !mask_filter_may_contain(filter, hash))
+		return NULL;
+
+	return bucket_lookup(ti, &masked_key, mask, hash);
+}
+
+static void mask_usage_inc(const struct mask_array *ma, int index)
+{
+	struct mask_array_stats *stats = this_cpu_ptr(ma->masks_usage_stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	stats->usage_cntrs[index]++;
+	u64_stats_update_end(&stats->syncp);
 }
 
 /* Flow lookup does full lookup on flow table. It starts with
- * mask from index passed in *index.
+ * mask from index passed in *index.  Masks are probed in array order, which
+ * ovs_flow_masks_rebalance() keeps sorted by hit frequency.
+ *
+ * Must be called with BH disabled, the mask usage counters are per cpu.
  */
 static struct sw_flow *flow_lookup(struct flow_table *tbl,
 				   struct table_instance *ti,
@@ -573,8 +1087,10 @@ static struct sw_flow *flow_lookup(struct flow_table *tbl,
 		mask = rcu_dereference_ovsl(ma->masks[*index]);
 		if (mask) {
 			flow = masked_flow_lookup(ti, key, mask, n_mask_hit);
-			if (flow)
+			if (flow) {
+				mask_usage_inc(ma, *index);
 				return flow;
+			}
 		}
 	}
 
@@ -590,6 +1106,7 @@ static struct sw_flow *flow_lookup(struct flow_table *tbl,
 		flow = masked_flow_lookup(ti, key, mask, n_mask_hit);
 		if (flow) { /* Found */
 			*index = i;
+			mask_usage_inc(ma, i);
 			return flow;
 		}
 	}
@@ -604,10 +1121,10 @@ static struct sw_flow *flow_lookup(struct flow_table *tbl,
  * This is per cpu cache and is divided in MC_HASH_SEGS segments.
  * In case of a hash collision the entry is hashed in next segment.
  */
-struct sw_flow *ovs_flow_tbl_lookup_stats(struct flow_table *tbl,
-					  const struct sw_flow_key *key,
-					  u32 skb_hash,
-					  u32 *n_mask_hit)
+static struct sw_flow *mask_cache_lookup(struct flow_table *tbl,
+					 const struct sw_flow_key *key,
+					 u32 skb_hash,
+					 u32 *n_mask_hit)
 {
 	struct mask_array *ma = rcu_dereference(tbl->mask_array);
 	struct table_instance *ti = rcu_dereference(tbl->ti);
@@ -616,19 +1133,6 @@ struct sw_flow *ovs_flow_tbl_lookup_stats(struct flow_table *tbl,
 	u32 hash;
 	int seg;
 
-	*n_mask_hit = 0;
-	if (unlikely(!skb_hash)) {
-		u32 mask_index = 0;
-
-		return flow_lookup(tbl, ti, ma, key, n_mask_hit, &mask_index);
-	}
-
-	/* Pre and post recirulation flows usually have the same skb_hash
-	 * value. To avoid hash collisions, rehash the 'skb_hash' with
-	 * 'recirc_id'.  */
-	if (key->recirc_id)
-		skb_hash = jhash_1word(skb_hash, key->recirc_id);
-
 	ce = NULL;
 	hash = skb_hash;
 	entries = this_cpu_ptr(tbl->mask_cache);
@@ -661,15 +1165,360 @@ struct sw_flow *ovs_flow_tbl_lookup_stats(struct flow_table *tbl,
 	return flow;
 }
 
+static bool emc_key_equal(const struct emc_entry *e,
+			  const struct sw_flow_key *key)
+{
+	const long *cp = (const long *)((const u8 *)key + EMC_KEY_START);
+	long diffs = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(e->key); i++)
+		diffs |= e->key[i] ^ cp[i];
+
+	return diffs == 0;
+}
+
+/*
+ * The exact-match cache maps a full packet key to the flow it matched, so a
+ * hit skips masking and hashing altogether.  It is per cpu and 2-way: each
+ * key may live in one of EMC_SEGS slots picked from successive bits of the
+ * skb_hash.  A removed flow stops hitting at once; its entries are only
+ * invalidated, together with all others, by the next bump of 'emc_gen'.
+ */
+static struct sw_flow *emc_lookup(struct flow_table *tbl,
+				  const struct sw_flow_key *key, u32 skb_hash,
+				  unsigned long gen)
+{
+	struct flow_emc *emc = tbl->emc[smp_processor_id()];
+	u32 hash = skb_hash;
+	int seg;
+
+	for (seg = 0; seg < EMC_SEGS; seg++) {
+		struct emc_entry *e;
+
+		e = &emc->entries[hash & (EMC_ENTRIES - 1)];
+		if (e->skb_hash == skb_hash && e->gen == gen &&
+		    emc_key_equal(e, key) && !READ_ONCE(e->flow->removed))
+			return e->flow;
+
+		hash >>= EMC_SHIFT;
+	}
+
+	return NULL;
+}
+
+static void emc_insert(struct flow_table *tbl, const struct sw_flow_key *key,
+		       u32 skb_hash, struct sw_flow *flow, unsigned long gen)
+{
+	struct flow_emc *emc = tbl->emc[smp_processor_id()];
+	struct emc_entry *e = NULL;
+	u32 hash = skb_hash;
+	int seg;
+
+	for (seg = 0; seg < EMC_SEGS; seg++) {
+		e = &emc->entries[hash & (EMC_ENTRIES - 1)];
+		if (e->gen != gen)
+			break;	/* Stale entry, reuse it. */
+
+		hash >>= EMC_SHIFT;
+	}
+
+	/* All ways are live: evict the first one.  The cache is refilled on
+	 * the next miss of the evicted key anyway.
+	 */
+	if (seg == EMC_SEGS)
+		e = &emc->entries[skb_hash & (EMC_ENTRIES - 1)];
+
+	e->skb_hash = skb_hash;
+	e->gen = gen;
+	e->flow = flow;
+	memcpy(e->key, (const u8 *)key + EMC_KEY_START, EMC_KEY_LEN);
+}
+
+struct sw_flow *ovs_flow_tbl_lookup_stats(struct flow_table *tbl,
+					  const struct sw_flow_key *key,
+					  u32 skb_hash,
+					  u32 *n_mask_hit)
+{
+	unsigned long gen;
+	struct sw_flow *flow;
+	bool use_emc;
+
+	*n_mask_hit = 0;
+	if (unlikely(!skb_hash)) {
+		struct mask_array *ma = rcu_dereference(tbl->mask_array);
+		struct table_instance *ti = rcu_dereference(tbl->ti);
+		u32 mask_index = 0;
+
+		return flow_lookup(tbl, ti, ma, key, n_mask_hit, &mask_index);
+	}
+
+	/* Pre and post recirulation flows usually have the same skb_hash
+	 * value. To avoid hash collisions, rehash the 'skb_hash' with
+	 * 'recirc_id'.  */
+	if (key->recirc_id)
+		skb_hash = jhash_1word(skb_hash, key->recirc_id);
+
+	gen = emc_read_gen();
+	use_emc = likely(!key->tun_opts_len);
+	if (use_emc) {
+		flow = emc_lookup(tbl, key, skb_hash, gen);
+		if (flow)
+			return flow;
+	}
+
+	flow = mask_cache_lookup(tbl, key, skb_hash, n_mask_hit);
+	if (flow && use_emc)
+		emc_insert(tbl, key, skb_hash, flow, gen);
+
+	return flow;
+}
+
+/* Key fields that conntrack sets and that are part of the recirculation
+ * cache key, so the next flow may match them freely.
+ */
+static struct sw_flow_key recirc_keyed __read_mostly;
+
+/* Key fields that conntrack sets from the connection, for IPv4 and IPv6
+ * packets.  They vary between packets of one flow, so the next flow must not
+ * match them.
+ */
+static struct sw_flow_key recirc_unstable[2] __read_mostly;
+
+static void recirc_masks_init(void)
+{
+	int i;
+
+	memset(&recirc_keyed.recirc_id, 0xff, sizeof(recirc_keyed.recirc_id));
+	memset(&recirc_keyed.ct_state, 0xff, sizeof(recirc_keyed.ct_state));
+	memset(&recirc_keyed.ct_zone, 0xff, sizeof(recirc_keyed.ct_zone));
+	memset(&recirc_keyed.ct.mark, 0xff, sizeof(recirc_keyed.ct.mark));
+
+	for (i = 0; i < ARRAY_SIZE(recirc_unstable); i++) {
+		struct sw_flow_key *k = &recirc_unstable[i];
+
+		memset(&k->ct_orig_proto, 0xff, sizeof(k->ct_orig_proto));
+		memset(&k->ct.orig_tp, 0xff, sizeof(k->ct.orig_tp));
+		memset(&k->ct.labels, 0xff, sizeof(k->ct.labels));
+	}
+	memset(&recirc_unstable[0].ipv4.ct_orig, 0xff,
+	       sizeof(recirc_unstable[0].ipv4.ct_orig));
+	memset(&recirc_unstable[1].ipv6.ct_orig, 0xff,
+	       sizeof(recirc_unstable[1].ipv6.ct_orig));
+}
+
+/* Returns true if every packet that matched 'from' and then had only its
+ * conntrack fields and recirc_id changed matches 'to' once those are fixed,
+ * that is, if 'to' only matches bits that 'from' matched or that are part of
+ * the recirculation cache key.
+ */
+static bool recirc_mask_covered(const struct sw_flow_mask *from,
+				const struct sw_flow_mask *to, bool ipv6)
+{
+	const long *a = (const long *)&from->key;
+	const long *b = (const long *)&to->key;
+	const long *keyed = (const long *)&recirc_keyed;
+	const long *unstable = (const long *)&recirc_unstable[ipv6];
+	int i;
+
+	for (i = to->range.start / sizeof(long);
+	     i < to->range.end / sizeof(long); i++)
+		if (b[i] & (unstable[i] | ~(a[i] | keyed[i])))
+			return false;
+
+	return true;
+}
+
+static u32 recirc_hash(const struct sw_flow *from,
+		       const struct sw_flow_key *key)
+{
+	return jhash_3words((u32)(unsigned long)from, key->recirc_id,
+			    key->ct.mark ^ ((u32)key->ct_zone << 8 |
+					    key->ct_state), 0);
+}
+
+/*
+ * Looks up 'key', which the flow 'from' recirculated after only running
+ * conntrack on it (see sw_flow_actions.ct_recirc).  Every packet of 'from'
+ * that comes back with the same conntrack fields matches the same flow,
+ * unless that flow matches fields 'from' did not, so the answer is cached per
+ * cpu and the flow table is only searched on a cache miss.
+ */
+struct sw_flow *ovs_flow_tbl_lookup_recirc(struct flow_table *tbl,
+					   const struct sw_flow *from,
+					   const struct sw_flow_key *key,
+					   u32 skb_hash,
+					   u32 *n_mask_hit)
+{
+	struct flow_emc *emc = tbl->emc[smp_processor_id()];
+	unsigned long gen = emc_read_gen();
+	struct recirc_entry *e;
+	struct sw_flow *flow;
+
+	e = &emc->recirc[recirc_hash(from, key) & (RECIRC_CACHE_ENTRIES - 1)];
+	if (e->from == from && e->gen == gen &&
+	    e->recirc_id == key->recirc_id && e->ct_state == key->ct_state &&
+	    e->ct_zone == key->ct_zone && e->ct_mark == key->ct.mark &&
+	    !READ_ONCE(e->flow->removed)) {
+		*n_mask_hit = 0;
+		return e->flow;
+	}
+
+	flow = ovs_flow_tbl_lookup_stats(tbl, key, skb_hash, n_mask_hit);
+	if (flow && recirc_mask_covered(from->mask, flow->mask,
+					key->eth.type == htons(ETH_P_IPV6))) {
+		e->from = from;
+		e->recirc_id = key->recirc_id;
+		e->ct_mark = key->ct.mark;
+		e->ct_zone = key->ct_zone;
+		e->ct_state = key->ct_state;
+		e->gen = gen;
+		e->flow = flow;
+	}
+
+	return flow;
+}
+
+/*
+ * Batched ovs_flow_tbl_lookup_stats().  Every stage runs over the whole batch
+ * before the next one starts, so the cache misses of different packets
+ * overlap instead of being paid one after the other:
+ *
+ *   1. Rehash the skb hashes and prefetch the EMC and mask cache entries.
+ *   2. Probe the EMC; on a miss hash the key under the mask the mask cache
+ *      points to and prefetch its bucket.
+ *   3. Prefetch the flows whose bucket signature matches.
+ *   4. Compare.  Packets that miss the cached mask, or have no cache entry,
+ *      fall back to mask_cache_lookup().
+ *
+ * 'n' must not exceed FLOW_TBL_BATCH_MAX.  Must be called with
+ * rcu_read_lock and bottom halves disabled.
+ */
+void ovs_flow_tbl_lookup_batch(struct flow_table *tbl,
+			       const struct sw_flow_key *keys,
+			       const u32 *skb_hashes, struct sw_flow **flows,
+			       int n, u32 *n_mask_hit)
+{
+	unsigned long gen = emc_read_gen();
+	struct mask_array *ma = rcu_dereference(tbl->mask_array);
+	struct table_instance *ti = rcu_dereference(tbl->ti);
+	struct mask_cache_entry *entries = this_cpu_ptr(tbl->mask_cache);
+	struct flow_emc *emc = tbl->emc[smp_processor_id()];
+	struct sw_flow_mask *masks[FLOW_TBL_BATCH_MAX];
+	u32 mask_index[FLOW_TBL_BATCH_MAX];
+	u32 hashes[FLOW_TBL_BATCH_MAX];
+	u32 flow_hashes[FLOW_TBL_BATCH_MAX];
+	struct sw_flow_key masked_key;
+	int i;
+
+	*n_mask_hit = 0;
+
+	for (i = 0; i < n; i++) {
+		u32 hash = skb_hashes[i];
+
+		if (hash && keys[i].recirc_id)
+			hash = jhash_1word(hash, keys[i].recirc_id);
+		hashes[i] = hash;
+		flows[i] = NULL;
+		masks[i] = NULL;
+		if (!hash)
+			continue;
+
+		prefetch(&emc->entries[hash & (EMC_ENTRIES - 1)]);
+		prefetch(&entries[hash & (MC_HASH_ENTRIES - 1)]);
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct sw_flow_key *key = &keys[i];
+		struct mask_cache_entry *ce;
+		struct mask_filter *filter;
+		struct sw_flow_mask *mask;
+		u32 hash = hashes[i];
+
+		if (!hash)
+			continue;
+
+		if (likely(!key->tun_opts_len)) {
+			flows[i] = emc_lookup(tbl, key, hash, gen);
+			if (flows[i])
+				continue;
+		}
+
+		ce = &entries[hash & (MC_HASH_ENTRIES - 1)];
+		if (ce->skb_hash != hash || ce->mask_index >= ma->max)
+			continue;
+
+		mask = rcu_dereference(ma->masks[ce->mask_index]);
+		if (!mask)
+			continue;
+
+		ovs_flow_mask_key(&masked_key, key, false, mask);
+		flow_hashes[i] = flow_hash(&masked_key, &mask->range);
+		(*n_mask_hit)++;
+
+		filter = rcu_dereference(mask->filter);
+		if (filter && !mask_filter_may_contain(filter, flow_hashes[i]))
+			continue;
+
+		masks[i] = mask;
+		mask_index[i] = ce->mask_index;
+		prefetch(find_bucket(ti, flow_hashes[i]));
+	}
+
+	for (i = 0; i < n; i++)
+		if (masks[i])
+			bucket_prefetch_flows(ti, flow_hashes[i]);
+
+	for (i = 0; i < n; i++) {
+		const struct sw_flow_key *key = &keys[i];
+		u32 hit = 0;
+
+		if (flows[i])
+			continue;
+
+		if (masks[i]) {
+			flows[i] = bucket_lookup(ti, key, masks[i],
+						 flow_hashes[i]);
+			if (flows[i]) {
+				mask_usage_inc(ma, mask_index[i]);
+				goto emc_fill;
+			}
+		}
+
+		if (unlikely(!hashes[i])) {
+			u32 index = 0;
+
+			flows[i] = flow_lookup(tbl, ti, ma, key, &hit, &index);
+			*n_mask_hit += hit;
+			continue;
+		}
+
+		flows[i] = mask_cache_lookup(tbl, key, hashes[i], &hit);
+		*n_mask_hit += hit;
+
+emc_fill:
+		if (flows[i] && likely(!key->tun_opts_len))
+			emc_insert(tbl, key, hashes[i], flows[i], gen);
+	}
+}
+
 struct sw_flow *ovs_flow_tbl_lookup(struct flow_table *tbl,
 				    const struct sw_flow_key *key)
 {
 	struct table_instance *ti = rcu_dereference_ovsl(tbl->ti);
 	struct mask_array *ma = rcu_dereference_ovsl(tbl->mask_array);
 	u32 __always_unused n_mask_hit;
+	struct sw_flow *flow;
 	u32 index = 0;
 
-	return flow_lookup(tbl, ti, ma, key, &n_mask_hit, &index);
+	/* Called through the netlink interface and therefore preemptible,
+	 * but flow_lookup() touches per cpu counters.
+	 */
+	local_bh_disable();
+	flow = flow_lookup(tbl, ti, ma, key, &n_mask_hit, &index);
+	local_bh_enable();
+
+	return flow;
 }
 
 struct sw_flow *ovs_flow_tbl_lookup_exact(struct flow_table *tbl,
@@ -723,12 +1572,25 @@ struct sw_flow *ovs_flow_tbl_lookup_ufid(struct flow_table *tbl,
 {
 	struct table_instance *ti = rcu_dereference_ovsl(tbl->ufid_ti);
 	struct sw_flow *flow;
-	struct hlist_head *head;
+	struct flow_bucket *b;
 	u32 hash;
+	int i;
 
 	hash = ufid_hash(ufid);
-	head = find_bucket(ti, hash);
-	hlist_for_each_entry_rcu(flow, head, ufid_table.node[ti->node_ver]) {
+	b = find_bucket(ti, hash);
+	if (bucket_slots_cover(b)) {
+		for (i = 0; i < BUCKET_SLOTS; i++) {
+			if (READ_ONCE(b->hash[i]) != hash)
+				continue;
+			flow = rcu_dereference_ovsl(b->flows[i]);
+			if (flow && flow->ufid_table.hash == hash &&
+			    ovs_flow_cmp_ufid(flow, ufid))
+				return flow;
+		}
+		return NULL;
+	}
+
+	hlist_for_each_entry_rcu(flow, &b->head, ufid_table.node[ti->node_ver]) {
 		if (flow->ufid_table.hash == hash &&
 		    ovs_flow_cmp_ufid(flow, ufid))
 			return flow;
@@ -744,10 +1606,102 @@ int ovs_flow_tbl_num_masks(const struct flow_table *table)
 	return ma->count;
 }
 
-static struct table_instance *table_instance_expand(struct table_instance *ti,
-						    bool ufid)
+struct mask_count {
+	int index;
+	u64 counter;
+};
+
+static int compare_mask_and_count(const void *a, const void *b)
+{
+	const struct mask_count *mc_a = a;
+	const struct mask_count *mc_b = b;
+
+	/* Most used first; keep the current order on ties so that an idle
+	 * table is never reshuffled.
+	 */
+	if (mc_a->counter != mc_b->counter)
+		return mc_a->counter > mc_b->counter ? -1 : 1;
+	return mc_a->index - mc_b->index;
+}
+
+/* Must be called with OVS mutex held.
+ *
+ * Reorders the mask array so that the masks hit most often since the last
+ * call are probed first by flow_lookup().  Cached mask indexes in the
+ * per cpu mask cache may point to a different mask afterwards, which only
+ * costs a full lookup, as with any other mask array reallocation.
+ */
+void ovs_flow_masks_rebalance(struct flow_table *table)
+{
+	struct mask_array *ma = ovsl_dereference(table->mask_array);
+	struct mask_count *masks_and_count;
+	struct mask_array *new;
+	int masks_entries = 0;
+	int i;
+
+	masks_and_count = kmalloc_array(ma->max, sizeof(*masks_and_count),
+					GFP_KERNEL);
+	if (!masks_and_count)
+		return;
+
+	for (i = 0; i < ma->max; i++) {
+		u64 counter = 0;
+		int cpu;
+
+		if (!ovsl_dereference(ma->masks[i]))
+			continue;
+
+		for_each_possible_cpu(cpu) {
+			struct mask_array_stats *stats;
+			unsigned int start;
+			u64 counter_cpu;
+
+			stats = per_cpu_ptr(ma->masks_usage_stats, cpu);
+			do {
+				start = u64_stats_fetch_begin_irq(&stats->syncp);
+				counter_cpu = stats->usage_cntrs[i];
+			} while (u64_stats_fetch_retry_irq(&stats->syncp, start));
+
+			counter += counter_cpu;
+		}
+
+		masks_and_count[masks_entries].index = i;
+		masks_and_count[masks_entries].counter =
+			counter - ma->masks_usage_zero_cntr[i];
+		ma->masks_usage_zero_cntr[i] = counter;
+		masks_entries++;
+	}
+
+	sort(masks_and_count, masks_entries, sizeof(*masks_and_count),
+	     compare_mask_and_count, NULL);
+
+	/* Nothing to do if the masks are already in order. */
+	for (i = 0; i < masks_entries; i++)
+		if (masks_and_count[i].index != i)
+			break;
+	if (i == masks_entries)
+		goto free_mask_entries;
+
+	new = tbl_mask_array_alloc(ma->max);
+	if (!new)
+		goto free_mask_entries;
+
+	for (i = 0; i < masks_entries; i++)
+		new->masks[new->count++] = ma->masks[masks_and_count[i].index];
+
+	rcu_assign_pointer(table->mask_array, new);
+	call_rcu(&ma->rcu, mask_array_rcu_cb);
+
+free_mask_entries:
+	kfree(masks_and_count);
+}
+
+static void mask_free_rcu(struct rcu_head *rcu)
 {
-	return table_instance_rehash(ti, ti->n_buckets * 2, ufid);
+	struct sw_flow_mask *mask = container_of(rcu, struct sw_flow_mask, rcu);
+
+	mask_filter_free(rcu_dereference_raw(mask->filter));
+	kfree(mask);
 }
 
 static void tbl_mask_array_delete_mask(struct mask_array *ma,
@@ -760,7 +1714,7 @@ static void tbl_mask_array_delete_mask(struct mask_array *ma,
 		if (mask == ovsl_dereference(ma->masks[i])) {
 			RCU_INIT_POINTER(ma->masks[i], NULL);
 			ma->count--;
-			kfree_rcu(mask, rcu);
+			call_rcu(&mask->rcu, mask_free_rcu);
 			return;
 		}
 	}
@@ -800,17 +1754,21 @@ void ovs_flow_tbl_remove(struct flow_table *table, struct sw_flow *flow)
 	struct table_instance *ufid_ti = ovsl_dereference(table->ufid_ti);
 
 	BUG_ON(table->count == 0);
-	hlist_del_rcu(&flow->flow_table.node[ti->node_ver]);
+	table_unlink(ti, flow, false);
 	table->count--;
 	if (ovs_identifier_is_ufid(&flow->id)) {
-		hlist_del_rcu(&flow->ufid_table.node[ufid_ti->node_ver]);
+		table_unlink(ufid_ti, flow, true);
 		table->ufid_count--;
 	}
+	mask_filter_remove(flow);
 
 	/* RCU delete the mask. 'flow->mask' is not NULLed, as it should be
 	 * accessible as long as the RCU read lock is held.
 	 */
 	flow_mask_remove(table, flow->mask);
+
+	/* Cache entries still point to the flow until it is reaped. */
+	WRITE_ONCE(flow->removed, true);
 }
 
 static struct sw_flow_mask *mask_alloc(void)
@@ -818,8 +1776,12 @@ static struct sw_flow_mask *mask_alloc(void)
 	struct sw_flow_mask *mask;
 
 	mask = kmalloc(sizeof(*mask), GFP_KERNEL);
-	if (mask)
+	if (mask) {
 		mask->ref_count = 1;
+		INIT_HLIST_HEAD(&mask->flows);
+		/* A mask without a filter just never skips its bucket. */
+		RCU_INIT_POINTER(mask->filter, mask_filter_alloc(1));
+	}
 
 	return mask;
 }
@@ -880,6 +1842,7 @@ static int flow_mask_insert(struct flow_table *tbl, struct sw_flow *flow,
 			err = tbl_mask_array_realloc(tbl, ma->max +
 							  MASK_ARRAY_SIZE_MIN);
 			if (err) {
+				mask_filter_free(ovsl_dereference(mask->filter));
 				kfree(mask);
 				return err;
 			}
@@ -906,28 +1869,71 @@ static int flow_mask_insert(struct flow_table *tbl, struct sw_flow *flow,
 	return 0;
 }
 
+/* Must be called with OVS mutex held.
+ *
+ * Grows the table once it holds more flows than buckets, and rotates its
+ * hash seed every REHASH_INTERVAL.  Both go through an incremental
+ * migration, so each call only moves TBL_MIGRATE_BUCKETS buckets.
+ */
+static void flow_key_expand(struct flow_table *table)
+{
+	struct table_instance *ti = ovsl_dereference(table->ti);
+	unsigned int n_buckets;
+
+	if (!ti->next) {
+		n_buckets = ti->n_buckets;
+		while (table->count > n_buckets)
+			n_buckets *= 2;
+
+		if ((n_buckets != ti->n_buckets ||
+		     time_after(jiffies, table->last_rehash + REHASH_INTERVAL)) &&
+		    table_migration_start(&table->ti, n_buckets))
+			table->last_rehash = jiffies;
+	}
+
+	table_migration_step(&table->ti, TBL_MIGRATE_BUCKETS, false);
+}
+
+/* Must be called with OVS mutex held. */
+static void flow_ufid_expand(struct flow_table *table)
+{
+	struct table_instance *ti = ovsl_dereference(table->ufid_ti);
+	unsigned int n_buckets;
+
+	if (!ti->next) {
+		n_buckets = ti->n_buckets;
+		while (table->ufid_count > n_buckets)
+			n_buckets *= 2;
+		if (n_buckets == ti->n_buckets ||
+		    !table_migration_start(&table->ufid_ti, n_buckets))
+			return;
+	}
+
+	table_migration_step(&table->ufid_ti, TBL_MIGRATE_BUCKETS, true);
+}
+
+/* Must be called with OVS mutex held.  Advances a pending migration by a
+ * larger step, so that it completes even when flow updates stop.
+ */
+void ovs_flow_tbl_migrate(struct flow_table *table)
+{
+	table_migration_step(&table->ti, TBL_MIGRATE_BUCKETS_IDLE, false);
+	table_migration_step(&table->ufid_ti, TBL_MIGRATE_BUCKETS_IDLE, true);
+}
+
 /* Must be called with OVS mutex held. */
 static void flow_key_insert(struct flow_table *table, struct sw_flow *flow)
 {
-	struct table_instance *new_ti = NULL;
 	struct table_instance *ti;
 
 	flow->flow_table.hash = flow_hash(&flow->key, &flow->mask->range);
+	mask_filter_insert(flow);
 	ti = ovsl_dereference(table->ti);
-	table_instance_insert(ti, flow);
+	table_link(ti, flow, false);
 	table->count++;
 
-	/* Expand table, if necessary, to make room. */
-	if (table->count > ti->n_buckets)
-		new_ti = table_instance_expand(ti, false);
-	else if (time_after(jiffies, table->last_rehash + REHASH_INTERVAL))
-		new_ti = table_instance_rehash(ti, ti->n_buckets, false);
-
-	if (new_ti) {
-		rcu_assign_pointer(table->ti, new_ti);
-		call_rcu(&ti->rcu, flow_tbl_destroy_rcu_cb);
-		table->last_rehash = jiffies;
-	}
+	if (!table->in_batch)
+		flow_key_expand(table);
 }
 
 /* Must be called with OVS mutex held. */
@@ -937,19 +1943,29 @@ static void flow_ufid_insert(struct flow_table *table, struct sw_flow *flow)
 
 	flow->ufid_table.hash = ufid_hash(&flow->id);
 	ti = ovsl_dereference(table->ufid_ti);
-	ufid_table_instance_insert(ti, flow);
+	table_link(ti, flow, true);
 	table->ufid_count++;
 
-	/* Expand table, if necessary, to make room. */
-	if (table->ufid_count > ti->n_buckets) {
-		struct table_instance *new_ti;
+	if (!table->in_batch)
+		flow_ufid_expand(table);
+}
 
-		new_ti = table_instance_expand(ti, true);
-		if (new_ti) {
-			rcu_assign_pointer(table->ufid_ti, new_ti);
-			call_rcu(&ti->rcu, flow_tbl_destroy_rcu_cb);
-		}
-	}
+/* Must be called with OVS mutex held.  Until the matching
+ * ovs_flow_tbl_batch_end(), inserts leave the tables to grow past their
+ * load factor instead of rehashing them, so that a batch of inserts
+ * expands each table at most once.
+ */
+void ovs_flow_tbl_batch_begin(struct flow_table *table)
+{
+	table->in_batch = true;
+}
+
+/* Must be called with OVS mutex held. */
+void ovs_flow_tbl_batch_end(struct flow_table *table)
+{
+	table->in_batch = false;
+	flow_key_expand(table);
+	flow_ufid_expand(table);
 }
 
 /* Must be called with OVS mutex held. */
@@ -975,18 +1991,16 @@ int ovs_flow_init(void)
 {
 	BUILD_BUG_ON(__alignof__(struct sw_flow_key) % __alignof__(long));
 	BUILD_BUG_ON(sizeof(struct sw_flow_key) % sizeof(long));
+	BUILD_BUG_ON(EMC_KEY_START % sizeof(long));
+
+	recirc_masks_init();
 
-	flow_cache = kmem_cache_create("sw_flow", sizeof(struct sw_flow)
-				       + (nr_cpu_ids
-					  * sizeof(struct flow_stats *)),
+	flow_cache = kmem_cache_create("sw_flow", sizeof(struct sw_flow),
 				       0, 0, NULL);
 	if (flow_cache == NULL)
 		return -ENOMEM;
 
-	flow_stats_cache
-		= kmem_cache_create("sw_flow_stats", sizeof(struct flow_stats),
-				    0, SLAB_HWCACHE_ALIGN, NULL);
-	if (flow_stats_cache == NULL) {
+	if (ovs_flow_stats_init()) {
 		kmem_cache_destroy(flow_cache);
 		flow_cache = NULL;
 		return -ENOMEM;
@@ -998,6 +2012,9 @@ int ovs_flow_init(void)
 /* Uninitializes the flow module. */
 void ovs_flow_exit(void)
 {
-	kmem_cache_destroy(flow_stats_cache);
+	cancel_delayed_work_sync(&emc_reap_work);
+	emc_reap(NULL);
+	rcu_barrier();
+	ovs_flow_stats_exit();
 	kmem_cache_destroy(flow_cache);
 }
@@ -29,7 +29,7 @@
 #include <linux/in6.h>
 #include <linux/jiffies.h>
 #include <linux/time.h>
-#include <linux/flex_array.h>
+#include <linux/u64_stats_sync.h>
 
 #include <net/inet_ecn.h>
 #include <net/ip_tunnels.h>
@@ -41,32 +41,114 @@ struct mask_cache_entry {
 	u32 mask_index;
 };
 
+/* Exact-match cache.  Entries hold the packet key from 'tun_key' on (keys
+ * with tunnel options bypass the cache) and are valid only while 'gen'
+ * equals the global cache generation and their flow is not 'removed'.
+ */
+#define EMC_SHIFT		10
+#define EMC_ENTRIES		(1u << EMC_SHIFT)
+#define EMC_KEY_START		offsetof(struct sw_flow_key, tun_key)
+#define EMC_KEY_LEN		(sizeof(struct sw_flow_key) - EMC_KEY_START)
+
+struct emc_entry {
+	u32 skb_hash;
+	unsigned long gen;
+	struct sw_flow *flow;
+	long key[EMC_KEY_LEN / sizeof(long)];
+};
+
+/* Recirculation cache.  Maps a flow that only runs conntrack and then
+ * recirculates, together with the conntrack fields and recirc_id of the
+ * recirculated key, to the flow that key matched.  Shares 'gen' with the EMC.
+ */
+#define RECIRC_CACHE_SHIFT	8
+#define RECIRC_CACHE_ENTRIES	(1u << RECIRC_CACHE_SHIFT)
+
+struct recirc_entry {
+	const struct sw_flow *from;
+	u32 recirc_id;
+	u32 ct_mark;
+	u16 ct_zone;
+	u8 ct_state;
+	unsigned long gen;
+	struct sw_flow *flow;
+};
+
+struct flow_emc {
+	struct emc_entry entries[EMC_ENTRIES];
+	struct recirc_entry recirc[RECIRC_CACHE_ENTRIES];
+};
+
+/* Counting, blocked Bloom filter over the masked-key hashes of the flows that
+ * use a mask.  Each hash selects one 64-byte block of 'bits', so rejecting a
+ * probe touches a single cache line.  'counters' (one per bit) and 'n_flows'
+ * are only used under ovs_mutex.
+ */
+struct mask_filter {
+	struct rcu_head rcu;
+	unsigned int n_blocks;
+	unsigned int n_flows;
+	u8 *counters;
+	unsigned long *bits;
+};
+
+struct mask_array_stats {
+	struct u64_stats_sync syncp;
+	u64 usage_cntrs[];
+};
+
 struct mask_array {
 	struct rcu_head rcu;
 	int count, max;
+	struct mask_array_stats __percpu *masks_usage_stats;
+	u64 *masks_usage_zero_cntr;	/* Usage at the last rebalance. */
 	struct sw_flow_mask __rcu *masks[];
 };
 
+/* A hash bucket fills one cache line.  Every flow in the bucket is on 'head';
+ * the first BUCKET_SLOTS of them are also indexed by 'hash'/'flows', so while
+ * 'n_flows' <= BUCKET_SLOTS a lookup only has to touch the flows whose
+ * signature matches.  Writers hold ovs_mutex.
+ */
+#define BUCKET_SLOTS		4
+
+struct flow_bucket {
+	struct hlist_head head;
+	unsigned int n_flows;
+	u32 hash[BUCKET_SLOTS];
+	struct sw_flow __rcu *flows[BUCKET_SLOTS];
+} ____cacheline_aligned;
+
+/* While 'next' is set the table is being resized or reseeded into it a few
+ * buckets at a time.  Buckets below 'migrated' have their flows linked into
+ * both instances; readers keep using this one, which stays complete, until
+ * 'next' replaces it.  'next' and 'migrated' are only used under ovs_mutex.
+ */
 struct table_instance {
-	struct flex_array *buckets;
+	struct flow_bucket *buckets;
 	unsigned int n_buckets;
 	struct rcu_head rcu;
 	int node_ver;
 	u32 hash_seed;
 	bool keep_flows;
+	struct table_instance *next;
+	unsigned int migrated;
 };
 
 struct flow_table {
 	struct table_instance __rcu *ti;
 	struct table_instance __rcu *ufid_ti;
 	struct mask_cache_entry __percpu *mask_cache;
+	struct flow_emc **emc;		/* One for each CPU. */
 	struct mask_array __rcu *mask_array;
 	unsigned long last_rehash;
 	unsigned int count;
 	unsigned int ufid_count;
+	bool in_batch;			/* Defer expansion, ovs_mutex. */
 };
 
-extern struct kmem_cache *flow_stats_cache;
+/* Maximum number of keys per ovs_flow_tbl_lookup_batch() call. */
+#define FLOW_TBL_BATCH_MAX	16
 
 int ovs_flow_init(void);
 void ovs_flow_exit(void);
@@ -82,13 +164,26 @@ int ovs_flow_tbl_flush(struct flow_table *flow_table);
 int ovs_flow_tbl_insert(struct flow_table *table, struct sw_flow *flow,
 			const struct sw_flow_mask *mask);
 void ovs_flow_tbl_remove(struct flow_table *table, struct sw_flow *flow);
+void ovs_flow_tbl_batch_begin(struct flow_table *table);
+void ovs_flow_tbl_batch_end(struct flow_table *table);
 int  ovs_flow_tbl_num_masks(const struct flow_table *table);
-struct sw_flow *ovs_flow_tbl_dump_next(struct table_instance *table,
+void ovs_flow_masks_rebalance(struct flow_table *table);
+void ovs_flow_tbl_migrate(struct flow_table *table);
+struct sw_flow *ovs_flow_tbl_dump_next(struct table_instance *table, u32 end,
 				       u32 *bucket, u32 *idx);
 struct sw_flow *ovs_flow_tbl_lookup_stats(struct flow_table *,
 					  const struct sw_flow_key *,
 					  u32 skb_hash,
 					  u32 *n_mask_hit);
+struct sw_flow *ovs_flow_tbl_lookup_recirc(struct flow_table *,
+					   const struct sw_flow *from,
+					   const struct sw_flow_key *,
+					   u32 skb_hash,
+					   u32 *n_mask_hit);
+void ovs_flow_tbl_lookup_batch(struct flow_table *,
+			       const struct sw_flow_key *keys,
+			       const u32 *skb_hashes, struct sw_flow **flows,
+			       int n, u32 *n_mask_hit);
 struct sw_flow *ovs_flow_tbl_lookup(struct flow_table *,
 				    const struct sw_flow_key *);
 struct sw_flow *ovs_flow_tbl_lookup_exact(struct flow_table *tbl,
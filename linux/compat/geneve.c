@@ -90,6 +90,7 @@ struct geneve_dev {
 	bool		   collect_md;
 	u32		   flags;
 	struct dst_cache   dst_cache;
+	struct ovs_tnl_rt_cache rt_cache;	/* shared by collect_md flows */
 };
 
 /* Geneve device flags */
@@ -104,6 +105,7 @@ struct geneve_sock {
 	struct rcu_head		rcu;
 	int			refcnt;
 	struct hlist_head	vni_list[VNI_HASH_SIZE];
+	struct geneve_dev __rcu	*collect_md_dev;	/* receives every VNI */
 	u32			flags;
 #ifdef HAVE_UDP_OFFLOAD
 	struct udp_offload	udp_offloads;
@@ -181,44 +183,20 @@ static struct geneve_dev *geneve_lookup_skb(struct geneve_sock *gs,
 					    struct sk_buff *skb)
 {
 	u8 *vni;
-	__be32 addr;
-	static u8 zero_vni[3];
-#if IS_ENABLED(CONFIG_IPV6)
-	static struct in6_addr zero_addr6;
-#endif
-
-	if (geneve_get_sk_family(gs) == AF_INET) {
-		struct iphdr *iph;
-
-		iph = ip_hdr(skb); /* outer IP header... */
 
-		if (gs->collect_md) {
-			vni = zero_vni;
-			addr = 0;
-		} else {
-			vni = geneve_hdr(skb)->vni;
-			addr = iph->saddr;
-		}
+	/* A collect_md socket has a single device that takes every VNI, so
+	 * there is nothing to look up however many tenants share it.
+	 */
+	if (gs->collect_md)
+		return rcu_dereference(gs->collect_md_dev);
 
-		return geneve_lookup(gs, addr, vni);
+	vni = geneve_hdr(skb)->vni;
+	if (geneve_get_sk_family(gs) == AF_INET)
+		return geneve_lookup(gs, ip_hdr(skb)->saddr, vni);
 #if IS_ENABLED(CONFIG_IPV6)
-	} else if (geneve_get_sk_family(gs) == AF_INET6) {
-		struct ipv6hdr *ip6h;
-		struct in6_addr addr6;
-
-		ip6h = ipv6_hdr(skb); /* outer IPv6 header... */
-
-		if (gs->collect_md) {
-			vni = zero_vni;
-			addr6 = zero_addr6;
-		} else {
-			vni = geneve_hdr(skb)->vni;
-			addr6 = ip6h->saddr;
-		}
-
-		return geneve6_lookup(gs, addr6, vni);
+	if (geneve_get_sk_family(gs) == AF_INET6)
+		return geneve6_lookup(gs, ipv6_hdr(skb)->saddr, vni);
 #endif
-	}
 	return NULL;
 }
 
@@ -316,6 +294,13 @@ static int geneve_init(struct net_device *dev)
 		return err;
 	}
 
+	err = ovs_tnl_rt_cache_init(&geneve->rt_cache, GFP_KERNEL);
+	if (err) {
+		dst_cache_destroy(&geneve->dst_cache);
+		free_percpu(dev->tstats);
+		return err;
+	}
+
 	return 0;
 }
 
@@ -323,6 +308,7 @@ static void geneve_uninit(struct net_device *dev)
 {
 	struct geneve_dev *geneve = netdev_priv(dev);
 
+	ovs_tnl_rt_cache_destroy(&geneve->rt_cache);
 	dst_cache_destroy(&geneve->dst_cache);
 	free_percpu(dev->tstats);
 }
@@ -627,15 +613,24 @@ static void __geneve_sock_release(struct geneve_sock *gs)
 	kfree_rcu(gs, rcu);
 }
 
+static void geneve_sock_unlink_md(struct geneve_sock *gs,
+				  struct geneve_dev *geneve)
+{
+	if (gs && rtnl_dereference(gs->collect_md_dev) == geneve)
+		RCU_INIT_POINTER(gs->collect_md_dev, NULL);
+}
+
 static void geneve_sock_release(struct geneve_dev *geneve)
 {
 	struct geneve_sock *gs4 = rtnl_dereference(geneve->sock4);
 #if IS_ENABLED(CONFIG_IPV6)
 	struct geneve_sock *gs6 = rtnl_dereference(geneve->sock6);
 
+	geneve_sock_unlink_md(gs6, geneve);
 	rcu_assign_pointer(geneve->sock6, NULL);
 #endif
 
+	geneve_sock_unlink_md(gs4, geneve);
 	rcu_assign_pointer(geneve->sock4, NULL);
 	synchronize_net();
 
@@ -689,6 +684,8 @@ out:
 
 	hash = geneve_net_vni_hash(geneve->vni);
 	hlist_add_head_rcu(&geneve->hlist, &gs->vni_list[hash]);
+	if (geneve->collect_md)
+		rcu_assign_pointer(gs->collect_md_dev, geneve);
 	return 0;
 }
 
@@ -841,7 +838,9 @@ static struct rtable *geneve_get_v4_rt(struct sk_buff *skb,
 	bool use_cache = ip_tunnel_dst_cache_usable(skb, info);
 	struct geneve_dev *geneve = netdev_priv(dev);
 	struct dst_cache *dst_cache;
+	bool use_rt_cache = false;
 	struct rtable *rt = NULL;
+	__be32 req_saddr;
 	__u8 tos;
 
 	if (!rcu_dereference(geneve->sock4))
@@ -856,6 +855,7 @@ static struct rtable *geneve_get_v4_rt(struct sk_buff *skb,
 		fl4->saddr = info->key.u.ipv4.src;
 		fl4->flowi4_tos = RT_TOS(info->key.tos);
 		dst_cache = &info->dst_cache;
+		use_rt_cache = !(info->key.tun_flags & TUNNEL_NOCACHE);
 	} else {
 		tos = geneve->tos;
 		if (tos == 1) {
@@ -876,6 +876,16 @@ static struct rtable *geneve_get_v4_rt(struct sk_buff *skb,
 			return rt;
 	}
 
+	/* A new flow, or one with a mark, can still reuse the route that
+	 * another flow to the same remote already looked up.
+	 */
+	if (use_rt_cache) {
+		rt = ovs_tnl_rt_cache_get(&geneve->rt_cache, fl4);
+		if (rt)
+			goto out;
+	}
+
+	req_saddr = fl4->saddr;
 	rt = ip_route_output_key(geneve->net, fl4);
 	if (IS_ERR(rt)) {
 		netdev_dbg(dev, "no route to %pI4\n", &fl4->daddr);
@@ -886,6 +896,9 @@ static struct rtable *geneve_get_v4_rt(struct sk_buff *skb,
 		ip_rt_put(rt);
 		return ERR_PTR(-ELOOP);
 	}
+	if (use_rt_cache)
+		ovs_tnl_rt_cache_set(&geneve->rt_cache, fl4, req_saddr, rt);
+out:
 	if (use_cache)
 		dst_cache_set_ip4(dst_cache, &rt->dst, fl4->saddr);
 	return rt;
@@ -1475,6 +1488,7 @@ static int geneve_configure(struct net *net, struct net_device *dev,
 	}
 
 	dst_cache_reset(&geneve->dst_cache);
+	ovs_tnl_rt_cache_reset(&geneve->rt_cache);
 
 	err = register_netdevice(dev);
 	if (err)
@@ -70,4 +70,12 @@
 #define U32_MAX		((u32)~0U)
 #endif
 
+#ifndef U8_MAX
+#define U8_MAX		((u8)~0U)
+#endif
+
+#ifndef U16_MAX
+#define U16_MAX		((u16)~0U)
+#endif
+
 #endif /* linux/kernel.h */
@@ -42,6 +42,7 @@
 
 #include <linux/types.h>
 #include <linux/if_ether.h>
+#include <linux/ioctl.h>
 
 /**
  * struct ovs_header - header for OVS Generic Netlink messages.
@@ -93,6 +94,18 @@ enum ovs_datapath_cmd {
  * datapath.  Always present in notifications.
  * @OVS_DP_ATTR_MEGAFLOW_STATS: Statistics about mega flow masks usage for the
  * datapath. Always present in notifications.
+ * @OVS_DP_ATTR_STAGE_STATS: Nested %OVS_DP_STAGE_ATTR_* cycle histograms for
+ * each stage of packet processing.  Present in notifications only while
+ * %OVS_DP_F_STAGE_STATS is set in the user features.
+ * @OVS_DP_ATTR_MISS_STATS: &struct ovs_dp_miss_stats counting misses that were
+ * not sent to userspace because of miss-storm protection.  Always present in
+ * notifications.
+ * @OVS_DP_ATTR_DEFERRED_LIMIT: 32-bit number of actions (recirculations,
+ * samples and clones nested too deep to run at once) that may be deferred
+ * while executing the actions of one packet, at most
+ * %OVS_DP_DEFERRED_LIMIT_MAX.  Always present in notifications.
+ * @OVS_DP_ATTR_DEFERRED_STATS: &struct ovs_dp_deferred_stats.  Always present
+ * in notifications.
  *
  * These attributes follow the &struct ovs_header within the Generic Netlink
  * payload for %OVS_DP_* commands.
@@ -105,6 +118,10 @@ enum ovs_datapath_attr {
 	OVS_DP_ATTR_MEGAFLOW_STATS,	/* struct ovs_dp_megaflow_stats */
 	OVS_DP_ATTR_USER_FEATURES,	/* OVS_DP_F_*  */
 	OVS_DP_ATTR_PAD,
+	OVS_DP_ATTR_STAGE_STATS,	/* Nested OVS_DP_STAGE_ATTR_* */
+	OVS_DP_ATTR_MISS_STATS,		/* struct ovs_dp_miss_stats */
+	OVS_DP_ATTR_DEFERRED_LIMIT,	/* u32 deferred actions per packet */
+	OVS_DP_ATTR_DEFERRED_STATS,	/* struct ovs_dp_deferred_stats */
 	__OVS_DP_ATTR_MAX
 };
 
@@ -118,6 +135,21 @@ struct ovs_dp_stats {
 	__u64 n_flows;           /* Number of flows present */
 };
 
+struct ovs_dp_miss_stats {
+	__u64 n_dedup;		 /* Repeats of a pending miss, dropped. */
+	__u64 n_ratelimited;	 /* Misses over the port's upcall rate, dropped. */
+};
+
+#define OVS_DP_DEFERRED_LIMIT_MAX 1024
+
+struct ovs_dp_deferred_stats {
+	__u64 n_deferred;	 /* Actions deferred. */
+	__u64 n_dropped;	 /* Actions dropped over the deferred limit. */
+	__u64 n_recursion_dropped; /* Packets dropped over the recursion
+				    * limit. */
+	__u64 max_depth;	 /* Most actions deferred for one packet. */
+};
+
 struct ovs_dp_megaflow_stats {
 	__u64 n_mask_hit;	 /* Number of masks used for flow lookups. */
 	__u32 n_masks;		 /* Number of masks for the datapath. */
@@ -126,6 +158,33 @@ struct ovs_dp_megaflow_stats {
 	__u64 pad2;		 /* Pad for future expension. */
 };
 
+/**
+ * enum ovs_dp_stage_attr - attributes nested in %OVS_DP_ATTR_STAGE_STATS.
+ *
+ * Each stage attribute carries a &struct ovs_dp_stage_stats.
+ */
+enum ovs_dp_stage_attr {
+	OVS_DP_STAGE_ATTR_UNSPEC,
+	OVS_DP_STAGE_ATTR_SKETCH,	/* Sketch update on receive. */
+	OVS_DP_STAGE_ATTR_LOOKUP,	/* Flow table lookup. */
+	OVS_DP_STAGE_ATTR_EXECUTE,	/* Action execution. */
+	OVS_DP_STAGE_ATTR_UPCALL,	/* Miss upcall to userspace. */
+	OVS_DP_STAGE_ATTR_PAD,
+	__OVS_DP_STAGE_ATTR_MAX
+};
+
+#define OVS_DP_STAGE_ATTR_MAX (__OVS_DP_STAGE_ATTR_MAX - 1)
+
+#define OVS_DP_STAGE_HIST_BUCKETS 32
+
+struct ovs_dp_stage_stats {
+	__u64 n_samples;	 /* Number of times the stage ran. */
+	__u64 n_cycles;		 /* Total cycles spent in the stage. */
+	__u64 hist[OVS_DP_STAGE_HIST_BUCKETS]; /* hist[i] counts samples that
+						* took [2^i, 2^(i+1)) cycles;
+						* the last bucket is open. */
+};
+
 struct ovs_vport_stats {
 	__u64   rx_packets;		/* total packets received       */
 	__u64   tx_packets;		/* total packets transmitted    */
@@ -143,6 +202,14 @@ struct ovs_vport_stats {
 /* Allow datapath to associate multiple Netlink PIDs to each vport */
 #define OVS_DP_F_VPORT_PIDS	(1 << 1)
 
+/* Collect per-stage cycle histograms, see OVS_DP_ATTR_STAGE_STATS */
+#define OVS_DP_F_STAGE_STATS	(1 << 2)
+
+/* Upcall only some misses of a flow until userspace installs it or until it
+ * turns out userspace does not, see OVS_DP_ATTR_MISS_STATS.
+ */
+#define OVS_DP_F_MISS_DEDUP	(1 << 3)
+
 /* Fixed logical ports. */
 #define OVSP_LOCAL      ((__u32)0)
 
@@ -258,6 +325,10 @@ enum ovs_vport_type {
  * upcalls should not be sent.
  * @OVS_VPORT_ATTR_STATS: A &struct ovs_vport_stats giving statistics for
  * packets sent or received through the vport.
+ * @OVS_VPORT_ATTR_UPCALL_RATE: 32-bit maximum rate, in upcalls per second, of
+ * %OVS_PACKET_CMD_MISS upcalls for packets received on this port, with bursts
+ * of up to a tenth of that.  Misses over the rate are dropped.  0, the
+ * default, means unlimited.
  *
  * These attributes follow the &struct ovs_header within the Generic Netlink
  * payload for %OVS_VPORT_* commands.
@@ -283,6 +354,7 @@ enum ovs_vport_attr {
 				/* receiving upcalls */
 	OVS_VPORT_ATTR_STATS,	/* struct ovs_vport_stats */
 	OVS_VPORT_ATTR_PAD,
+	OVS_VPORT_ATTR_UPCALL_RATE, /* u32 miss upcalls per second, 0 if no limit */
 	__OVS_VPORT_ATTR_MAX
 };
 
@@ -320,7 +392,8 @@ enum ovs_flow_cmd {
 	OVS_FLOW_CMD_NEW,
 	OVS_FLOW_CMD_DEL,
 	OVS_FLOW_CMD_GET,
-	OVS_FLOW_CMD_SET
+	OVS_FLOW_CMD_SET,
+	OVS_FLOW_CMD_BATCH
 };
 
 struct ovs_flow_stats {
@@ -570,6 +643,31 @@ struct ovs_key_ct_tuple_ipv6 {
  * @OVS_FLOW_ATTR_UFID_FLAGS: A 32-bit value of OR'd %OVS_UFID_F_*
  * flags that provide alternative semantics for flow installation and
  * retrieval. Optional for all requests.
+ * @OVS_FLOW_ATTR_DUMP_SHARD: &struct ovs_flow_dump_shard restricting an
+ * %OVS_FLOW_CMD_GET dump to one shard of the flow table, so that several
+ * threads can each dump a disjoint part of the table in parallel.  Ignored in
+ * other requests.  Each dump computes its bucket range from the table size
+ * when it starts, so the shards only partition the table if it is not
+ * resized or rehashed while they run.  Across a rehash a flow may be missed
+ * or reported by more than one shard, as with any dump that spans a rehash.
+ * @OVS_FLOW_ATTR_DUMP_GEN: A 64-bit flow statistics generation.  An
+ * %OVS_FLOW_CMD_GET dump request with this attribute only dumps the flows
+ * whose statistics changed since the given generation, or all flows if it is
+ * 0.  The first message of such a dump carries only this attribute, giving the
+ * generation to pass to the next dump.  A flow may be reported one dump more
+ * than strictly necessary.
+ * @OVS_FLOW_ATTR_DUMP_PACKED: Flag asking an %OVS_FLOW_CMD_GET dump to report
+ * only statistics, as %OVS_FLOW_ATTR_STATS_DELTAS arrays packing as many
+ * flows as fit into each message.  Flows without a UFID are skipped.  Usually
+ * combined with %OVS_FLOW_ATTR_DUMP_GEN.
+ * @OVS_FLOW_ATTR_STATS_DELTAS: Array of &struct ovs_flow_stats_delta, one for
+ * each flow, in the messages of an %OVS_FLOW_ATTR_DUMP_PACKED dump.
+ * @OVS_FLOW_ATTR_BATCH: Nested %OVS_FLOW_BATCH_ATTR_* operations of an
+ * %OVS_FLOW_CMD_BATCH request, applied in order.  Required for
+ * %OVS_FLOW_CMD_BATCH requests, ignored otherwise.
+ * @OVS_FLOW_ATTR_BATCH_STATUS: Array of __s32, the result of each operation of
+ * an %OVS_FLOW_CMD_BATCH request in order: 0 on success, otherwise a negative
+ * errno value.  Present in %OVS_FLOW_CMD_BATCH replies.
  *
  * These attributes follow the &struct ovs_header within the Generic Netlink
  * payload for %OVS_FLOW_* commands.
@@ -588,11 +686,56 @@ enum ovs_flow_attr {
 	OVS_FLOW_ATTR_UFID,      /* Variable length unique flow identifier. */
 	OVS_FLOW_ATTR_UFID_FLAGS,/* u32 of OVS_UFID_F_*. */
 	OVS_FLOW_ATTR_PAD,
+	OVS_FLOW_ATTR_DUMP_SHARD,/* struct ovs_flow_dump_shard. */
+	OVS_FLOW_ATTR_DUMP_GEN,  /* u64 stats generation to dump changes since. */
+	OVS_FLOW_ATTR_DUMP_PACKED, /* Flag to dump packed stats only. */
+	OVS_FLOW_ATTR_STATS_DELTAS, /* Array of struct ovs_flow_stats_delta. */
+	OVS_FLOW_ATTR_BATCH,     /* Nested OVS_FLOW_BATCH_ATTR_* operations. */
+	OVS_FLOW_ATTR_BATCH_STATUS, /* Array of __s32 operation results. */
 	__OVS_FLOW_ATTR_MAX
 };
 
 #define OVS_FLOW_ATTR_MAX (__OVS_FLOW_ATTR_MAX - 1)
 
+/**
+ * enum ovs_flow_batch_attr - operations nested in %OVS_FLOW_ATTR_BATCH.
+ * @OVS_FLOW_BATCH_ATTR_PUT: Nested %OVS_FLOW_ATTR_* attributes of a flow to
+ * install or modify, as in an %OVS_FLOW_CMD_NEW request.  The NLM_F_CREATE and
+ * NLM_F_EXCL flags of the batch request apply to every put.
+ * @OVS_FLOW_BATCH_ATTR_DEL: Nested %OVS_FLOW_ATTR_* attributes identifying a
+ * flow to delete, as in an %OVS_FLOW_CMD_DEL request.  Either
+ * %OVS_FLOW_ATTR_UFID or %OVS_FLOW_ATTR_KEY is required.
+ *
+ * All operations are validated before any is applied, then applied under a
+ * single lock hold.  Operations are not reported to the flow multicast group.
+ */
+enum ovs_flow_batch_attr {
+	OVS_FLOW_BATCH_ATTR_UNSPEC,
+	OVS_FLOW_BATCH_ATTR_PUT,	/* Nested OVS_FLOW_ATTR_*. */
+	OVS_FLOW_BATCH_ATTR_DEL,	/* Nested OVS_FLOW_ATTR_*. */
+	__OVS_FLOW_BATCH_ATTR_MAX
+};
+
+#define OVS_FLOW_BATCH_ATTR_MAX (__OVS_FLOW_BATCH_ATTR_MAX - 1)
+
+/* Maximum number of operations in an OVS_FLOW_CMD_BATCH request. */
+#define OVS_FLOW_BATCH_MAX	1024
+
+struct ovs_flow_dump_shard {
+	__u32 index;		/* Shard to dump, less than 'n_shards'. */
+	__u32 n_shards;		/* Number of shards to split the table in. */
+};
+
+struct ovs_flow_stats_delta {
+	__u32 ufid[4];		/* UFID, zero-padded to 16 bytes. */
+	__u64 n_packets;	/* Number of matched packets. */
+	__u64 n_bytes;		/* Number of matched bytes. */
+	__u64 used;		/* As OVS_FLOW_ATTR_USED, 0 if never used. */
+	__u8 ufid_len;		/* Length of 'ufid' in bytes. */
+	__u8 tcp_flags;		/* As OVS_FLOW_ATTR_TCP_FLAGS. */
+	__u8 pad[6];
+};
+
 /**
  * Omit attributes for notifications.
  *
@@ -945,4 +1088,118 @@ enum ovs_action_attr {
 
 #define OVS_ACTION_ATTR_MAX (__OVS_ACTION_ATTR_MAX - 1)
 
+#define OVS_CT_LIMIT_FAMILY  "ovs_ct_limit"
+#define OVS_CT_LIMIT_MCGROUP "ovs_ct_limit"
+#define OVS_CT_LIMIT_VERSION 0x1
+
+enum ovs_ct_limit_cmd {
+	OVS_CT_LIMIT_CMD_UNSPEC,
+	OVS_CT_LIMIT_CMD_SET,		/* Add or modify ct limit. */
+	OVS_CT_LIMIT_CMD_DEL,		/* Delete ct limit. */
+	OVS_CT_LIMIT_CMD_GET		/* Get ct limit. */
+};
+
+/**
+ * enum ovs_ct_limit_attr - attributes of %OVS_CT_LIMIT_FAMILY messages.
+ * @OVS_CT_LIMIT_ATTR_ZONE_LIMIT: Array of &struct ovs_zone_limit in requests.
+ * Replies to %OVS_CT_LIMIT_CMD_GET nest one such attribute per zone in it.
+ *
+ * A limit applies to the connections a zone may commit through the ct
+ * action; commits beyond it drop the packet.  A limit of 0 is unlimited.
+ * Zones without a limit of their own use the one set for
+ * %OVS_ZONE_LIMIT_DEFAULT_ZONE, which is 0 until set.  'count' in replies is
+ * the number of committed connections in the zone, counted for limited zones
+ * only and recounted from the conntrack table every few seconds.
+ */
+enum ovs_ct_limit_attr {
+	OVS_CT_LIMIT_ATTR_UNSPEC,
+	OVS_CT_LIMIT_ATTR_ZONE_LIMIT,	/* Nested struct ovs_zone_limit. */
+	__OVS_CT_LIMIT_ATTR_MAX
+};
+
+#define OVS_CT_LIMIT_ATTR_MAX (__OVS_CT_LIMIT_ATTR_MAX - 1)
+
+#define OVS_ZONE_LIMIT_DEFAULT_ZONE -1
+
+struct ovs_zone_limit {
+	int zone_id;
+	__u32 limit;
+	__u32 count;
+};
+
+/* Shared-memory upcall rings.
+ *
+ * A handler opens OVS_UPCALL_RING_DEVICE and binds it with
+ * OVS_UPCALL_RING_IOC_BIND to the Netlink port ID it receives upcalls on,
+ * then mmap()s the ring.  From then on, %OVS_PACKET_CMD_MISS upcalls for that
+ * port ID are written to the ring when they fit, and still sent over Netlink
+ * otherwise: upcalls with userdata, actions, an egress tunnel key, an MRU or a
+ * truncated packet, GSO packets, packets that still need their checksum
+ * completed, IPv6 tunnels, tunnel options, non-Ethernet packets, connections
+ * with an original direction tuple, packets larger than a slot, and upcalls
+ * that find the ring full.
+ *
+ * The mapping starts with a &struct ovs_upcall_ring_hdr.  Slot i starts at
+ * offset OVS_UPCALL_RING_SLOTS_OFFSET + i * slot_size and holds a &struct
+ * ovs_upcall_slot followed by the packet, from the start of the Ethernet
+ * header onward.  The kernel fills the slot at index 'producer' modulo
+ * 'n_slots' and then advances 'producer'; userspace consumes the slot at index
+ * 'consumer' modulo 'n_slots' and then advances 'consumer'.  Both indexes
+ * increase freely and wrap at 2^32.  poll() reports POLLIN while the ring is
+ * not empty.
+ */
+#define OVS_UPCALL_RING_DEVICE "/dev/openvswitch-upcall"
+#define OVS_UPCALL_RING_SLOTS_OFFSET 4096
+
+struct ovs_upcall_ring_bind {
+	__u32 portid;		/* Netlink port ID whose misses to divert. */
+	__u32 n_slots;		/* Power of 2. */
+	__u32 slot_size;	/* Multiple of 64 bytes. */
+};
+
+#define OVS_UPCALL_RING_IOC_BIND _IOW('o', 1, struct ovs_upcall_ring_bind)
+
+struct ovs_upcall_ring_hdr {
+	__u32 n_slots;
+	__u32 slot_size;
+	__u32 producer __attribute__((aligned(64))); /* Written by the kernel. */
+	__u32 consumer __attribute__((aligned(64))); /* Written by userspace. */
+};
+
+#define OVS_UPCALL_TUN_F_KEY		(1 << 0)
+#define OVS_UPCALL_TUN_F_DONT_FRAGMENT	(1 << 1)
+#define OVS_UPCALL_TUN_F_CSUM		(1 << 2)
+#define OVS_UPCALL_TUN_F_OAM		(1 << 3)
+
+/* Metadata part of the flow key of a miss, with the meaning of the
+ * corresponding OVS_KEY_ATTR_*.  Userspace parses the packet headers itself.
+ */
+struct ovs_upcall_key {
+	__u32 in_port;
+	__u32 priority;
+	__u32 skb_mark;
+	__u32 recirc_id;
+	__u32 dp_hash;
+	__u32 ct_state;
+	__u32 ct_mark;
+	__u16 ct_zone;
+	__u8 tun_present;	/* Nonzero if received on an IPv4 tunnel. */
+	__u8 tun_flags;		/* OVS_UPCALL_TUN_F_*. */
+	__be64 tun_id;
+	__be32 tun_ipv4_src;
+	__be32 tun_ipv4_dst;
+	__be16 tun_tp_src;
+	__be16 tun_tp_dst;
+	__u8 tun_tos;
+	__u8 tun_ttl;
+	__u8 pad[2];
+	struct ovs_key_ct_labels ct_labels;
+};
+
+struct ovs_upcall_slot {
+	__u32 dp_ifindex;	/* As in struct ovs_header. */
+	__u32 packet_len;	/* Bytes of packet following the slot header. */
+	struct ovs_upcall_key key;
+};
+
 #endif /* _LINUX_OPENVSWITCH_H */
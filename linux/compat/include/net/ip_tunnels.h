@@ -326,6 +326,29 @@ struct net *rpl_ip_tunnel_get_link_net(const struct net_device *dev);
 #define __ip_tunnel_change_mtu rpl___ip_tunnel_change_mtu
 int rpl___ip_tunnel_change_mtu(struct net_device *dev, int new_mtu, bool strict);
 
+/* Per-CPU IPv4 route cache of a metadata-mode tunnel device.  Unlike the
+ * dst_cache in each flow's tunnel info, which starts cold on every CPU for
+ * every new flow, it is shared by all the flows going out of the device, and
+ * it is keyed by everything the route lookup depends on, so it also serves
+ * packets with a mark.
+ */
+struct ovs_tnl_rt_cache {
+	struct ovs_tnl_rt_cache_pcpu __percpu *cache;
+	unsigned long reset_ts;
+};
+
+int ovs_tnl_rt_cache_init(struct ovs_tnl_rt_cache *, gfp_t);
+void ovs_tnl_rt_cache_destroy(struct ovs_tnl_rt_cache *);
+struct rtable *ovs_tnl_rt_cache_get(struct ovs_tnl_rt_cache *,
+				    struct flowi4 *);
+void ovs_tnl_rt_cache_set(struct ovs_tnl_rt_cache *, const struct flowi4 *,
+			  __be32 req_saddr, struct rtable *);
+
+static inline void ovs_tnl_rt_cache_reset(struct ovs_tnl_rt_cache *c)
+{
+	c->reset_ts = jiffies;
+}
+
 static inline int iptunnel_pull_offloads(struct sk_buff *skb)
 {
 	if (skb_is_gso(skb)) {
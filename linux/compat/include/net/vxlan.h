@@ -219,6 +219,7 @@ struct vxlan_sock {
 	struct hlist_node hlist;
 	struct socket	 *sock;
 	struct hlist_head vni_list[VNI_HASH_SIZE];
+	struct vxlan_dev __rcu *collect_md_dev;	/* receives every VNI */
 	atomic_t	  refcnt;
 	u32		  flags;
 #ifdef HAVE_UDP_OFFLOAD
@@ -278,6 +279,7 @@ struct vxlan_dev {
 	unsigned int	  addrcnt;
 
 	struct vxlan_config	cfg;
+	struct ovs_tnl_rt_cache	rt_cache;	/* shared by collect_md flows */
 
 	struct hlist_head fdb_head[FDB_HASH_SIZE];
 };
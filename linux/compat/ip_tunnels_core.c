@@ -163,6 +163,121 @@ int rpl___iptunnel_pull_header(struct sk_buff *skb, int hdr_len,
 EXPORT_SYMBOL_GPL(rpl___iptunnel_pull_header);
 #endif /* USE_UPSTREAM_TUNNEL */
 
+#ifndef USE_UPSTREAM_TUNNEL
+#define OVS_TNL_RT_CACHE_SHIFT	6
+#define OVS_TNL_RT_CACHE_SIZE	(1 << OVS_TNL_RT_CACHE_SHIFT)
+
+struct ovs_tnl_rt_cache_entry {
+	struct dst_entry *dst;
+	unsigned long refresh_ts;
+	__be32 daddr;
+	__be32 req_saddr;	/* Source requested by the lookup, or 0. */
+	__be32 saddr;		/* Source the route chose. */
+	u32 mark;
+	int oif;
+	u8 tos;
+};
+
+struct ovs_tnl_rt_cache_pcpu {
+	struct ovs_tnl_rt_cache_entry entries[OVS_TNL_RT_CACHE_SIZE];
+};
+
+static struct ovs_tnl_rt_cache_entry *
+ovs_tnl_rt_cache_slot(struct ovs_tnl_rt_cache *c, __be32 daddr,
+		      __be32 saddr, u32 mark, int oif, u8 tos)
+{
+	u32 hash;
+
+	hash = jhash_3words((__force u32)daddr, (__force u32)saddr, mark,
+			    (u32)oif << 8 | tos);
+	return &this_cpu_ptr(c->cache)->entries[hash &
+						(OVS_TNL_RT_CACHE_SIZE - 1)];
+}
+
+/* On a hit, returns the route with a reference and sets the source address
+ * of 'fl4' to the one the route chose.  Local BH must be disabled.
+ */
+struct rtable *ovs_tnl_rt_cache_get(struct ovs_tnl_rt_cache *c,
+				    struct flowi4 *fl4)
+{
+	struct ovs_tnl_rt_cache_entry *e;
+	struct dst_entry *dst;
+
+	e = ovs_tnl_rt_cache_slot(c, fl4->daddr, fl4->saddr, fl4->flowi4_mark,
+				  fl4->flowi4_oif, fl4->flowi4_tos);
+	dst = e->dst;
+	if (!dst || e->daddr != fl4->daddr || e->req_saddr != fl4->saddr ||
+	    e->mark != fl4->flowi4_mark || e->oif != fl4->flowi4_oif ||
+	    e->tos != fl4->flowi4_tos)
+		return NULL;
+
+	if (unlikely(!time_after(e->refresh_ts, c->reset_ts) ||
+		     (dst->obsolete && !dst->ops->check(dst, 0)))) {
+		e->dst = NULL;
+		dst_release(dst);
+		return NULL;
+	}
+
+	dst_hold(dst);
+	fl4->saddr = e->saddr;
+	return (struct rtable *)dst;
+}
+EXPORT_SYMBOL_GPL(ovs_tnl_rt_cache_get);
+
+/* Stores 'rt', which the lookup described by 'fl4' returned when it asked for
+ * source address 'req_saddr'.  Local BH must be disabled.
+ */
+void ovs_tnl_rt_cache_set(struct ovs_tnl_rt_cache *c,
+			  const struct flowi4 *fl4, __be32 req_saddr,
+			  struct rtable *rt)
+{
+	struct ovs_tnl_rt_cache_entry *e;
+
+	e = ovs_tnl_rt_cache_slot(c, fl4->daddr, req_saddr, fl4->flowi4_mark,
+				  fl4->flowi4_oif, fl4->flowi4_tos);
+	dst_release(e->dst);
+	dst_hold(&rt->dst);
+	e->dst = &rt->dst;
+	e->refresh_ts = jiffies;
+	e->daddr = fl4->daddr;
+	e->req_saddr = req_saddr;
+	e->saddr = fl4->saddr;
+	e->mark = fl4->flowi4_mark;
+	e->oif = fl4->flowi4_oif;
+	e->tos = fl4->flowi4_tos;
+}
+EXPORT_SYMBOL_GPL(ovs_tnl_rt_cache_set);
+
+int ovs_tnl_rt_cache_init(struct ovs_tnl_rt_cache *c, gfp_t gfp)
+{
+	c->cache = alloc_percpu_gfp(struct ovs_tnl_rt_cache_pcpu,
+				    gfp | __GFP_ZERO);
+	if (!c->cache)
+		return -ENOMEM;
+
+	ovs_tnl_rt_cache_reset(c);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ovs_tnl_rt_cache_init);
+
+void ovs_tnl_rt_cache_destroy(struct ovs_tnl_rt_cache *c)
+{
+	int cpu, i;
+
+	if (!c->cache)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct ovs_tnl_rt_cache_pcpu *pcpu = per_cpu_ptr(c->cache, cpu);
+
+		for (i = 0; i < OVS_TNL_RT_CACHE_SIZE; i++)
+			dst_release(pcpu->entries[i].dst);
+	}
+	free_percpu(c->cache);
+}
+EXPORT_SYMBOL_GPL(ovs_tnl_rt_cache_destroy);
+#endif /* USE_UPSTREAM_TUNNEL */
+
 bool ovs_skb_is_encapsulated(struct sk_buff *skb)
 {
 	/* checking for inner protocol should be sufficient on newer kernel, but
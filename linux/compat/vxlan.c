@@ -192,9 +192,9 @@ static struct vxlan_dev *vxlan_vs_find_vni(struct vxlan_sock *vs, __be32 vni)
 {
 	struct vxlan_dev *vxlan;
 
-	/* For flow based devices, map all packets to VNI 0 */
+	/* A flow based socket has a single device that takes every VNI */
 	if (vs->flags & VXLAN_F_COLLECT_METADATA)
-		vni = 0;
+		return rcu_dereference(vs->collect_md_dev);
 
 	hlist_for_each_entry_rcu(vxlan, vni_head(vs, vni), hlist) {
 		if (vxlan->default_dst.remote_vni == vni)
@@ -491,15 +491,24 @@ static bool __vxlan_sock_release_prep(struct vxlan_sock *vs)
 	return true;
 }
 
+static void vxlan_sock_unlink_md(struct vxlan_sock *vs,
+				 struct vxlan_dev *vxlan)
+{
+	if (vs && rtnl_dereference(vs->collect_md_dev) == vxlan)
+		RCU_INIT_POINTER(vs->collect_md_dev, NULL);
+}
+
 static void vxlan_sock_release(struct vxlan_dev *vxlan)
 {
 	struct vxlan_sock *sock4 = rtnl_dereference(vxlan->vn4_sock);
 #if IS_ENABLED(CONFIG_IPV6)
 	struct vxlan_sock *sock6 = rtnl_dereference(vxlan->vn6_sock);
 
+	vxlan_sock_unlink_md(sock6, vxlan);
 	rcu_assign_pointer(vxlan->vn6_sock, NULL);
 #endif
 
+	vxlan_sock_unlink_md(sock4, vxlan);
 	rcu_assign_pointer(vxlan->vn4_sock, NULL);
 	synchronize_net();
 
@@ -917,6 +926,7 @@ static struct rtable *vxlan_get_route(struct vxlan_dev *vxlan,
 				      const struct ip_tunnel_info *info)
 {
 	bool use_cache = (dst_cache && ip_tunnel_dst_cache_usable(skb, info));
+	bool use_rt_cache;
 	struct rtable *rt = NULL;
 	struct flowi4 fl4;
 
@@ -936,12 +946,25 @@ static struct rtable *vxlan_get_route(struct vxlan_dev *vxlan,
 	fl4.daddr = daddr;
 	fl4.saddr = *saddr;
 
-	rt = ip_route_output_key(vxlan->net, &fl4);
-	if (!IS_ERR(rt)) {
-		*saddr = fl4.saddr;
-		if (use_cache)
-			dst_cache_set_ip4(dst_cache, &rt->dst, fl4.saddr);
+	/* In metadata mode, reuse the route another flow to the same remote
+	 * already looked up, even when the packet carries a mark.
+	 */
+	use_rt_cache = info && !(info->key.tun_flags & TUNNEL_NOCACHE);
+	if (use_rt_cache) {
+		rt = ovs_tnl_rt_cache_get(&vxlan->rt_cache, &fl4);
+		if (rt)
+			goto out;
 	}
+
+	rt = ip_route_output_key(vxlan->net, &fl4);
+	if (IS_ERR(rt))
+		return rt;
+	if (use_rt_cache)
+		ovs_tnl_rt_cache_set(&vxlan->rt_cache, &fl4, *saddr, rt);
+out:
+	*saddr = fl4.saddr;
+	if (use_cache)
+		dst_cache_set_ip4(dst_cache, &rt->dst, fl4.saddr);
 	return rt;
 }
 
@@ -1306,16 +1329,27 @@ static void vxlan_vs_add_dev(struct vxlan_sock *vs, struct vxlan_dev *vxlan)
 
 	spin_lock(&vn->sock_lock);
 	hlist_add_head_rcu(&vxlan->hlist, vni_head(vs, vni));
+	if ((vs->flags & VXLAN_F_COLLECT_METADATA) && !vni)
+		rcu_assign_pointer(vs->collect_md_dev, vxlan);
 	spin_unlock(&vn->sock_lock);
 }
 
 /* Setup stats when device is created */
 static int vxlan_init(struct net_device *dev)
 {
+	struct vxlan_dev *vxlan = netdev_priv(dev);
+	int err;
+
 	dev->tstats = netdev_alloc_pcpu_stats(struct pcpu_sw_netstats);
 	if (!dev->tstats)
 		return -ENOMEM;
 
+	err = ovs_tnl_rt_cache_init(&vxlan->rt_cache, GFP_KERNEL);
+	if (err) {
+		free_percpu(dev->tstats);
+		return err;
+	}
+
 	return 0;
 }
 
@@ -1329,6 +1363,7 @@ static void vxlan_uninit(struct net_device *dev)
 
 	vxlan_fdb_delete_default(vxlan);
 
+	ovs_tnl_rt_cache_destroy(&vxlan->rt_cache);
 	free_percpu(dev->tstats);
 }
 
@@ -6,6 +6,7 @@
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/module.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/skbuff.h>
 #include <linux/socket.h>
@@ -25,7 +26,7 @@ enum switch_type {
 static enum switch_type switch_types[] = {filter, filter, ingress, ingress, egress, egress};
 #define SW_COUNT (sizeof(switch_types) / sizeof(enum switch_type))
 static struct countmax_sketch* countmax[SW_COUNT];
-static struct countmin_sketch* countmin[SW_COUNT];
+static struct countmin_sketch __rcu* countmin[SW_COUNT];
 
 static int threshold;
 
@@ -33,6 +34,9 @@ static int threshold;
 static const unsigned short listen_port = 0x8888;
 static const char* magic_command = "lol233hhh";
 static const char* magic_finish = "finish";
+static const char* magic_resize = "resize";
+static const char* magic_count = "count";
+static const char* magic_error = "error";
 /*****sketch update*****/
 
 int init_filter_sketch(int w, int d, int filter_threshold) {
@@ -42,8 +46,8 @@ int init_filter_sketch(int w, int d, int filter_threshold) {
     for (i = 0; i < SW_COUNT; ++i) {
         switch (switch_types[i]) {
             case filter:
-                countmin[i] = new_countmin_sketch(w, d);
-                if (!countmin[i]) return -1;
+                RCU_INIT_POINTER(countmin[i], new_countmin_sketch(w, d));
+                if (!rcu_access_pointer(countmin[i])) return -1;
                 printk("s%d: countmin\n", i);
                 break;
             case egress:
@@ -61,7 +65,8 @@ void clean_filter_sketch(void) {
     for (i = 0; i < SW_COUNT; ++i) {
         switch (switch_types[i]) {
             case filter:
-                if (countmin[i]) delete_countmin_sketch(countmin[i]);
+                if (rcu_access_pointer(countmin[i]))
+                    delete_countmin_sketch(rcu_dereference_raw(countmin[i]));
                 break;
             case egress:
                 if (countmax[i]) delete_countmax_sketch(countmax[i]);
@@ -70,6 +75,32 @@ void clean_filter_sketch(void) {
     }
 }
 
+/* Changes the width of a filter sketch without reloading the module.  'w'
+ * must divide the current width (fold) or be a multiple of it (expand); in
+ * both cases every counter of the new sketch starts from the old counters its
+ * keys used to hash to, so no history is lost.  Only called from the report
+ * thread. */
+int resize_filter_sketch(int sw_id, int w) {
+    struct countmin_sketch* old;
+    struct countmin_sketch* next;
+
+    if (sw_id < 0 || sw_id >= SW_COUNT || switch_types[sw_id] != filter || w <= 0) return -EINVAL;
+    old = rcu_dereference_protected(countmin[sw_id], 1);
+    if (old->w == w) return 0;
+    if (old->w % w != 0 && w % old->w != 0) return -EINVAL;
+
+    next = countmin_sketch_resize(old, w);
+    if (!next) return -ENOMEM;
+
+    /* Carry the old counts over only once no writer can touch 'old' any
+     * more, so that no update is lost and none is counted twice. */
+    rcu_assign_pointer(countmin[sw_id], next);
+    synchronize_rcu();
+    countmin_sketch_merge(next, old);
+    delete_countmin_sketch(old);
+    return 0;
+}
+
 static void extract_5_tuple(struct sw_flow_key* key, struct flow_key* tuple) {
     tuple->srcport = key->tp.src;
     tuple->dstport = key->tp.dst;
@@ -88,12 +119,17 @@ void my_label_sketch(char* dev_name, struct sk_buff* skb, struct sw_flow_key* ke
     //printk("on dev %s ", dev_name);
     if (dev_name[0] != 's') return;
     dev_id = dev_name[1] - '0';
-    if (dev_id < 0 || dev_id > 9 || dev_id > SW_COUNT) return;
+    if (dev_id < 0 || dev_id > 9 || dev_id >= SW_COUNT) return;
     //printk("(dev_id=%d): ", dev_id);
 
     extract_5_tuple(key, &tuple);
     hash = flow_key_hash(&tuple, 16);
-    if (switch_types[dev_id] == egress) {
+    if (switch_types[dev_id] == filter) {
+        /* Called under rcu_read_lock from the datapath, see
+         * resize_filter_sketch(). */
+        countmin_sketch_update(rcu_dereference(countmin[dev_id]), &tuple, 1);
+    }
+    else if (switch_types[dev_id] == egress) {
         //printk("update!\n");        
         //countmax_sketch_query(countmax[dev_id], &tuple);
         if (hash & 1) {
@@ -114,6 +150,31 @@ struct countmax_entry {
     struct flow_key key;
     elemtype value;
 };
+
+/* "count <switch id> <src ip> <dst ip> <src port> <dst port> <protocol>"
+ * sends back the filter sketch estimate for that flow as an elemtype. */
+static int query_filter_sketch(const char* cmd, elemtype* value) {
+    char srcip[16], dstip[16];
+    struct flow_key tuple;
+    unsigned short srcport, dstport, protocol;
+    int sw_id;
+
+    memset(&tuple, 0, sizeof(tuple));
+    if (sscanf(cmd, "%d %15s %15s %hu %hu %hu", &sw_id, srcip, dstip,
+               &srcport, &dstport, &protocol) != 6 ||
+        sw_id < 0 || sw_id >= SW_COUNT || switch_types[sw_id] != filter ||
+        !in4_pton(srcip, -1, (u8*)&tuple.srcip, -1, NULL) ||
+        !in4_pton(dstip, -1, (u8*)&tuple.dstip, -1, NULL))
+        return -EINVAL;
+    tuple.srcport = htons(srcport);
+    tuple.dstport = htons(dstport);
+    tuple.protocol = protocol;
+
+    rcu_read_lock();
+    *value = countmin_sketch_query(rcu_dereference(countmin[sw_id]), &tuple);
+    rcu_read_unlock();
+    return 0;
+}
 void print_ip(uint32_t ip) {
     printk("%d.%d.%d.%d", (ip) % 0x100, (ip / 0x100) % 0x100, (ip / 0x10000) % 0x100, ip / 0x1000000);
 }
@@ -250,6 +311,29 @@ static int sketch_report_listen(void* arg) {
         printk("receive message, length: %d\n", ret);
         if (strcmp(recvbuf, magic_command) == 0) {
             get_stat_and_send_back(client_sock);
+        } else if (strncmp(recvbuf, magic_resize, strlen(magic_resize)) == 0) {
+            /* "resize <switch id> <new width>" */
+            int sw_id, w;
+            const char* reply = magic_error;
+            if (sscanf(recvbuf + strlen(magic_resize), "%d %d", &sw_id, &w) == 2 &&
+                resize_filter_sketch(sw_id, w) == 0) {
+                reply = magic_finish;
+            }
+            memset(&msg, 0, sizeof(msg));
+            vec.iov_base = (void*)reply;
+            vec.iov_len = strlen(reply) + 1;
+            kernel_sendmsg(client_sock, &msg, &vec, 1, strlen(reply) + 1);
+        } else if (strncmp(recvbuf, magic_count, strlen(magic_count)) == 0) {
+            elemtype value;
+            memset(&msg, 0, sizeof(msg));
+            if (query_filter_sketch(recvbuf + strlen(magic_count), &value) == 0) {
+                vec.iov_base = &value;
+                vec.iov_len = sizeof(value);
+            } else {
+                vec.iov_base = (void*)magic_error;
+                vec.iov_len = strlen(magic_error) + 1;
+            }
+            kernel_sendmsg(client_sock, &msg, &vec, 1, vec.iov_len);
         }
         /*release socket*/
         sock_release(client_sock);
@@ -293,7 +377,7 @@ void my_label_sketch(char* dev_name, struct sk_buff* skb, struct sw_flow_key* ke
     //printk("tos = %u\n", tos);
     if (switch_types[dev_id] == filter) {
         if ((tos & 0x80) == 0) {
-            elemtype res = countmin_sketch_update(countmin[dev_id], &tuple, 1);
+            elemtype res = countmin_sketch_update(rcu_dereference(countmin[dev_id]), &tuple, 1);
             if (res < threshold) {
                 ip_header->tos = ip_header->tos | 0x80;  // put tag
                 // REMEMBER TO CALCULATE THE CHECKSUM!!!!!
@@ -6,6 +6,7 @@
 
 int init_filter_sketch(int w, int d, int filter_threshold);
 void clean_filter_sketch(void);
+int resize_filter_sketch(int sw_id, int w);
 void my_label_sketch(char* dev_name, struct sk_buff* skb, struct sw_flow_key* key);
 int sketch_report_init(void);
 int sketch_report_clean(void);
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2007-2015 Nicira, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/if_vlan.h>
+#include <linux/kernel.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/nsproxy.h>
+#include <linux/openvswitch.h>
+#include <linux/poll.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "datapath.h"
+#include "flow.h"
+#include "upcall_ring.h"
+
+#define UPCALL_RING_HASH_BITS	8
+#define UPCALL_RING_MAX_SLOTS	(1u << 16)
+#define UPCALL_RING_MAX_SLOT_SIZE (1u << 16)
+
+/* A ring bound to one Netlink port ID.  'producer' is the kernel's own copy
+ * of the index it publishes in 'hdr', so that a corrupted mapping cannot make
+ * the kernel write out of bounds.
+ */
+struct upcall_ring {
+	struct hlist_node node;		/* In 'upcall_rings', RCU. */
+	struct net *net;
+	u32 portid;
+	spinlock_t lock;		/* Serializes producers. */
+	u32 producer;
+	u32 n_slots;
+	u32 slot_size;
+	wait_queue_head_t wait;
+	struct ovs_upcall_ring_hdr *hdr; /* vmalloc_user()'d, mapped. */
+	void *slots;
+};
+
+static struct hlist_head upcall_rings[1 << UPCALL_RING_HASH_BITS];
+static DEFINE_MUTEX(upcall_rings_mutex);
+
+static struct hlist_head *upcall_ring_bucket(const struct net *net, u32 portid)
+{
+	return &upcall_rings[hash_32(portid ^ (u32)(unsigned long)net,
+				     UPCALL_RING_HASH_BITS)];
+}
+
+/* Called with RCU read lock or 'upcall_rings_mutex'. */
+static struct upcall_ring *upcall_ring_find(const struct net *net, u32 portid)
+{
+	struct upcall_ring *ring;
+
+	hlist_for_each_entry_rcu(ring, upcall_ring_bucket(net, portid), node)
+		if (ring->portid == portid && net_eq(ring->net, net))
+			return ring;
+
+	return NULL;
+}
+
+/* Returns true if the miss described by 'skb', 'key' and 'upcall_info' can be
+ * represented in a ring slot.
+ */
+static bool upcall_ring_eligible(const struct sk_buff *skb,
+				 const struct sw_flow_key *key,
+				 const struct dp_upcall_info *upcall_info,
+				 u32 cutlen)
+{
+	if (upcall_info->cmd != OVS_PACKET_CMD_MISS ||
+	    upcall_info->userdata || upcall_info->actions_len ||
+	    upcall_info->egress_tun_info || upcall_info->mru || cutlen)
+		return false;
+
+	if (skb_is_gso(skb) || skb->ip_summed == CHECKSUM_PARTIAL)
+		return false;
+
+	if (ovs_key_mac_proto(key) != MAC_PROTO_ETHERNET ||
+	    key->ct_orig_proto)
+		return false;
+
+	return !key->tun_proto ||
+	       (key->tun_proto == AF_INET && !key->tun_opts_len);
+}
+
+static void upcall_key_fill(struct ovs_upcall_key *ukey,
+			    const struct sw_flow_key *key)
+{
+	memset(ukey, 0, sizeof(*ukey));
+	ukey->in_port = key->phy.in_port;
+	ukey->priority = key->phy.priority;
+	ukey->skb_mark = key->phy.skb_mark;
+	ukey->recirc_id = key->recirc_id;
+	ukey->dp_hash = key->ovs_flow_hash;
+	ukey->ct_state = key->ct_state;
+	ukey->ct_mark = key->ct.mark;
+	ukey->ct_zone = key->ct_zone;
+	memcpy(&ukey->ct_labels, &key->ct.labels, sizeof(ukey->ct_labels));
+
+	if (key->tun_proto) {
+		const struct ip_tunnel_key *tun_key = &key->tun_key;
+
+		ukey->tun_present = 1;
+		if (tun_key->tun_flags & TUNNEL_KEY)
+			ukey->tun_flags |= OVS_UPCALL_TUN_F_KEY;
+		if (tun_key->tun_flags & TUNNEL_DONT_FRAGMENT)
+			ukey->tun_flags |= OVS_UPCALL_TUN_F_DONT_FRAGMENT;
+		if (tun_key->tun_flags & TUNNEL_CSUM)
+			ukey->tun_flags |= OVS_UPCALL_TUN_F_CSUM;
+		if (tun_key->tun_flags & TUNNEL_OAM)
+			ukey->tun_flags |= OVS_UPCALL_TUN_F_OAM;
+		ukey->tun_id = tun_key->tun_id;
+		ukey->tun_ipv4_src = tun_key->u.ipv4.src;
+		ukey->tun_ipv4_dst = tun_key->u.ipv4.dst;
+		ukey->tun_tp_src = tun_key->tp_src;
+		ukey->tun_tp_dst = tun_key->tp_dst;
+		ukey->tun_tos = tun_key->tos;
+		ukey->tun_ttl = tun_key->ttl;
+	}
+}
+
+/* Copies 'skb' to 'data', with its VLAN tag pushed back inside if it was
+ * offloaded.
+ */
+static void upcall_ring_copy_packet(const struct sk_buff *skb, u8 *data)
+{
+	if (skb_vlan_tag_present(skb)) {
+		__be16 *tag = (__be16 *)(data + 2 * ETH_ALEN);
+
+		skb_copy_bits(skb, 0, data, 2 * ETH_ALEN);
+		tag[0] = skb->vlan_proto;
+		tag[1] = htons(skb_vlan_tag_get(skb));
+		skb_copy_bits(skb, 2 * ETH_ALEN, data + 2 * ETH_ALEN + VLAN_HLEN,
+			      skb->len - 2 * ETH_ALEN);
+	} else {
+		skb_copy_bits(skb, 0, data, skb->len);
+	}
+}
+
+/**
+ * ovs_upcall_ring_queue - queue a miss upcall to a shared-memory ring
+ * @net: Network namespace of the datapath.
+ * @dp_ifindex: ifindex of the datapath's local port.
+ * @skb: The packet.
+ * @key: Its flow key.
+ * @upcall_info: Upcall metadata.
+ * @cutlen: Bytes to truncate from the end of the packet.
+ *
+ * Returns 0 if the upcall was written to the ring bound to
+ * @upcall_info->portid, otherwise a negative errno value, in which case the
+ * caller sends it over Netlink instead.  Must be called with rcu_read_lock.
+ */
+int ovs_upcall_ring_queue(struct net *net, int dp_ifindex,
+			  struct sk_buff *skb, const struct sw_flow_key *key,
+			  const struct dp_upcall_info *upcall_info,
+			  u32 cutlen)
+{
+	struct ovs_upcall_slot *slot;
+	struct upcall_ring *ring;
+	unsigned int len;
+	u32 prod;
+
+	if (!upcall_ring_eligible(skb, key, upcall_info, cutlen))
+		return -EOPNOTSUPP;
+
+	ring = upcall_ring_find(net, upcall_info->portid);
+	if (!ring)
+		return -ENOENT;
+
+	len = skb->len + (skb_vlan_tag_present(skb) ? VLAN_HLEN : 0);
+	if (len < 2 * ETH_ALEN || sizeof(*slot) + len > ring->slot_size)
+		return -EMSGSIZE;
+
+	spin_lock_bh(&ring->lock);
+	prod = ring->producer;
+	if (prod - smp_load_acquire(&ring->hdr->consumer) >= ring->n_slots) {
+		spin_unlock_bh(&ring->lock);
+		return -ENOBUFS;
+	}
+
+	slot = ring->slots + (prod & (ring->n_slots - 1)) * ring->slot_size;
+	slot->dp_ifindex = dp_ifindex;
+	slot->packet_len = len;
+	upcall_key_fill(&slot->key, key);
+	upcall_ring_copy_packet(skb, (u8 *)(slot + 1));
+
+	ring->producer = prod + 1;
+	smp_store_release(&ring->hdr->producer, prod + 1);
+	spin_unlock_bh(&ring->lock);
+
+	if (wq_has_sleeper(&ring->wait))
+		wake_up_interruptible_poll(&ring->wait, POLLIN | POLLRDNORM);
+
+	return 0;
+}
+
+static int upcall_ring_bind(struct file *file,
+			    const struct ovs_upcall_ring_bind __user *ubind)
+{
+	struct net *net = current->nsproxy->net_ns;
+	struct ovs_upcall_ring_bind bind;
+	struct upcall_ring *ring;
+	size_t size;
+	int err;
+
+	if (!ns_capable(net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&bind, ubind, sizeof(bind)))
+		return -EFAULT;
+
+	if (!bind.portid || !is_power_of_2(bind.n_slots) ||
+	    bind.n_slots > UPCALL_RING_MAX_SLOTS ||
+	    bind.slot_size < sizeof(struct ovs_upcall_slot) + ETH_HLEN ||
+	    bind.slot_size > UPCALL_RING_MAX_SLOT_SIZE ||
+	    bind.slot_size % 64)
+		return -EINVAL;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	size = OVS_UPCALL_RING_SLOTS_OFFSET +
+	       (size_t)bind.n_slots * bind.slot_size;
+	ring->hdr = vmalloc_user(PAGE_ALIGN(size));
+	if (!ring->hdr) {
+		err = -ENOMEM;
+		goto err_free_ring;
+	}
+
+	ring->net = get_net(net);
+	ring->portid = bind.portid;
+	ring->n_slots = bind.n_slots;
+	ring->slot_size = bind.slot_size;
+	ring->slots = (void *)ring->hdr + OVS_UPCALL_RING_SLOTS_OFFSET;
+	ring->hdr->n_slots = bind.n_slots;
+	ring->hdr->slot_size = bind.slot_size;
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->wait);
+
+	mutex_lock(&upcall_rings_mutex);
+	if (file->private_data) {
+		err = -EBUSY;
+		goto err_unlock;
+	}
+	if (upcall_ring_find(net, bind.portid)) {
+		err = -EADDRINUSE;
+		goto err_unlock;
+	}
+	hlist_add_head_rcu(&ring->node, upcall_ring_bucket(net, bind.portid));
+	file->private_data = ring;
+	mutex_unlock(&upcall_rings_mutex);
+
+	return 0;
+
+err_unlock:
+	mutex_unlock(&upcall_rings_mutex);
+	put_net(ring->net);
+	vfree(ring->hdr);
+err_free_ring:
+	kfree(ring);
+	return err;
+}
+
+static long upcall_ring_ioctl(struct file *file, unsigned int cmd,
+			      unsigned long arg)
+{
+	switch (cmd) {
+	case OVS_UPCALL_RING_IOC_BIND:
+		return upcall_ring_bind(file, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int upcall_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct upcall_ring *ring = READ_ONCE(file->private_data);
+
+	if (!ring)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->hdr, vma->vm_pgoff);
+}
+
+static unsigned int upcall_ring_poll(struct file *file, poll_table *wait)
+{
+	struct upcall_ring *ring = READ_ONCE(file->private_data);
+
+	if (!ring)
+		return POLLERR;
+
+	poll_wait(file, &ring->wait, wait);
+	if (READ_ONCE(ring->hdr->consumer) != READ_ONCE(ring->producer))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static int upcall_ring_release(struct inode *inode, struct file *file)
+{
+	struct upcall_ring *ring = file->private_data;
+
+	if (!ring)
+		return 0;
+
+	mutex_lock(&upcall_rings_mutex);
+	hlist_del_rcu(&ring->node);
+	mutex_unlock(&upcall_rings_mutex);
+
+	/* Wait for producers still writing to the ring. */
+	synchronize_rcu();
+	put_net(ring->net);
+	vfree(ring->hdr);
+	kfree(ring);
+	return 0;
+}
+
+static const struct file_operations upcall_ring_fops = {
+	.owner		= THIS_MODULE,
+	.unlocked_ioctl	= upcall_ring_ioctl,
+	.compat_ioctl	= upcall_ring_ioctl,
+	.mmap		= upcall_ring_mmap,
+	.poll		= upcall_ring_poll,
+	.release	= upcall_ring_release,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice upcall_ring_dev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= "openvswitch-upcall",
+	.fops	= &upcall_ring_fops,
+};
+
+int __init ovs_upcall_ring_init(void)
+{
+	return misc_register(&upcall_ring_dev);
+}
+
+void ovs_upcall_ring_exit(void)
+{
+	misc_deregister(&upcall_ring_dev);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2007-2015 Nicira, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#ifndef UPCALL_RING_H
+#define UPCALL_RING_H 1
+
+#include <linux/skbuff.h>
+#include <net/net_namespace.h>
+
+#include "datapath.h"
+#include "flow.h"
+
+int ovs_upcall_ring_queue(struct net *net, int dp_ifindex,
+			  struct sk_buff *skb, const struct sw_flow_key *key,
+			  const struct dp_upcall_info *upcall_info,
+			  u32 cutlen);
+
+int __init ovs_upcall_ring_init(void);
+void ovs_upcall_ring_exit(void);
+
+#endif /* upcall_ring.h */
@@ -39,8 +39,26 @@
 
 static struct vport_ops ovs_netdev_vport_ops;
 
-/* Must be called with rcu_read_lock. */
-void netdev_port_receive(struct sk_buff *skb, struct ip_tunnel_info *tun_info)
+/* Packets received by the rx handler are queued per CPU and handed to the
+ * datapath NETDEV_RX_BURST at a time, so that their flow lookups can be
+ * batched.  A burst that does not fill up is flushed by 'flush', which runs
+ * right after the current NET_RX softirq.  Queued packets reference their
+ * vport through OVS_CB(skb)->input_vport; ovs_netdev_detach_dev() purges
+ * them before the vport can go away.
+ */
+#define NETDEV_RX_BURST		FLOW_TBL_BATCH_MAX
+
+struct netdev_rx_burst {
+	struct sk_buff_head queue;
+	struct tasklet_struct flush;
+};
+
+static DEFINE_PER_CPU(struct netdev_rx_burst, netdev_rx_bursts);
+static struct sw_flow_key __percpu *netdev_rx_keys;
+
+/* Must be called with rcu_read_lock.  Returns NULL if 'skb' was consumed. */
+static struct sk_buff *netdev_port_prepare(struct sk_buff *skb,
+					   struct vport **vportp)
 {
 	struct vport *vport;
 
@@ -56,16 +74,106 @@ void netdev_port_receive(struct sk_buff *skb, struct ip_tunnel_info *tun_info)
 	 */
 	skb = skb_share_check(skb, GFP_ATOMIC);
 	if (unlikely(!skb))
-		return;
+		return NULL;
 
 	if (skb->dev->type == ARPHRD_ETHER) {
 		skb_push(skb, ETH_HLEN);
 		skb_postpush_rcsum(skb, skb->data, ETH_HLEN);
 	}
-	ovs_vport_receive(vport, skb, tun_info);
-	return;
+	*vportp = vport;
+	return skb;
 error:
 	kfree_skb(skb);
+	return NULL;
+}
+
+/* Must be called with rcu_read_lock. */
+void netdev_port_receive(struct sk_buff *skb, struct ip_tunnel_info *tun_info)
+{
+	struct vport *vport;
+
+	skb = netdev_port_prepare(skb, &vport);
+	if (skb)
+		ovs_vport_receive(vport, skb, tun_info);
+}
+
+/* Must be called with bottom halves disabled. */
+static void netdev_rx_burst_flush(struct netdev_rx_burst *burst)
+{
+	struct sk_buff *skbs[NETDEV_RX_BURST];
+	struct sk_buff *skb;
+	int n = 0;
+
+	/* The read-side section must cover the dequeue, see
+	 * netdev_rx_burst_purge().
+	 */
+	rcu_read_lock();
+	spin_lock(&burst->queue.lock);
+	while (n < NETDEV_RX_BURST && (skb = __skb_dequeue(&burst->queue)))
+		skbs[n++] = skb;
+	spin_unlock(&burst->queue.lock);
+
+	if (n)
+		ovs_vport_receive_batch(skbs, this_cpu_ptr(netdev_rx_keys), n);
+	rcu_read_unlock();
+}
+
+static void netdev_rx_burst_tasklet(unsigned long data)
+{
+	struct netdev_rx_burst *burst = (struct netdev_rx_burst *)data;
+
+	netdev_rx_burst_flush(burst);
+	if (!skb_queue_empty(&burst->queue))
+		tasklet_schedule(&burst->flush);
+}
+
+/* Called with rcu_read_lock and bottom-halves disabled. */
+static void netdev_port_receive_burst(struct sk_buff *skb)
+{
+	struct netdev_rx_burst *burst;
+	struct vport *vport;
+	u32 qlen;
+
+	skb = netdev_port_prepare(skb, &vport);
+	if (unlikely(!skb))
+		return;
+
+	OVS_CB(skb)->input_vport = vport;
+	burst = this_cpu_ptr(&netdev_rx_bursts);
+	spin_lock(&burst->queue.lock);
+	__skb_queue_tail(&burst->queue, skb);
+	qlen = skb_queue_len(&burst->queue);
+	spin_unlock(&burst->queue.lock);
+
+	if (qlen >= NETDEV_RX_BURST)
+		netdev_rx_burst_flush(burst);
+	else
+		tasklet_schedule(&burst->flush);
+}
+
+/* Drops the packets of 'vport' still waiting in a burst.  Called once the rx
+ * handler is unregistered, so no new ones can be queued.  A flush that
+ * already dequeued some of them holds rcu_read_lock until it is done, which
+ * the RCU-deferred vport free waits for.
+ */
+static void netdev_rx_burst_purge(struct vport *vport)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct netdev_rx_burst *burst = per_cpu_ptr(&netdev_rx_bursts,
+							    cpu);
+		struct sk_buff *skb, *tmp;
+
+		spin_lock_bh(&burst->queue.lock);
+		skb_queue_walk_safe(&burst->queue, skb, tmp) {
+			if (!vport || OVS_CB(skb)->input_vport == vport) {
+				__skb_unlink(skb, &burst->queue);
+				kfree_skb(skb);
+			}
+		}
+		spin_unlock_bh(&burst->queue.lock);
+	}
 }
 
 /* Called with rcu_read_lock and bottom-halves disabled. */
@@ -77,9 +185,13 @@ static rx_handler_result_t netdev_frame_hook(struct sk_buff **pskb)
 		return RX_HANDLER_PASS;
 
 #ifndef USE_UPSTREAM_TUNNEL
-	netdev_port_receive(skb, NULL);
+	netdev_port_receive_burst(skb);
 #else
-	netdev_port_receive(skb, skb_tunnel_info(skb));
+	/* Tunnel metadata is not carried through a burst. */
+	if (skb_tunnel_info(skb))
+		netdev_port_receive(skb, skb_tunnel_info(skb));
+	else
+		netdev_port_receive_burst(skb);
 #endif
 	return RX_HANDLER_CONSUMED;
 }
@@ -166,6 +278,7 @@ void ovs_netdev_detach_dev(struct vport *vport)
 	ASSERT_RTNL();
 	vport->dev->priv_flags &= ~IFF_OVS_DATAPATH;
 	netdev_rx_handler_unregister(vport->dev);
+	netdev_rx_burst_purge(vport);
 	netdev_upper_dev_unlink(vport->dev,
 				netdev_master_upper_dev_get(vport->dev));
 	dev_set_promiscuity(vport->dev, -1);
@@ -218,6 +331,43 @@ static struct vport_ops ovs_netdev_vport_ops = {
 	.send		= dev_queue_xmit,
 };
 
+/* The receive bursts outlive the vport type: they are only torn down after
+ * the datapaths, and with them every rx handler that could still queue
+ * packets, are gone.
+ */
+int __init ovs_netdev_rx_init(void)
+{
+	int cpu;
+
+	netdev_rx_keys = __alloc_percpu(sizeof(struct sw_flow_key) *
+					NETDEV_RX_BURST,
+					__alignof__(struct sw_flow_key));
+	if (!netdev_rx_keys)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct netdev_rx_burst *burst = per_cpu_ptr(&netdev_rx_bursts,
+							    cpu);
+
+		skb_queue_head_init(&burst->queue);
+		tasklet_init(&burst->flush, netdev_rx_burst_tasklet,
+			     (unsigned long)burst);
+	}
+
+	return 0;
+}
+
+/* Must be called once no rx handler of ours is registered any more. */
+void ovs_netdev_rx_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		tasklet_kill(&per_cpu_ptr(&netdev_rx_bursts, cpu)->flush);
+	netdev_rx_burst_purge(NULL);
+	free_percpu(netdev_rx_keys);
+}
+
 int __init ovs_netdev_init(void)
 {
 	return ovs_vport_ops_register(&ovs_netdev_vport_ops);
@@ -31,6 +31,8 @@ void ovs_netdev_detach_dev(struct vport *);
 
 int __init ovs_netdev_init(void);
 void ovs_netdev_exit(void);
+int __init ovs_netdev_rx_init(void);
+void ovs_netdev_rx_exit(void);
 
 void ovs_netdev_tunnel_destroy(struct vport *vport);
 
@@ -190,6 +190,7 @@ struct vport *ovs_vport_alloc(int priv_size, const struct vport_ops *ops,
 	vport->port_no = parms->port_no;
 	vport->ops = ops;
 	INIT_HLIST_NODE(&vport->dp_hash_node);
+	spin_lock_init(&vport->upcall_limiter.lock);
 
 	if (ovs_vport_set_upcall_portids(vport, parms->upcall_portids)) {
 		kfree(vport);
@@ -413,6 +414,60 @@ int ovs_vport_set_upcall_portids(struct vport *vport, const struct nlattr *ids)
 	return 0;
 }
 
+/* Burst of upcalls, in tenths of a second at 'rate'. */
+#define UPCALL_BURST_DIV	10
+
+/**
+ *	ovs_vport_set_upcall_rate - set the miss upcall rate limit of @vport.
+ *
+ * @vport: vport to modify.
+ * @rate: new limit in upcalls per second, 0 for no limit.
+ *
+ * Must be called with ovs_mutex.
+ */
+void ovs_vport_set_upcall_rate(struct vport *vport, u32 rate)
+{
+	struct vport_upcall_limiter *lim = &vport->upcall_limiter;
+
+	spin_lock_bh(&lim->lock);
+	lim->tokens = (u64)(rate / UPCALL_BURST_DIV + 1) * HZ;
+	lim->last = jiffies;
+	WRITE_ONCE(lim->rate, rate);
+	spin_unlock_bh(&lim->lock);
+}
+
+/**
+ *	ovs_vport_upcall_allowed - take a miss upcall token from @vport.
+ *
+ * @vport: vport the missed packet was received on.
+ *
+ * Returns true if the upcall is within the rate limit of @vport.  Must be
+ * called with bottom halves disabled.
+ */
+bool ovs_vport_upcall_allowed(struct vport *vport)
+{
+	struct vport_upcall_limiter *lim = &vport->upcall_limiter;
+	u32 rate = READ_ONCE(lim->rate);
+	unsigned long now, elapsed;
+	bool allowed;
+
+	if (!rate)
+		return true;
+
+	spin_lock(&lim->lock);
+	now = jiffies;
+	elapsed = min_t(unsigned long, now - lim->last, HZ);
+	lim->tokens = min_t(u64, lim->tokens + (u64)elapsed * rate,
+			    (u64)(rate / UPCALL_BURST_DIV + 1) * HZ);
+	lim->last = now;
+	allowed = lim->tokens >= HZ;
+	if (allowed)
+		lim->tokens -= HZ;
+	spin_unlock(&lim->lock);
+
+	return allowed;
+}
+
 /**
  *	ovs_vport_get_upcall_portids - get the upcall_portids of @vport.
  *
@@ -468,20 +523,10 @@ u32 ovs_vport_find_upcall_portid(const struct vport *vport, struct sk_buff *skb)
 	return ids->ids[ids_index];
 }
 
-/**
- *	ovs_vport_receive - pass up received packet to the datapath for processing
- *
- * @vport: vport that received the packet
- * @skb: skb that was received
- * @tun_key: tunnel (if any) that carried packet
- *
- * Must be called with rcu_read_lock.  The packet cannot be shared and
- * skb->data should point to the Ethernet header.
- */
-int ovs_vport_receive(struct vport *vport, struct sk_buff *skb,
-		      const struct ip_tunnel_info *tun_info)
+static int vport_receive_key(struct vport *vport, struct sk_buff *skb,
+			     const struct ip_tunnel_info *tun_info,
+			     struct sw_flow_key *key)
 {
-	struct sw_flow_key key;
 	int error;
 
 	OVS_CB(skb)->input_vport = vport;
@@ -499,15 +544,71 @@ int ovs_vport_receive(struct vport *vport, struct sk_buff *skb,
 	ovs_skb_init_inner_protocol(skb);
 	skb_clear_ovs_gso_cb(skb);
 	/* Extract flow from 'skb' into 'key'. */
-	error = ovs_flow_key_extract(tun_info, skb, &key);
-	if (unlikely(error)) {
+	error = ovs_flow_key_extract(tun_info, skb, key);
+	if (unlikely(error))
 		kfree_skb(skb);
+	return error;
+}
+
+/**
+ *	ovs_vport_receive - pass up received packet to the datapath for processing
+ *
+ * @vport: vport that received the packet
+ * @skb: skb that was received
+ * @tun_key: tunnel (if any) that carried packet
+ *
+ * Must be called with rcu_read_lock.  The packet cannot be shared and
+ * skb->data should point to the Ethernet header.
+ */
+int ovs_vport_receive(struct vport *vport, struct sk_buff *skb,
+		      const struct ip_tunnel_info *tun_info)
+{
+	struct sw_flow_key key;
+	int error;
+
+	error = vport_receive_key(vport, skb, tun_info, &key);
+	if (unlikely(error))
 		return error;
-	}
 	ovs_dp_process_packet(skb, &key);
 	return 0;
 }
 
+/**
+ *	ovs_vport_receive_batch - pass up a burst of received packets
+ *
+ * @skbs: packets, each with OVS_CB(skb)->input_vport set to its vport
+ * @keys: room for at least @n flow keys
+ * @n: number of packets, at most %FLOW_TBL_BATCH_MAX
+ *
+ * Like ovs_vport_receive() without tunnel metadata.  Runs of packets that
+ * belong to the same datapath share a batched flow lookup.  Must be called
+ * with rcu_read_lock and bottom halves disabled.
+ */
+void ovs_vport_receive_batch(struct sk_buff **skbs, struct sw_flow_key *keys,
+			     int n)
+{
+	struct datapath *dp = NULL;
+	int i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		struct sk_buff *skb = skbs[i];
+		struct vport *vport = OVS_CB(skb)->input_vport;
+
+		if (m && vport->dp != dp) {
+			ovs_dp_process_packet_batch(dp, skbs, keys, m);
+			m = 0;
+		}
+		dp = vport->dp;
+
+		if (vport_receive_key(vport, skb, NULL, &keys[m]))
+			continue;
+		skbs[m++] = skb;
+	}
+
+	if (m)
+		ovs_dp_process_packet_batch(dp, skbs, keys, m);
+}
+
 static unsigned int packet_length(const struct sk_buff *skb,
 				  struct net_device *dev)
 {
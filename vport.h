@@ -51,6 +51,8 @@ int ovs_vport_get_options(const struct vport *, struct sk_buff *);
 int ovs_vport_set_upcall_portids(struct vport *, const struct nlattr *pids);
 int ovs_vport_get_upcall_portids(const struct vport *, struct sk_buff *);
 u32 ovs_vport_find_upcall_portid(const struct vport *, struct sk_buff *);
+void ovs_vport_set_upcall_rate(struct vport *, u32 rate);
+bool ovs_vport_upcall_allowed(struct vport *);
 
 /**
  * struct vport_portids - array of netlink portids of a vport.
@@ -68,11 +70,26 @@ struct vport_portids {
 	u32 ids[];
 };
 
+/**
+ * struct vport_upcall_limiter - token bucket for the miss upcalls of a vport.
+ * @lock: Protects @tokens and @last.
+ * @rate: Upcalls per second, 0 if unlimited.
+ * @tokens: Available upcalls, scaled by HZ.
+ * @last: Time of the last refill, in jiffies.
+ */
+struct vport_upcall_limiter {
+	spinlock_t lock;
+	u32 rate;
+	u64 tokens;
+	unsigned long last;
+};
+
 /**
  * struct vport - one port within a datapath
  * @dev: Pointer to net_device.
  * @dp: Datapath to which this port belongs.
  * @upcall_portids: RCU protected 'struct vport_portids'.
+ * @upcall_limiter: Limits the rate of miss upcalls for received packets.
  * @port_no: Index into @dp's @ports array.
  * @hash_node: Element in @dev_table hash table in vport.c.
  * @dp_hash_node: Element in @datapath->ports hash table in datapath.c.
@@ -84,6 +101,7 @@ struct vport {
 	struct net_device *dev;
 	struct datapath	*dp;
 	struct vport_portids __rcu *upcall_portids;
+	struct vport_upcall_limiter upcall_limiter;
 	u16 port_no;
 
 	struct hlist_node hash_node;
@@ -186,6 +204,8 @@ static inline struct vport *vport_from_priv(void *priv)
 
 int ovs_vport_receive(struct vport *, struct sk_buff *,
 		      const struct ip_tunnel_info *);
+void ovs_vport_receive_batch(struct sk_buff **skbs, struct sw_flow_key *keys,
+			     int n);
 
 static inline const char *ovs_vport_name(struct vport *vport)
 {